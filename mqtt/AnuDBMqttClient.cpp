@@ -282,6 +282,7 @@ public:
 		if (!running_) return;
 		running_ = false;
 		// Signal workers to stop gracefully
+		preparedQueries_.clear();
 		collMap_.clear();
 		Status status = db_->close();
 		if (!status.ok()) {
@@ -377,6 +378,7 @@ private:
 					resp["message"] = status.message();
 				}
 				else {
+					preparedQueries_.erase(collectionName);
 					collMap_.erase(collectionName);
 					resp["status"] = "success";
 					resp["message"] = collectionName + " collection deleted successfully in AnuDB.";
@@ -582,6 +584,43 @@ private:
 			resp["message"] = std::string("Exception: ") + e.what();
 		}
 	}
+	void handle_aggregate(json& req, json& resp) {
+		try {
+			std::string collectionName = req["collection_name"];
+			if (db_) {
+				if (collMap_.count(collectionName) == 0) {
+
+					Collection* coll = db_->getCollection(collectionName);
+					if (coll != NULL) {
+						collMap_[collectionName] = coll;
+					}
+					else {
+						resp["status"] = "error";
+						resp["message"] = "Collection :" + collectionName + " is not found";
+						return;
+					}
+				}
+				Collection* coll = collMap_[collectionName];
+				json query = req.contains("query") ? req["query"] : json::object();
+				json result;
+				// With group_by the aggregates are computed per value of that field
+				Status status = req.contains("group_by") ?
+					coll->group(query, req["group_by"].get<std::string>(), req["aggregates"], result) :
+					coll->aggregate(query, req["aggregates"], result);
+				if (!status.ok()) {
+					resp["status"] = "error";
+					resp["message"] = status.message();
+					return;
+				}
+				resp["collection"] = collectionName;
+				resp["result"] = result;
+			}
+		}
+		catch (const std::exception& e) {
+			resp["status"] = "error";
+			resp["message"] = std::string("Exception: ") + e.what();
+		}
+	}
 	void handle_read_document(json& req, json& resp, Work* work, std::string& response_topic) {
 		try {
 			std::string collectionName = req["collection_name"];
@@ -618,6 +657,19 @@ private:
 						limit = req["limit"];
 					}
 					auto cursor = coll->createCursor();
+					// Token of the previous page, the cursor seeks straight past its last document
+					std::string lastId;
+					if (req.contains("continuation")) {
+						if (!QueryCursor::decodeToken(req["continuation"].get<std::string>(), &lastId)) {
+							resp["status"] = "error";
+							resp["message"] = "Invalid continuation token";
+							return;
+						}
+						cursor->seek(lastId);
+						if (cursor->isValid() && cursor->currentId() == lastId) {
+							cursor->next();
+						}
+					}
 					uint64_t cnt = 0;
 					while (cursor->isValid() && cnt < limit) {
 						Document doc;
@@ -631,9 +683,13 @@ private:
 						else {
 							std::cerr << "Error reading document: " << status.message() << std::endl;
 						}
+						lastId = cursor->currentId();
 						cnt++;
 						cursor->next();
 					}
+					if (cursor->isValid()) {
+						resp["continuation"] = QueryCursor::encodeToken(lastId);
+					}
 				}
 			}
 		}
@@ -695,7 +751,14 @@ private:
 				}
 				Collection* coll = collMap_[collectionName];
 				std::string field = req["field"];;
-				Status status = coll->createIndex(field);
+				json options = json::object();
+				if (req.contains("include")) {
+					options["include"] = req["include"];
+				}
+				if (req.contains("multikey")) {
+					options["multikey"] = req["multikey"];
+				}
+				Status status = coll->createIndex(field, options);
 				if (!status.ok()) {
 					resp["status"] = "error while creating index in collection " + collectionName;
 					resp["message"] = status.message();
@@ -760,20 +823,77 @@ private:
 				std::string requestId = req["request_id"];
 				json query = req["query"];
 				Collection* coll = collMap_[collectionName];
-				std::vector<std::string> docIds;
-				docIds = coll->findDocument(query);
-
-				for (const std::string& docId : docIds) {
-					Document doc;
-					Status status = coll->readDocument(docId, doc);
+				// Optional paging, applied on the index before documents are read
+				QueryOptions options;
+				if (req.contains("skip")) {
+					options.skip = req["skip"].get<uint64_t>();
+				}
+				if (req.contains("limit")) {
+					options.limit = req["limit"].get<uint64_t>();
+				}
+				if (req.contains("projection")) {
+					options.projection = req["projection"].get<std::vector<std::string>>();
+				}
+				// {"field": "asc" or "desc"}, with a limit only the first matches in that order are read
+				if (req.contains("sort") && req["sort"].is_object() && !req["sort"].empty()) {
+					options.sortField = req["sort"].begin().key();
+					options.sortDescending = req["sort"].begin().value() != "asc";
+				}
+				// Token returned with the previous page of the same query
+				if (req.contains("continuation")) {
+					options.continuation = req["continuation"].get<std::string>();
+				}
+				std::unique_ptr<QueryCursor> cursor;
+				Status status;
+				if (req.contains("params")) {
+					// {"$param": name} operands of the query take their values from params, the query is
+					// parsed once and kept for the next request of the same shape
+					auto& prepared = preparedQueries_[collectionName];
+					std::string key = query.dump();
+					auto it = prepared.find(key);
+					if (it == prepared.end()) {
+						if (prepared.size() >= 256) {
+							prepared.clear();
+						}
+						std::unique_ptr<PreparedQuery> preparedQuery;
+						status = coll->prepare(query, preparedQuery);
+						if (status.ok()) {
+							it = prepared.emplace(key, std::move(preparedQuery)).first;
+						}
+					}
+					for (auto param = req["params"].begin(); status.ok() && param != req["params"].end(); param++) {
+						status = it->second->bind(param.key(), param.value());
+					}
 					if (status.ok()) {
-						std::string tmp = (std::string)doc.data().dump();
-						send_response(tmp, work, response_topic);
-						//std::cout << doc.data().dump() << std::endl;
+						status = it->second->find(cursor, options);
 					}
-					else {
-						std::cerr << "Failed to read document " << docId << ": " << status.message() << std::endl;
+				}
+				else {
+					status = coll->find(query, cursor, options);
+				}
+				if (!status.ok()) {
+					resp["status"] = "error";
+					resp["message"] = status.message();
+					return;
+				}
+				// Documents are sent as they are read, without collecting the whole result first
+				for (; cursor->isValid(); cursor->next()) {
+					Document doc;
+					status = cursor->current(&doc);
+					if (!status.ok()) {
+						std::cerr << "Failed to read document " << cursor->currentId() << ": " << status.message() << std::endl;
+						continue;
 					}
+					std::string tmp = (std::string)doc.data().dump();
+					send_response(tmp, work, response_topic);
+				}
+				// A full page returns the token of its last match, the next request resumes after it
+				std::string continuation = cursor->continuationToken();
+				if (!continuation.empty()) {
+					resp["continuation"] = continuation;
+				}
+				if (!cursor->status().ok()) {
+					std::cerr << "Failed to find documents: " << cursor->status().message() << std::endl;
 				}
 			}
 		}
@@ -828,6 +948,9 @@ private:
 				handle_find_documents(req, resp, wrk, response_topic);
 				resp["status"] = "success";
 			}
+			else if (cmd == "aggregate") {
+				handle_aggregate(req, resp);
+			}
 			else if (cmd == "export_collection") {
 				handle_export_collection(req, resp);
 			}
@@ -955,6 +1078,8 @@ private:
 	char* certp_;
 	char* keyp_;
 	std::unordered_map<std::string, Collection*> collMap_;
+	// Queries with parameters prepared per collection, keyed by their filter
+	std::unordered_map<std::string, std::unordered_map<std::string, std::unique_ptr<PreparedQuery>>> preparedQueries_;
 };
 
 volatile sig_atomic_t running = 1;
@@ -966,12 +1091,14 @@ int main(int argc, char* argv[]) {
 	bool tls_enabled = false;
 	std::string broker_url = "", database_name = "", username = "", password = "";
 	std::string cert = "", key = "", pass = "", cacert = "";
+	size_t memory_budget = 0;
 
 	// Check for minimum number of arguments (at least program name)
 	if (argc < 2) {
 		std::cerr << "Usage: " << argv[0] << " --broker_url <url> --database_name <name> "
 			<< "[--username <user>] [--password <pass>] "
-			<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>]"
+			<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>] "
+			<< "[--memory_budget_mb <mb>]"
 			<< std::endl;
 		return 1;
 	}
@@ -1008,11 +1135,15 @@ int main(int argc, char* argv[]) {
 			pass = argv[++i];
 			tls_enabled = true;
 		}
+		else if (arg == "--memory_budget_mb" && i + 1 < argc) {
+			memory_budget = static_cast<size_t>(std::stoul(argv[++i])) << 20;
+		}
 		else {
 			std::cerr << "Unknown option: " << arg << std::endl;
 			std::cerr << "Usage: " << argv[0] << " --broker_url <url> --database_name <name> "
 				<< "[--username <user>] [--password <pass>] "
-				<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>]"
+				<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>] "
+				<< "[--memory_budget_mb <mb>]"
 				<< std::endl;
 			return 1;
 		}
@@ -1023,7 +1154,8 @@ int main(int argc, char* argv[]) {
 		std::cerr << "Error: Required parameters missing" << std::endl;
 		std::cerr << "Usage: " << argv[0] << " --broker_url <url> --database_name <name> "
 			<< "[--username <user>] [--password <pass>] "
-			<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>]"
+			<< "[--tls_cacert <path>] [--tls_cert <path>] [--tls_key <path>] [--tls_pass <pass>] "
+			<< "[--memory_budget_mb <mb>]"
 			<< std::endl;
 		return 1;
 	}
@@ -1032,7 +1164,7 @@ int main(int argc, char* argv[]) {
 	signal(SIGTERM, signal_handler);
 
 	try {
-		std::unique_ptr<Database> db = std::make_unique<Database>(database_name);
+		std::unique_ptr<Database> db = std::make_unique<Database>(database_name, memory_budget);
 		std::string client_id = "anudb_mqtt_server_" + std::to_string(time(nullptr));
 
 		AnuDBMqttClient mqtt_client(
@@ -1,9 +1,197 @@
 #include "Collection.h"
 
+#include <cstdio>
+#include <unordered_map>
+
 using namespace anudb;
 
+namespace {
+	// Add the top level field names of a document to fields
+	void collectFields(const json& data, std::set<std::string>& fields) {
+		for (auto it = data.begin(); it != data.end(); it++) {
+			fields.insert(it.key());
+		}
+	}
+
+	// total += value unless the result leaves the int64 range
+	bool addInteger(int64_t& total, int64_t value) {
+		if ((value > 0 && total > INT64_MAX - value) || (value < 0 && total < INT64_MIN - value)) {
+			return false;
+		}
+		total += value;
+		return true;
+	}
+}
+
 // Create a document in the collection
 Status  Collection::createDocument(Document& doc) {
+	// The document it overwrites is read under the same lock as updateDocument, so their index changes do not interleave
+	std::lock_guard<std::mutex> lock(collection_mutex_);
+	Document previous;
+	bool overwrite = false;
+	Status status = readOverwritten(doc.id(), previous, overwrite);
+	if (!status.ok()) {
+		return status;
+	}
+	// Document and its index entries are committed together
+	WriteBatch batch(engine_);
+	status = addDocumentToBatch(doc, *engine_->getIndexSet(name_), batch, overwrite ? &previous : nullptr);
+	if (!status.ok()) {
+		return status;
+	}
+	// Store in the database
+	status = engine_->write(batch);
+	if (queryCache_.enabled()) {
+		// Fields only the overwritten document had change too
+		std::set<std::string> fields;
+		collectFields(doc.data(), fields);
+		if (overwrite) {
+			collectFields(previous.data(), fields);
+		}
+		invalidateQueryCache(fields);
+	}
+	return status;
+}
+
+Status Collection::insertMany(std::vector<Document>& docs, std::vector<Status>& statuses, size_t batchSize) {
+	statuses.assign(docs.size(), Status::OK());
+	if (batchSize == 0) {
+		return Status::InvalidArgument("Batch size must be greater than zero");
+	}
+	std::lock_guard<std::mutex> lock(collection_mutex_);
+	std::shared_ptr<const std::set<std::string>> indexes = engine_->getIndexSet(name_);
+	WriteBatch batch(engine_);
+	Status result;
+	size_t groupStart = 0;
+	bool caching = queryCache_.enabled();
+	std::set<std::string> fields;
+	// Documents of the group not committed yet by id, a later one with the same id overwrites them
+	std::unordered_map<std::string, size_t> pending;
+	for (size_t i = 0; i < docs.size(); i++) {
+		Document previous;
+		bool overwrite = false;
+		auto written = docs[i].id().empty() ? pending.end() : pending.find(docs[i].id());
+		if (written != pending.end()) {
+			previous = docs[written->second];
+			overwrite = true;
+		}
+		else {
+			statuses[i] = readOverwritten(docs[i].id(), previous, overwrite);
+		}
+		if (statuses[i].ok()) {
+			statuses[i] = addDocumentToBatch(docs[i], *indexes, batch, overwrite ? &previous : nullptr);
+		}
+		if (statuses[i].ok()) {
+			pending[docs[i].id()] = i;
+		}
+		if (caching) {
+			collectFields(docs[i].data(), fields);
+			if (overwrite) {
+				collectFields(previous.data(), fields);
+			}
+		}
+		// Commit one group of documents with a single write
+		if (i + 1 - groupStart == batchSize || i + 1 == docs.size()) {
+			Status status = engine_->write(batch);
+			if (!status.ok()) {
+				for (size_t j = groupStart; j <= i; j++) {
+					if (statuses[j].ok()) {
+						statuses[j] = status;
+					}
+				}
+				result = status;
+			}
+			batch.clear();
+			pending.clear();
+			groupStart = i + 1;
+		}
+	}
+	if (caching) {
+		invalidateQueryCache(fields);
+	}
+	return result;
+}
+
+Status Collection::deleteDocument(const std::string& id) {
+	// Index keys come from the stored document, it must not change before the removals are committed
+	std::lock_guard<std::mutex> lock(collection_mutex_);
+	Document doc;
+	Status status = readDocument(id, doc);
+	if (!status.ok()) {
+		std::cerr << "Unable to read document for id : " << id << " " << status.message() << std::endl;
+		return status;
+	}
+	WriteBatch batch(engine_);
+	status = removeDocumentFromBatch(doc, *engine_->getIndexSet(name_), batch);
+	if (!status.ok()) {
+		return status;
+	}
+	status = engine_->write(batch);
+	if (queryCache_.enabled()) {
+		std::set<std::string> fields;
+		collectFields(doc.data(), fields);
+		invalidateQueryCache(fields);
+	}
+	return status;
+}
+
+Status Collection::deleteMany(const std::vector<std::string>& ids, std::vector<Status>& statuses, size_t batchSize) {
+	statuses.assign(ids.size(), Status::OK());
+	if (batchSize == 0) {
+		return Status::InvalidArgument("Batch size must be greater than zero");
+	}
+	std::lock_guard<std::mutex> lock(collection_mutex_);
+	std::shared_ptr<const std::set<std::string>> indexes = engine_->getIndexSet(name_);
+	WriteBatch batch(engine_);
+	Status result;
+	size_t groupStart = 0;
+	bool caching = queryCache_.enabled();
+	std::set<std::string> fields;
+	for (size_t i = 0; i < ids.size(); i++) {
+		// Index keys are derived from the stored document, so it has to be read first
+		Document doc;
+		statuses[i] = readDocument(ids[i], doc);
+		if (statuses[i].ok()) {
+			statuses[i] = removeDocumentFromBatch(doc, *indexes, batch);
+			if (caching) {
+				collectFields(doc.data(), fields);
+			}
+		}
+		if (i + 1 - groupStart == batchSize || i + 1 == ids.size()) {
+			Status status = engine_->write(batch);
+			if (!status.ok()) {
+				for (size_t j = groupStart; j <= i; j++) {
+					if (statuses[j].ok()) {
+						statuses[j] = status;
+					}
+				}
+				result = status;
+			}
+			batch.clear();
+			groupStart = i + 1;
+		}
+	}
+	if (caching) {
+		invalidateQueryCache(fields);
+	}
+	return result;
+}
+
+Status Collection::readOverwritten(const std::string& id, Document& previous, bool& found) {
+	found = false;
+	// A generated id is new
+	if (id.empty()) {
+		return Status::OK();
+	}
+	Status status = readDocument(id, previous);
+	if (status.isNotFound()) {
+		return Status::OK();
+	}
+	found = status.ok();
+	return status;
+}
+
+Status Collection::addDocumentToBatch(Document& doc, const std::set<std::string>& indexes, WriteBatch& batch, const Document* previous) {
 	// Check if document has an ID, if not generate one
 	if (doc.id().empty()) {
 		doc.setId(generateId());
@@ -13,9 +201,30 @@ Status  Collection::createDocument(Document& doc) {
 	if (!doc.hasField("_id")) {
 		doc.setValue("_id", doc.id());
 	}
-	for (std::string index : engine_->getIndexNames(name_)) {
+	for (const std::string& index : indexes) {
+		bool elements = isMultikey(index);
+		std::vector<std::string> keys;
 		if (hasIndexField(doc.data(), index)) {
-			Status status = insertIfIndexFieldExists(doc, index);
+			keys = documentIndexKeys(doc.data(), index, doc.id(), elements);
+			std::sort(keys.begin(), keys.end());
+		}
+		// Entries of the overwritten document that the new one does not have are removed, as in updateDocument
+		if (previous != nullptr && hasIndexField(previous->data(), index)) {
+			for (const std::string& key : documentIndexKeys(previous->data(), index, doc.id(), elements)) {
+				if (!std::binary_search(keys.begin(), keys.end(), key)) {
+					Status status = batch.remove(getIndexCfName(index), key);
+					if (!status.ok()) {
+						return status;
+					}
+				}
+			}
+		}
+		if (keys.empty()) {
+			continue;
+		}
+		std::string value = indexEntryValue(doc, index);
+		for (const std::string& key : keys) {
+			Status status = batch.putIndex(getIndexCfName(index), key, value);
 			if (!status.ok()) {
 				return status;
 			}
@@ -23,26 +232,19 @@ Status  Collection::createDocument(Document& doc) {
 	}
 	// Serialize the document
 	auto serialized = doc.to_msgpack();
-	// Store in the database
-	return engine_->put(name_, doc.id(), serialized);
+	return batch.put(name_, doc.id(), serialized);
 }
 
-Status Collection::deleteDocument(const std::string& id) {
-	Document doc;
-	Status status = readDocument(id, doc);
-	if (!status.ok()) {
-		std::cerr << "Unable to read document for id : " << id << " " << status.message() << std::endl;
-		return status;
-	}
-	for (std::string index : engine_->getIndexNames(name_)) {
+Status Collection::removeDocumentFromBatch(const Document& doc, const std::set<std::string>& indexes, WriteBatch& batch) {
+	for (const std::string& index : indexes) {
 		if (hasIndexField(doc.data(), index)) {
-			Status status = deleteIfIndexFieldExists(doc, index);
+			Status status = deleteIfIndexFieldExists(doc, index, batch);
 			if (!status.ok()) {
 				return status;
 			}
 		}
 	}
-	return engine_->remove(name_, id);
+	return batch.remove(name_, doc.id());
 }
 
 std::string Collection::getIndexCfName(const std::string& index) {
@@ -57,45 +259,114 @@ Status Collection::getIndex(std::vector<std::string>& indexList) const {
 	return Status::OK();
 }
 
-Status Collection::createIndex(const std::string& index) {
-	Status status = engine_->createCollection(getIndexCfName(index));
+Status Collection::createIndex(const std::string& index, const json& options) {
+	std::vector<std::string> include;
+	if (options.contains("include")) {
+		if (!options["include"].is_array()) {
+			return Status::InvalidArgument("include expects an array of field names");
+		}
+		for (const json& field : options["include"]) {
+			if (!field.is_string()) {
+				return Status::InvalidArgument("include expects an array of field names");
+			}
+			include.push_back(field.get<std::string>());
+		}
+	}
+	bool multikey = false;
+	if (options.contains("multikey")) {
+		if (!options["multikey"].is_boolean()) {
+			return Status::InvalidArgument("multikey expects true or false");
+		}
+		multikey = options["multikey"].get<bool>();
+		if (multikey && index.find(',') != std::string::npos) {
+			return Status::InvalidArgument("A compound index cannot be multikey: " + index);
+		}
+	}
+	Status status;
+	{
+		// Writers take the index set under collection_mutex_, once it holds the index they keep its entries
+		std::lock_guard<std::mutex> lock(collection_mutex_);
+		status = engine_->createIndex(name_, index, include, multikey);
+	}
+	if (!status.ok()) {
+		return status;
+	}
+	status = backfillIndex(index);
+	if (!status.ok()) {
+		return status;
+	}
+	queryCache_.clear();
+	std::cout << "Index created successfully!!!\n";
+	return Status::OK();
+}
+
+Status Collection::createIndex(std::initializer_list<std::string> fields) {
+	std::string index;
+	for (const std::string& field : fields) {
+		if (field.empty() || field.find(',') != std::string::npos) {
+			return Status::InvalidArgument("Invalid index field: " + field);
+		}
+		index += (index.empty() ? "" : ",") + field;
+	}
+	if (index.empty()) {
+		return Status::InvalidArgument("Index needs at least one field");
+	}
+	return createIndex(index);
+}
+
+Status Collection::backfillIndex(const std::string& index) {
+	Status status;
 	try {
+		// Existing documents are indexed in batches to keep WAL appends low. Each batch reads its documents
+		// again and is committed under collection_mutex_, so the entry of a version a concurrent write
+		// replaced after the cursor listed it is never added
+		const size_t batchSize = 1000;
 		auto cursor = createCursor();
+		std::vector<std::string> ids;
 		while (cursor->isValid()) {
-			Document doc;
-			Status status = cursor->current(&doc);
-
-			if (status.ok()) {
+			ids.clear();
+			for (; cursor->isValid() && ids.size() < batchSize; cursor->next()) {
+				ids.push_back(cursor->currentId());
+			}
+			std::lock_guard<std::mutex> lock(collection_mutex_);
+			std::vector<Document> docs;
+			status = readDocuments(ids, docs);
+			if (!status.ok()) {
+				std::cerr << "Error reading document: " << status.message() << std::endl;
+				return status;
+			}
+			WriteBatch batch(engine_);
+			for (const Document& doc : docs) {
 				if (hasIndexField(doc.data(), index)) {
-					Status status = insertIfIndexFieldExists(doc, index);
+					status = insertIfIndexFieldExists(doc, index, batch);
 					if (!status.ok()) {
 						return status;
 					}
 				}
 			}
-			else {
-				std::cerr << "Error reading document: " << status.message() << std::endl;
+			status = engine_->write(batch);
+			if (!status.ok()) {
 				return status;
 			}
-
-			cursor->next();
 		}
 	}
 	catch (const std::exception& e) {
 		return Status::Corruption("Failed to deserialize document: " + std::string(e.what()));
 	}
-	std::cout << "Index created successfully!!!\n";
 	return Status::OK();
 }
 
 // Remove an index
 Status Collection::deleteIndex(const std::string& index) {
-	return engine_->dropCollection(getIndexCfName(index));
+	Status status = engine_->dropIndex(name_, index);
+	queryCache_.clear();
+	return status;
 }
 
 // Read a document from the collection
 Status Collection::readDocument(const std::string& id, Document& doc) {
-	std::vector<uint8_t> serialized;
+	// Decode straight from the pinned block cache data
+	rocksdb::PinnableSlice serialized;
 	Status status = engine_->get(name_, id, &serialized);
 
 	if (!status.ok()) {
@@ -103,7 +374,7 @@ Status Collection::readDocument(const std::string& id, Document& doc) {
 	}
 
 	try {
-		doc = Document::from_msgpack(serialized);
+		doc = Document::from_msgpack(reinterpret_cast<const uint8_t*>(serialized.data()), serialized.size());
 		return Status::OK();
 	}
 	catch (const std::exception& e) {
@@ -111,6 +382,32 @@ Status Collection::readDocument(const std::string& id, Document& doc) {
 	}
 }
 
+Status Collection::readDocuments(const std::vector<std::string>& ids, std::vector<Document>& docs) {
+	std::vector<rocksdb::PinnableSlice> values;
+	std::vector<Status> statuses;
+	Status status = engine_->multiGet(name_, ids, values, statuses);
+	if (!status.ok()) {
+		return status;
+	}
+
+	docs.reserve(docs.size() + ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (statuses[i].isNotFound()) {
+			continue;
+		}
+		if (!statuses[i].ok()) {
+			return statuses[i];
+		}
+		try {
+			docs.push_back(Document::from_msgpack(reinterpret_cast<const uint8_t*>(values[i].data()), values[i].size()));
+		}
+		catch (const std::exception& e) {
+			return Status::Corruption("Failed to deserialize document: " + std::string(e.what()));
+		}
+	}
+	return Status::OK();
+}
+
 std::unique_ptr<Cursor> Collection::createCursor() {
 	return std::make_unique<Cursor>(name_, engine_);
 }
@@ -140,6 +437,43 @@ Status Collection::readAllDocuments(std::vector<Document>& docIds, uint64_t limi
 	return Status::OK();
 }
 
+Status Collection::readAllDocuments(std::vector<Document>& docIds, uint64_t limit, std::string& continuation) {
+	std::string lastId;
+	if (!continuation.empty() && !QueryCursor::decodeToken(continuation, &lastId)) {
+		return Status::InvalidArgument("Invalid continuation token");
+	}
+	auto cursor = createCursor();
+	if (!lastId.empty()) {
+		// Documents are ordered by id, the page starts right after the last one returned
+		cursor->seek(lastId);
+		if (cursor->isValid() && cursor->currentId() == lastId) {
+			cursor->next();
+		}
+	}
+	uint64_t cnt = 0;
+	try {
+		while (cursor->isValid() && cnt < limit) {
+			Document doc;
+			Status status = cursor->current(&doc);
+
+			if (status.ok()) {
+				docIds.push_back(doc);
+			}
+			else {
+				std::cerr << "Error reading document: " << status.message() << std::endl;
+			}
+			lastId = cursor->currentId();
+			cnt++;
+			cursor->next();
+		}
+	}
+	catch (const std::exception& e) {
+		return Status::Corruption("Failed to deserialize document: " + std::string(e.what()));
+	}
+	continuation = cursor->isValid() ? QueryCursor::encodeToken(lastId) : "";
+	return Status::OK();
+}
+
 std::string Collection::encodeIntKey(int value) {
 	// Add offset to make all values positive
 	uint64_t shifted = value + INT64_MAX + 1;
@@ -243,211 +577,1895 @@ std::string Collection::parseValue(const json& value) {
 		return "";
 	}
 	else if (value.is_object() || value.is_array()) {
-		return value;
+		return value.dump();
 	}
 	return "";
 }
 
-Status Collection::findDocumentsUsingEq(const json& eqOps, std::set<std::string>& indexes, std::vector<std::string>& docIds) {
-	std::string key = eqOps.begin().key();
-	std::string value = parseValue(eqOps.begin().value());
+char Collection::indexValueType(const json& value) {
+	if (value.is_string()) {
+		return IndexKey::kString;
+	}
+	else if (value.is_number_integer()) {
+		return IndexKey::kInt;
+	}
+	else if (value.is_number_float()) {
+		return IndexKey::kDouble;
+	}
+	else if (value.is_boolean()) {
+		return IndexKey::kBool;
+	}
+	else if (value.is_null()) {
+		return IndexKey::kNull;
+	}
+	return IndexKey::kJson;
+}
+
+std::string Collection::makeIndexKey(const json& value, const std::string& docId) {
+	return IndexKey::make(parseValue(value), docId, indexValueType(value));
+}
 
-	if (indexes.count(key) == 0) {
-		return Status::InvalidArgument("Specified key is not indexed, please create index for " + key);
+std::string Collection::makeDocumentIndexKey(const json& doc, const std::string& index, const std::string& docId) {
+	if (index.find(',') == std::string::npos) {
+		return makeIndexKey(FieldPath::value(doc, index), docId);
+	}
+	std::vector<std::string> fields = indexFields(index);
+	std::string value;
+	for (size_t i = 0; i < fields.size(); i++) {
+		if (i > 0) {
+			value.push_back('\0');
+		}
+		value += parseValue(FieldPath::value(doc, fields[i]));
 	}
-	value += "#";
-	return engine_->fetchDocIdsForEqual(getIndexCfName(key), value, docIds);
+	// The trailer records the type of the last field
+	return IndexKey::make(value, docId, indexValueType(FieldPath::value(doc, fields.back())));
 }
 
-Status Collection::findDocumentsUsingLt(const json& ltOps, std::set<std::string>& indexes, std::vector<std::string>& docIds) {
-	std::string key = ltOps.begin().key();
-	std::string value = parseValue(ltOps.begin().value());
-	if (value == "") {
-		return Status::InvalidArgument("Unable to parse value of operator..");
+std::vector<std::string> Collection::documentIndexKeys(const json& doc, const std::string& index, const std::string& docId, bool multikey) {
+	const json* value = multikey ? FieldPath::find(doc, index) : nullptr;
+	if (value == nullptr || !value->is_array()) {
+		return std::vector<std::string>(1, makeDocumentIndexKey(doc, index, docId));
+	}
+	// Elements are deduplicated on their encoded value, an equality scan finds the document once
+	std::vector<std::string> keys;
+	std::set<std::string> seen;
+	for (const json& element : *value) {
+		std::string encoded = parseValue(element);
+		if (seen.insert(encoded).second) {
+			keys.push_back(IndexKey::make(encoded, docId, indexValueType(element)));
+		}
 	}
-	value += "#";
-	return engine_->fetchDocIdsForLesser(getIndexCfName(key), value, docIds);
+	return keys;
 }
 
-Status Collection::findDocumentsUsingGt(const json& gtOps, std::set<std::string>& indexes, std::vector<std::string>& docIds) {
-	std::string key = gtOps.begin().key();
-	std::string value = parseValue(gtOps.begin().value());
-	if (value == "") {
-		return Status::InvalidArgument("Unable to parse value of operator..");
+Status Collection::parsePredicate(const std::string& op, const json& ops, IndexPredicate& predicate) {
+	if (!ops.is_object() || ops.empty()) {
+		return Status::InvalidArgument("Operator " + op + " expects {field: value}");
 	}
-	value += "#";
-	return engine_->fetchDocIdsForGreater(getIndexCfName(key), value, docIds);
+	return parsePredicate(op, ops.begin().key(), ops.begin().value(), predicate);
 }
 
-std::vector<std::string> Collection::findDocument(const json& filterOption) {
-	std::vector<std::string> docIds;
-	Status status;
-	std::set<std::string> indexes = engine_->getIndexNames(name_);
-	for (auto it = filterOption.begin(); it != filterOption.end(); it++) {
-		const std::string& op = it.key();
-		if (op == "$eq") {
-			const json& eqOps = it.value();
-			status = findDocumentsUsingEq(eqOps, indexes, docIds);
-			if (!status.ok()) {
-				std::cerr << "Error while finding doc:" << status.message() << std::endl;
-			}
+Status Collection::parsePredicate(const std::string& op, const std::string& key, const json& operand, IndexPredicate& predicate) {
+	predicate = IndexPredicate();
+	predicate.field = key;
+	predicate.index = key;
+	std::string& lowerBound = predicate.lowerBound;
+	std::string& upperBound = predicate.upperBound;
+	bool& reverse = predicate.reverse;
+	bool& prefixSeek = predicate.equality;
+	if (op == "$eq") {
+		std::string value = parseValue(operand);
+		lowerBound = IndexKey::lowerBound(value);
+		upperBound = IndexKey::upperBound(value);
+		prefixSeek = true;
+	}
+	else if (op == "$gt" || op == "$lt") {
+		std::string value = parseValue(operand);
+		if (value == "") {
+			return Status::InvalidArgument("Unable to parse value of operator..");
 		}
-		else if (op == "$gt") {
-			const json& gtOps = it.value();
-			status = findDocumentsUsingGt(gtOps, indexes, docIds);
-			if (!status.ok()) {
-				std::cerr << "Error while finding doc:" << status.message() << std::endl;
-			}
+		if (op == "$gt") {
+			lowerBound = IndexKey::upperBound(value);
 		}
-		else if (op == "$lt") {
-			const json& ltOps = it.value();
-			status = findDocumentsUsingLt(ltOps, indexes, docIds);
-			if (!status.ok()) {
-				std::cerr << "Error while finding doc:" << status.message() << std::endl;
-			}
+		else {
+			// $lt returns the closest values first
+			upperBound = IndexKey::lowerBound(value);
+			reverse = true;
 		}
-		else if (op == "$and") {
-			const json& andOps = it.value();
-			std::unordered_set<std::string> andDocIds;
-			if (andOps.is_array()) {
-				for (json::const_iterator it = andOps.begin(); it != andOps.end(); ++it) {
-					const json& item = *it;
-					for (auto element = item.begin(); element != item.end(); element++) {
-						std::vector<std::string> docIds;
-						std::string ops = element.key().data();
-						if (ops == "$eq") {
-							status = findDocumentsUsingEq(element.value(), indexes, docIds);
-						}
-						else if (ops == "$gt") {
-							status = findDocumentsUsingGt(element.value(), indexes, docIds);
-						}
-						else if (ops == "$lt") {
-							status = findDocumentsUsingLt(element.value(), indexes, docIds);
-						}
-						else {
-							status = Status::InvalidArgument("Not supported operator is passed");
-						}
-						if (!status.ok()) {
-							std::cerr << "Error while finding doc:" << status.message() << std::endl;
-							return {};
-						}
-
-						if (andDocIds.empty()) {
-							andDocIds.insert(docIds.begin(), docIds.end());
-						}
-						else {
-							for (std::string docId : docIds) {
-								if (andDocIds.count(docId) == 0) {
-									andDocIds.erase(docId);
-								}
-							}
-							std::unordered_set<std::string> tmpDoc1 = andDocIds;
-							std::unordered_set<std::string> tmpDoc2(docIds.begin(), docIds.end());
-							for (auto it = tmpDoc1.begin(); it != tmpDoc1.end(); it++) {
-								if (tmpDoc2.count(*it) == 0) {
-									andDocIds.erase(*it);
-								}
-							}
-						}
-					}
-				}
-			}
-			for (auto it = andDocIds.begin(); it != andDocIds.end(); it++) {
-				docIds.push_back(*it);
+	}
+	else if (op == "$gte") {
+		lowerBound = IndexKey::lowerBound(parseValue(operand));
+	}
+	else if (op == "$lte") {
+		upperBound = IndexKey::upperBound(parseValue(operand));
+	}
+	else if (op == "$between") {
+		if (operand.is_array()) {
+			// [low, high], both ends inclusive
+			if (operand.size() != 2) {
+				return Status::InvalidArgument("$between expects [low, high] for " + key);
 			}
+			lowerBound = IndexKey::lowerBound(parseValue(operand[0]));
+			upperBound = IndexKey::upperBound(parseValue(operand[1]));
 		}
-		else if (op == "$or") {
-			const json& orOps = it.value();
-			std::unordered_set<std::string> orDocIds;
-			if (orOps.is_array()) {
-				for (json::const_iterator it = orOps.begin(); it != orOps.end(); ++it) {
-					const json& item = *it;
-					std::vector<std::string> docIds;
-					for (auto element = item.begin(); element != item.end(); element++) {
-						std::vector<std::string> docIds;
-						std::string ops = element.key().data();
-						if (ops == "$eq") {
-							status = findDocumentsUsingEq(element.value(), indexes, docIds);
-						}
-						else if (ops == "$gt") {
-							status = findDocumentsUsingGt(element.value(), indexes, docIds);
-						}
-						else if (ops == "$lt") {
-							status = findDocumentsUsingLt(element.value(), indexes, docIds);
-						}
-						else {
-							status = Status::InvalidArgument("Not supported operator is passed");
-						}
-						if (!status.ok()) {
-							std::cerr << "Error while finding doc:" << status.message() << std::endl;
-							return {};
-						}
-						if (orDocIds.empty()) {
-							orDocIds.insert(docIds.begin(), docIds.end());
-						}
-						else {
-							for (std::string docId : docIds) {
-								orDocIds.insert(docId);
-							}
-						}
-					}
+		else if (operand.is_object()) {
+			// {"$gt" or "$gte": low, "$lt" or "$lte": high}, either side may be left open
+			bool hasLower = false;
+			bool hasUpper = false;
+			for (auto bound = operand.begin(); bound != operand.end(); bound++) {
+				const std::string& boundOp = bound.key();
+				std::string value = parseValue(bound.value());
+				if ((boundOp == "$gt" || boundOp == "$gte") && !hasLower) {
+					lowerBound = (boundOp == "$gt") ? IndexKey::upperBound(value) : IndexKey::lowerBound(value);
+					hasLower = true;
+				}
+				else if ((boundOp == "$lt" || boundOp == "$lte") && !hasUpper) {
+					upperBound = (boundOp == "$lt") ? IndexKey::lowerBound(value) : IndexKey::upperBound(value);
+					hasUpper = true;
+				}
+				else {
+					return Status::InvalidArgument("Invalid bound " + boundOp + " in $between for " + key);
 				}
-			}
-			for (auto it = orDocIds.begin(); it != orDocIds.end(); it++) {
-				docIds.push_back(*it);
 			}
 		}
-		else if (op == "$orderBy") {
-			const json& orderbyOps = it.value();
-			std::string key = orderbyOps.begin().key();
-			std::string value = orderbyOps.begin().value();
-			if (value == "") {
-				std::cerr << "Unable to parse value of operator..";
-			}
-			status = engine_->fetchDocIdsByOrder(getIndexCfName(key), value, docIds);
-			if (!status.ok()) {
-				std::cerr << "Error while finding doc:" << status.message() << std::endl;
-			}
+		else {
+			return Status::InvalidArgument("$between expects an array or an object of bounds for " + key);
 		}
 	}
-	return docIds;
-}
-
-Status Collection::updateDocument(const std::string& id, const nlohmann::json& update, bool upsert) {
-	std::lock_guard<std::mutex> lock(collection_mutex_);
-	Document doc;
-	Status status = readDocument(id, doc);
-
-	if (status.isNotFound()) {
-		if (upsert) {
-			doc = Document(id, json::object());
-			doc.setValue("_id", id);
+	else if (op == "$in") {
+		if (!operand.is_array()) {
+			return Status::InvalidArgument("$in expects an array of values for " + key);
+		}
+		std::vector<std::string>& values = predicate.values;
+		for (const json& value : operand) {
+			values.push_back(IndexKey::lowerBound(parseValue(value)));
+		}
+		std::sort(values.begin(), values.end());
+		values.erase(std::unique(values.begin(), values.end()), values.end());
+		if (values.empty()) {
+			// Crossed bounds, nothing matches
+			lowerBound = IndexKey::upperBound("");
+			upperBound = IndexKey::lowerBound("");
 		}
 		else {
-			return status;
+			lowerBound = values.front();
+			upperBound = values.back();
+			upperBound.back() = '\x01';
+			if (values.size() == 1) {
+				// Same as $eq
+				values.clear();
+				prefixSeek = true;
+			}
 		}
 	}
-	else if (!status.ok()) {
+	else {
+		return Status::InvalidArgument("Not supported operator is passed");
+	}
+	return Status::OK();
+}
+
+bool Collection::conditionsCoverIndex(const std::string& index, const std::vector<IndexPredicate>& conditions) {
+	for (const std::string& field : indexFields(index)) {
+		bool found = false;
+		for (const IndexPredicate& condition : conditions) {
+			std::vector<std::string> fields = indexFields(condition.field);
+			found = found || std::find(fields.begin(), fields.end(), field) != fields.end();
+		}
+		if (!found) {
+			return false;
+		}
+	}
+	return true;
+}
+
+Status Collection::resolvePredicateIndex(IndexPredicate& predicate, const std::set<std::string>& indexes,
+	const std::vector<IndexPredicate>& conditions) {
+	if (indexes.count(predicate.index) != 0) {
+		return Status::OK();
+	}
+	// Bounds on the first field are also bounds on a compound index, "v '\0'" starts every key with v first
+	for (const std::string& index : indexes) {
+		if (index.compare(0, predicate.field.size() + 1, predicate.field + ",") == 0 && conditionsCoverIndex(index, conditions)) {
+			predicate.index = index;
+			// An equal first value is followed by the other fields, the entries are not in doc id order
+			predicate.equality = false;
+			return Status::OK();
+		}
+	}
+	return Status::InvalidArgument("Specified key is not indexed, please create index for " + predicate.field);
+}
+
+void Collection::applyCompoundIndexes(std::vector<IndexPredicate>& predicates, const std::set<std::string>& indexes) {
+	auto findField = [&predicates](const std::string& field) {
+		return std::find_if(predicates.begin(), predicates.end(),
+			[&field](const IndexPredicate& p) { return p.field == field; });
+	};
+	while (true) {
+		// Compound index covering the most predicates, it has to cover at least two to beat single field indexes
+		std::string bestIndex;
+		size_t bestEqualities = 0;
+		size_t bestCovered = 1;
+		for (const std::string& index : indexes) {
+			if (index.find(',') == std::string::npos) {
+				continue;
+			}
+			if (!conditionsCoverIndex(index, predicates)) {
+				continue;
+			}
+			std::vector<std::string> fields = indexFields(index);
+			size_t equalities = 0;
+			while (equalities < fields.size()) {
+				auto it = findField(fields[equalities]);
+				if (it == predicates.end() || !it->equality || it->empty()) {
+					break;
+				}
+				equalities++;
+			}
+			size_t covered = equalities;
+			// The bounds of a value list cover the values in between as well, it stays a predicate of its own
+			auto next = (equalities > 0 && equalities < fields.size()) ? findField(fields[equalities]) : predicates.end();
+			if (next != predicates.end() && next->values.empty()) {
+				covered++;
+			}
+			if (covered > bestCovered) {
+				bestIndex = index;
+				bestEqualities = equalities;
+				bestCovered = covered;
+			}
+		}
+		if (bestIndex.empty()) {
+			return;
+		}
+
+		// Keys start with the equal values, each followed by '\0', then the bounds of the next field apply
+		std::vector<std::string> fields = indexFields(bestIndex);
+		IndexPredicate compound;
+		compound.field = bestIndex;
+		compound.index = bestIndex;
+		std::string prefix;
+		for (size_t i = 0; i < bestEqualities; i++) {
+			auto it = findField(fields[i]);
+			prefix += it->lowerBound;
+			predicates.erase(it);
+		}
+		std::string prefixEnd = prefix.substr(0, prefix.size() - 1) + '\x01';
+		if (bestCovered > bestEqualities) {
+			auto it = findField(fields[bestEqualities]);
+			compound.lowerBound = prefix + it->lowerBound;
+			compound.upperBound = it->upperBound.empty() ? prefixEnd : prefix + it->upperBound;
+			compound.reverse = it->reverse;
+			predicates.erase(it);
+		}
+		else {
+			compound.lowerBound = prefix;
+			compound.upperBound = prefixEnd;
+			// Every field is fixed, the entries of the value are in doc id order
+			compound.equality = (bestEqualities == fields.size());
+		}
+		predicates.push_back(compound);
+	}
+}
+
+std::unique_ptr<DocIdStream> Collection::createPredicateStream(const IndexPredicate& predicate) {
+	if (predicate.empty()) {
+		return std::unique_ptr<DocIdStream>(new VectorStream(std::vector<std::string>()));
+	}
+	if (!predicate.values.empty()) {
+		// Keys of a compound index continue after the value, they are outside the value's prefix domain
+		return std::unique_ptr<DocIdStream>(new IndexRangeStream(engine_, getIndexCfName(predicate.index),
+			predicate.values, predicate.index.find(',') == std::string::npos));
+	}
+	return std::unique_ptr<DocIdStream>(new IndexRangeStream(engine_, getIndexCfName(predicate.index),
+		predicate.lowerBound, predicate.upperBound, predicate.reverse, predicate.equality));
+}
+
+uint64_t Collection::estimatePredicate(const IndexPredicate& predicate) {
+	if (predicate.empty()) {
+		return 0;
+	}
+	std::string indexCf = getIndexCfName(predicate.index);
+	if (predicate.values.empty()) {
+		return engine_->estimateIndexEntries(indexCf, predicate.lowerBound, predicate.upperBound);
+	}
+	uint64_t estimate = 0;
+	for (const std::string& value : predicate.values) {
+		std::string end = value;
+		end.back() = '\x01';
+		estimate += engine_->estimateIndexEntries(indexCf, value, end);
+	}
+	return estimate;
+}
+
+Status Collection::createConditionStream(IndexPredicate predicate, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	if (!resolvePredicateIndex(predicate, indexes).ok()) {
+		return createScanStream(std::vector<IndexPredicate>(1, predicate), false, stream);
+	}
+	if (isMultikey(predicate.index) && !(predicate.equality && predicate.values.empty())) {
+		// Several elements of a document may fall in the range, its ids are deduplicated
+		return createSortedStream(predicate, stream);
+	}
+	stream = createPredicateStream(predicate);
+	return stream->status();
+}
+
+Status Collection::parseAndConditions(const json& andOps, std::vector<IndexPredicate>& predicates) {
+	if (!andOps.is_array()) {
+		return Status::InvalidArgument("Operator $and expects an array of conditions");
+	}
+	for (const json& item : andOps) {
+		if (!item.is_object()) {
+			return Status::InvalidArgument("Operator $and expects an array of conditions");
+		}
+		for (auto element = item.begin(); element != item.end(); element++) {
+			IndexPredicate predicate;
+			Status status = parsePredicate(element.key(), element.value(), predicate);
+			if (!status.ok()) {
+				return status;
+			}
+			addAndCondition(predicates, predicate);
+		}
+	}
+	return Status::OK();
+}
+
+void Collection::addAndCondition(std::vector<IndexPredicate>& predicates, const IndexPredicate& predicate) {
+	// Conditions on the same field become a single range, e.g. $gt and $lt on price. Each condition on
+	// an array may match another element, e.g. two tags, so these are kept as separate predicates
+	std::vector<IndexPredicate> added(1, predicate);
+	markMultikey(added);
+	auto same = std::find_if(predicates.begin(), predicates.end(),
+		[&predicate](const IndexPredicate& p) { return p.field == predicate.field; });
+	if (same != predicates.end() && !added[0].multikey) {
+		same->intersect(predicate);
+	}
+	else {
+		predicates.push_back(predicate);
+	}
+}
+
+Status Collection::parseOrConditions(const json& orOps, std::vector<IndexPredicate>& predicates) {
+	if (!orOps.is_array()) {
+		return Status::InvalidArgument("Operator $or expects an array of conditions");
+	}
+	for (const json& item : orOps) {
+		if (!item.is_object()) {
+			return Status::InvalidArgument("Operator $or expects an array of conditions");
+		}
+		for (auto element = item.begin(); element != item.end(); element++) {
+			IndexPredicate predicate;
+			Status status = parsePredicate(element.key(), element.value(), predicate);
+			if (!status.ok()) {
+				return status;
+			}
+			predicates.push_back(predicate);
+		}
+	}
+	return Status::OK();
+}
+
+Status Collection::parseFilterConditions(const json& filterOption, std::vector<IndexPredicate>& predicates, bool& any) {
+	predicates.clear();
+	any = false;
+	if (filterOption.is_null() || filterOption.empty()) {
+		return Status::OK();
+	}
+	if (!filterOption.is_object() || filterOption.size() != 1) {
+		return Status::InvalidArgument("A sorted query expects a single condition, $and or $or");
+	}
+	const std::string& op = filterOption.begin().key();
+	if (op == "$and") {
+		return parseAndConditions(filterOption.begin().value(), predicates);
+	}
+	if (op == "$or") {
+		any = true;
+		return parseOrConditions(filterOption.begin().value(), predicates);
+	}
+	IndexPredicate predicate;
+	Status status = parsePredicate(op, filterOption.begin().value(), predicate);
+	if (!status.ok()) {
+		return status;
+	}
+	predicates.push_back(predicate);
+	return Status::OK();
+}
+
+void Collection::planAnd(std::vector<IndexPredicate>& predicates, const std::set<std::string>& indexes, size_t& probeCount) {
+	applyCompoundIndexes(predicates, indexes);
+	const std::vector<IndexPredicate> conditions = predicates;
+	for (IndexPredicate& predicate : predicates) {
+		if (!resolvePredicateIndex(predicate, indexes, conditions).ok()) {
+			// Checked on the documents, after every indexed condition
+			predicate.indexed = false;
+			predicate.estimate = predicate.empty() ? 0 : UINT64_MAX;
+			continue;
+		}
+		predicate.estimate = estimatePredicate(predicate);
+	}
+	// The most selective condition drives the scan
+	std::stable_sort(predicates.begin(), predicates.end(),
+		[](const IndexPredicate& a, const IndexPredicate& b) { return a.estimate < b.estimate; });
+
+	// A condition whose range is not much larger than the driver is intersected with it on the index,
+	// reading its index entries is cheaper than fetching the document of every candidate
+	const uint64_t probeFactor = 8;
+	probeCount = 0;
+	if (!predicates.empty() && predicates[0].indexed) {
+		uint64_t limit = std::max<uint64_t>(predicates[0].estimate, 1) * probeFactor;
+		while (probeCount + 1 < predicates.size() && predicates[probeCount + 1].indexed &&
+			predicates[probeCount + 1].estimate <= limit) {
+			probeCount++;
+		}
+	}
+}
+
+Status Collection::createSortedStream(const IndexPredicate& predicate, std::unique_ptr<DocIdStream>& stream) {
+	stream = createPredicateStream(predicate);
+	if (predicate.empty() || (predicate.equality && !predicate.reverse)) {
+		// Entries of a single value are already ordered by doc id
+		return stream->status();
+	}
+	// A range is ordered by value first, its ids are collected and sorted once
+	std::vector<std::string> ids;
+	for (; stream->valid(); stream->next()) {
+		ids.push_back(stream->id().ToString());
+	}
+	Status status = stream->status();
+	if (!status.ok()) {
+		return status;
+	}
+	std::sort(ids.begin(), ids.end());
+	// A multikey index returns a document once per matching element
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	stream.reset(new VectorStream(std::move(ids)));
+	return Status::OK();
+}
+
+Status Collection::createAndStream(std::vector<IndexPredicate> predicates, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	size_t probeCount = 0;
+	planAnd(predicates, indexes, probeCount);
+	Status status;
+	if (predicates.empty() || predicates[0].empty()) {
+		stream.reset(new VectorStream(std::vector<std::string>()));
+		return Status::OK();
+	}
+	if (!predicates[0].indexed) {
+		// No condition has an index
+		return createScanStream(predicates, false, stream);
+	}
+
+	// The driver and the probes are intersected on their ids, only the index entries inside each range are read
+	std::vector<std::unique_ptr<DocIdStream>> inputs;
+	for (size_t i = 0; i <= probeCount; i++) {
+		std::unique_ptr<DocIdStream> input;
+		status = createSortedStream(predicates[i], input);
+		if (!status.ok()) {
+			return status;
+		}
+		inputs.push_back(std::move(input));
+	}
+	std::unique_ptr<DocIdStream> merged;
+	if (inputs.size() == 1) {
+		merged = std::move(inputs[0]);
+	}
+	else {
+		merged.reset(new IntersectStream(std::move(inputs)));
+	}
+	if (predicates.size() == probeCount + 1) {
+		stream = std::move(merged);
+		return stream->status();
+	}
+
+	// The remaining conditions are checked on the stored document of each candidate
+	std::vector<IndexPredicate> checks(predicates.begin() + 1 + probeCount, predicates.end());
+	stream.reset(new FilteredStream(std::move(merged), documentCheck(checks, false)));
+	return stream->status();
+}
+
+Status Collection::createOrStream(std::vector<IndexPredicate> predicates, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	Status status;
+	bool indexed = true;
+	for (IndexPredicate& predicate : predicates) {
+		if (!resolvePredicateIndex(predicate, indexes).ok()) {
+			predicate.indexed = false;
+			indexed = false;
+		}
+	}
+	if (!indexed) {
+		// A condition without an index can match any document, one scan evaluates all of them
+		return createScanStream(predicates, true, stream);
+	}
+	std::vector<std::unique_ptr<DocIdStream>> streams;
+	for (const IndexPredicate& predicate : predicates) {
+		std::unique_ptr<DocIdStream> clause;
+		status = createSortedStream(predicate, clause);
+		if (!status.ok()) {
+			return status;
+		}
+		streams.push_back(std::move(clause));
+	}
+	// Documents matching several conditions are returned once, in doc id order
+	stream.reset(new UnionStream(std::move(streams)));
+	return stream->status();
+}
+
+Status Collection::createQueryStream(const json& filterOption, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	std::vector<std::unique_ptr<DocIdStream>> streams;
+	for (auto it = filterOption.begin(); it != filterOption.end(); it++) {
+		const std::string& op = it.key();
+		std::unique_ptr<DocIdStream> opStream;
+		Status status;
+		if (op == "$and" || op == "$or") {
+			std::vector<IndexPredicate> predicates;
+			status = (op == "$and") ? parseAndConditions(it.value(), predicates) : parseOrConditions(it.value(), predicates);
+			if (status.ok()) {
+				status = (op == "$and") ? createAndStream(std::move(predicates), indexes, opStream) :
+					createOrStream(std::move(predicates), indexes, opStream);
+			}
+		}
+		else if (op == "$orderBy") {
+			const json& orderbyOps = it.value();
+			if (!orderbyOps.is_object() || orderbyOps.empty()) {
+				return Status::InvalidArgument("Operator $orderBy expects {field: \"asc\" or \"desc\"}");
+			}
+			std::string key = orderbyOps.begin().key();
+			std::string value = orderbyOps.begin().value();
+			if (indexes.count(key) == 0) {
+				return Status::InvalidArgument("Specified key is not indexed, please create index for " + key);
+			}
+			if (isMultikey(key)) {
+				return Status::InvalidArgument("A multikey index does not order its field: " + key);
+			}
+			opStream.reset(new IndexRangeStream(engine_, getIndexCfName(key), "", "", value != "asc"));
+			status = opStream->status();
+		}
+		else {
+			IndexPredicate predicate;
+			status = parsePredicate(op, it.value(), predicate);
+			if (status.ok()) {
+				status = createConditionStream(predicate, indexes, opStream);
+			}
+		}
+		if (!status.ok()) {
+			return status;
+		}
+		streams.push_back(std::move(opStream));
+	}
+	if (streams.size() == 1) {
+		stream = std::move(streams[0]);
+	}
+	else {
+		// Several top level operators return their matches one after another
+		stream.reset(new ConcatStream(std::move(streams)));
+	}
+	return Status::OK();
+}
+
+Status Collection::splitSort(const json& filterOption, const QueryOptions& options, json& filter, std::string& sortField, bool& descending) {
+	filter = filterOption;
+	sortField = options.sortField;
+	descending = options.sortDescending;
+	auto orderBy = filter.find("$orderBy");
+	// $orderBy alone is a scan of its index, see createQueryStream
+	if (orderBy == filter.end() || (filter.size() == 1 && sortField.empty())) {
+		return Status::OK();
+	}
+	if (sortField.empty()) {
+		if (!orderBy->is_object() || orderBy->empty()) {
+			return Status::InvalidArgument("Operator $orderBy expects {field: \"asc\" or \"desc\"}");
+		}
+		sortField = orderBy->begin().key();
+		descending = orderBy->begin().value() != "asc";
+	}
+	filter.erase(orderBy);
+	return Status::OK();
+}
+
+Status Collection::createFindStream(const json& filterOption, const QueryOptions& options, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	json filter;
+	std::string sortField;
+	bool descending = false;
+	Status status = splitSort(filterOption, options, filter, sortField, descending);
+	if (!status.ok()) {
+		return status;
+	}
+	std::string position;
+	if (!options.continuation.empty() && !QueryCursor::decodeToken(options.continuation, &position)) {
+		return Status::InvalidArgument("Invalid continuation token");
+	}
+	if (sortField.empty()) {
+		status = createQueryStream(filter, indexes, stream);
+		if (status.ok() && !position.empty()) {
+			stream->resume(position);
+		}
+		return status.ok() ? stream->status() : status;
+	}
+	// The cursor skips the first matches, they have to be ranked as well
+	uint64_t k = options.limit == 0 ? 0 : options.skip + options.limit;
+	return createSortStream(filter, sortField, descending, k, position, indexes, stream);
+}
+
+Status Collection::planSort(const json& filterOption, const std::string& sortField, uint64_t k, const std::set<std::string>& indexes, SortPlan& plan) {
+	std::vector<IndexPredicate> predicates;
+	bool any = false;
+	Status status = parseFilterConditions(filterOption, predicates, any);
+	if (!status.ok()) {
+		return status;
+	}
+	markMultikey(predicates);
+	plan = SortPlan();
+	plan.any = any;
+	plan.checks = predicates;
+	auto findField = [&plan](const std::string& field) {
+		return std::find_if(plan.checks.begin(), plan.checks.end(),
+			[&field](const IndexPredicate& p) { return p.field == field; });
+	};
+
+	// Index on the sort field, or a compound index whose fields before it have equal values in the filter.
+	// Its entries for these values are ordered by the sort field
+	size_t bestEqualities = 0;
+	std::shared_ptr<const std::set<std::string>> multikey = engine_->getMultikeyIndexes(name_);
+	for (const std::string& index : indexes) {
+		if (multikey->count(index) != 0) {
+			// Entries of the elements are not an order of the documents
+			continue;
+		}
+		std::vector<std::string> fields = indexFields(index);
+		size_t equalities = 0;
+		while (!any && equalities < fields.size() && fields[equalities] != sortField) {
+			auto it = findField(fields[equalities]);
+			if (it == plan.checks.end() || !it->equality || it->empty() || !it->values.empty()) {
+				break;
+			}
+			equalities++;
+		}
+		// The fields after the sort field need conditions of the filter, the index lacks documents without them
+		bool covered = true;
+		for (size_t i = equalities + 1; i < fields.size(); i++) {
+			covered = covered && !any && findField(fields[i]) != plan.checks.end();
+		}
+		if (covered && equalities < fields.size() && fields[equalities] == sortField && (plan.index.empty() || equalities > bestEqualities)) {
+			plan.index = index;
+			bestEqualities = equalities;
+		}
+	}
+
+	// Documents read when the matches of the filter are ranked, UINT64_MAX for a collection scan
+	uint64_t matchEstimate = predicates.empty() ? UINT64_MAX : (any ? 0 : UINT64_MAX);
+	for (IndexPredicate predicate : predicates) {
+		if (!resolvePredicateIndex(predicate, indexes, any ? std::vector<IndexPredicate>() : predicates).ok()) {
+			if (any) {
+				matchEstimate = UINT64_MAX;
+				break;
+			}
+			continue;
+		}
+		uint64_t estimate = estimatePredicate(predicate);
+		matchEstimate = any ? matchEstimate + estimate : std::min(matchEstimate, estimate);
+	}
+
+	if (!plan.index.empty()) {
+		std::vector<std::string> fields = indexFields(plan.index);
+		std::string prefix;
+		for (size_t i = 0; i < bestEqualities; i++) {
+			auto it = findField(fields[i]);
+			prefix += it->lowerBound;
+			plan.checks.erase(it);
+		}
+		plan.lowerBound = prefix;
+		plan.upperBound = prefix.empty() ? "" : prefix.substr(0, prefix.size() - 1) + '\x01';
+		auto sortCondition = any ? plan.checks.end() : findField(sortField);
+		if (sortCondition != plan.checks.end() && sortCondition->values.empty()) {
+			// A range on the sort field bounds the walk
+			if (!sortCondition->lowerBound.empty()) {
+				plan.lowerBound = prefix + sortCondition->lowerBound;
+			}
+			if (!sortCondition->upperBound.empty()) {
+				plan.upperBound = prefix + sortCondition->upperBound;
+			}
+			plan.checks.erase(sortCondition);
+		}
+		uint64_t walkEstimate = engine_->estimateIndexEntries(getIndexCfName(plan.index), plan.lowerBound, plan.upperBound);
+		plan.estimate = walkEstimate;
+		if (k > 0 && plan.checks.empty()) {
+			plan.estimate = std::min(walkEstimate, k);
+		}
+		else if (k > 0 && matchEstimate != UINT64_MAX) {
+			// Matches spread evenly over the walk are found every walkEstimate / matchEstimate entries
+			double reads = static_cast<double>(k) * walkEstimate / std::max<uint64_t>(matchEstimate, 1);
+			plan.estimate = std::min<uint64_t>(walkEstimate, static_cast<uint64_t>(reads));
+		}
+		if (plan.checks.empty() || matchEstimate == UINT64_MAX || plan.estimate <= matchEstimate) {
+			return Status::OK();
+		}
+	}
+	plan.index.clear();
+	plan.lowerBound.clear();
+	plan.upperBound.clear();
+	plan.checks = predicates;
+	plan.estimate = matchEstimate;
+	return Status::OK();
+}
+
+Status Collection::createSortStream(const json& filterOption, const std::string& sortField, bool descending, uint64_t k,
+	const std::string& after, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream) {
+	SortPlan plan;
+	Status status = planSort(filterOption, sortField, k, indexes, plan);
+	if (!status.ok()) {
+		return status;
+	}
+	if (!plan.index.empty()) {
+		// The walk stops as soon as the cursor has its matches
+		stream.reset(new IndexRangeStream(engine_, getIndexCfName(plan.index), plan.lowerBound, plan.upperBound, descending));
+		if (!plan.checks.empty()) {
+			stream.reset(new FilteredStream(std::move(stream), documentCheck(plan.checks, plan.any)));
+		}
+		if (!after.empty()) {
+			stream->resume(after);
+		}
+		return stream->status();
+	}
+
+	// Rank the matches by the index key of their sort value, which orders values like the index
+	// and ties by doc id. The heap keeps the k best keys with the worst one on top
+	std::unique_ptr<DocIdStream> matches;
+	if (plan.checks.empty()) {
+		status = createScanStream(plan.checks, false, matches);
+	}
+	else {
+		status = createQueryStream(filterOption, indexes, matches);
+	}
+	if (!status.ok()) {
+		return status;
+	}
+	auto before = [descending](const std::string& a, const std::string& b) { return descending ? a > b : a < b; };
+	const std::vector<std::string> fields(1, sortField);
+	std::vector<std::string> keys;
+	for (; matches->valid(); matches->next()) {
+		std::string id = matches->id().ToString();
+		rocksdb::PinnableSlice serialized;
+		status = engine_->get(name_, id, &serialized);
+		if (status.isNotFound()) {
+			continue;
+		}
+		if (!status.ok()) {
+			return status;
+		}
+		const char* data;
+		size_t dataSize;
+		json partial;
+		const json* sortValue = nullptr;
+		if (!MsgpackReader::findField(serialized.data(), serialized.size(), "data", &data, &dataSize) ||
+			!MsgpackReader::extractFields(data, dataSize, fields, partial) || (sortValue = FieldPath::find(partial, sortField)) == nullptr) {
+			continue;
+		}
+		std::string key = makeIndexKey(*sortValue, id);
+		if (!after.empty() && !before(after, key)) {
+			// Ranked on a previous page
+			continue;
+		}
+		keys.push_back(std::move(key));
+		std::push_heap(keys.begin(), keys.end(), before);
+		if (k > 0 && keys.size() > k) {
+			std::pop_heap(keys.begin(), keys.end(), before);
+			keys.pop_back();
+		}
+	}
+	if (!matches->status().ok()) {
+		return matches->status();
+	}
+	std::sort_heap(keys.begin(), keys.end(), before);
+	std::vector<std::string> ids;
+	ids.reserve(keys.size());
+	for (const std::string& key : keys) {
+		ids.push_back(IndexKey::docId(key).ToString());
+	}
+	// Positions are the rank keys, a continuation ranks only the matches after its key
+	stream.reset(new VectorStream(std::move(ids), std::move(keys)));
+	return Status::OK();
+}
+
+json Collection::describePredicate(const IndexPredicate& predicate) {
+	if (!predicate.indexed) {
+		return json{ {"field", predicate.field}, {"scan", "collection"} };
+	}
+	if (!predicate.values.empty()) {
+		return json{ {"field", predicate.field}, {"index", predicate.index}, {"estimate", predicate.estimate},
+			{"scan", "seek"}, {"values", predicate.values.size()} };
+	}
+	return json{ {"field", predicate.field}, {"index", predicate.index}, {"estimate", predicate.estimate},
+		{"scan", predicate.equality ? "prefix" : "range"} };
+}
+
+std::vector<std::string> Collection::predicateFields(const std::vector<IndexPredicate>& predicates) {
+	std::vector<std::string> fields;
+	for (const IndexPredicate& predicate : predicates) {
+		for (const std::string& field : indexFields(predicate.index)) {
+			if (std::find(fields.begin(), fields.end(), field) == fields.end()) {
+				fields.push_back(field);
+			}
+		}
+	}
+	return fields;
+}
+
+bool Collection::matchesSerialized(const rocksdb::Slice& docId, const rocksdb::Slice& serialized,
+	const std::vector<IndexPredicate>& predicates, const std::vector<std::string>& fields, bool any) {
+	// Stored documents are {"_id": id, "data": {...}}, see Document::to_msgpack
+	const char* data;
+	size_t dataSize;
+	json partial;
+	if (!MsgpackReader::findField(serialized.data(), serialized.size(), "data", &data, &dataSize) ||
+		!MsgpackReader::extractFields(data, dataSize, fields, partial)) {
+		return false;
+	}
+	return matchesFields(docId, partial, predicates, any);
+}
+
+bool Collection::matchesFields(const rocksdb::Slice& docId, const json& partial, const std::vector<IndexPredicate>& predicates, bool any) {
+	// Same comparison as on the index, the document values are encoded into index keys
+	std::string id = docId.ToString();
+	for (const IndexPredicate& predicate : predicates) {
+		bool match = false;
+		if (!predicate.empty() && hasIndexField(partial, predicate.index)) {
+			if (!predicate.multikey) {
+				match = predicate.matches(makeDocumentIndexKey(partial, predicate.index, id));
+			}
+			else {
+				// Any element, or a value that is not an array
+				for (const std::string& key : documentIndexKeys(partial, predicate.index, id, true)) {
+					if (predicate.matches(key)) {
+						match = true;
+						break;
+					}
+				}
+			}
+		}
+		if (match == any) {
+			return any;
+		}
+	}
+	return !any;
+}
+
+void Collection::markMultikey(std::vector<IndexPredicate>& predicates) {
+	std::shared_ptr<const std::set<std::string>> indexes = engine_->getIndexSet(name_);
+	std::shared_ptr<const std::set<std::string>> multikey = engine_->getMultikeyIndexes(name_);
+	for (IndexPredicate& predicate : predicates) {
+		predicate.multikey = multikey->count(predicate.index) != 0;
+		if (predicate.multikey || predicate.index.find(',') != std::string::npos) {
+			continue;
+		}
+		// Other indexes, compound ones too, hold whole values and their fields are compared whole
+		predicate.multikey = std::none_of(indexes->begin(), indexes->end(), [this, &predicate](const std::string& index) {
+			std::vector<std::string> fields = indexFields(index);
+			return std::find(fields.begin(), fields.end(), predicate.field) != fields.end();
+		});
+	}
+}
+
+FilteredStream::Predicate Collection::documentCheck(const std::vector<IndexPredicate>& checks, bool any) {
+	std::vector<IndexPredicate> predicates = checks;
+	markMultikey(predicates);
+	std::vector<std::string> fields = predicateFields(predicates);
+	return [this, predicates, fields, any](const rocksdb::Slice& id, Status* status) {
+		rocksdb::PinnableSlice serialized;
+		Status readStatus = engine_->get(name_, id.ToString(), &serialized);
+		if (!readStatus.ok()) {
+			if (!readStatus.isNotFound()) {
+				*status = readStatus;
+			}
+			return false;
+		}
+		return matchesSerialized(id, serialized, predicates, fields, any);
+	};
+}
+
+Status Collection::createScanStream(const std::vector<IndexPredicate>& checks, bool any, std::unique_ptr<DocIdStream>& stream) {
+	std::vector<IndexPredicate> predicates = checks;
+	markMultikey(predicates);
+	std::vector<std::string> fields = predicateFields(predicates);
+	std::vector<std::string> ids;
+	Status status = engine_->scanCollection(name_, StorageEngine::defaultScanThreads(),
+		[&](const rocksdb::Slice& key, const rocksdb::Slice& value) {
+			return matchesSerialized(key, value, predicates, fields, any);
+		}, ids);
+	if (!status.ok()) {
+		return status;
+	}
+	// Keys come back in order, the matches are ordered by doc id like the $and and $or results
+	stream.reset(new VectorStream(std::move(ids)));
+	return Status::OK();
+}
+
+Status Collection::parseAccumulators(const json& aggregates, std::vector<Accumulator>& accumulators) {
+	const std::string usage = "Aggregates expect {name: {\"$count\" | \"$sum\" | \"$min\" | \"$max\" | \"$avg\": field}}";
+	if (!aggregates.is_object() || aggregates.empty()) {
+		return Status::InvalidArgument(usage);
+	}
+	accumulators.clear();
+	for (auto it = aggregates.begin(); it != aggregates.end(); it++) {
+		if (!it.value().is_object() || it.value().size() != 1) {
+			return Status::InvalidArgument(usage);
+		}
+		Accumulator accumulator;
+		accumulator.name = it.key();
+		accumulator.op = it.value().begin().key();
+		const json& field = it.value().begin().value();
+		if (accumulator.op != "$count") {
+			if (accumulator.op != "$sum" && accumulator.op != "$min" && accumulator.op != "$max" && accumulator.op != "$avg") {
+				return Status::InvalidArgument("Not supported aggregate " + accumulator.op);
+			}
+			if (!field.is_string()) {
+				return Status::InvalidArgument(accumulator.op + " expects a field name");
+			}
+			accumulator.field = field.get<std::string>();
+		}
+		accumulators.push_back(accumulator);
+	}
+	return Status::OK();
+}
+
+void Collection::Accumulator::add(const json* input) {
+	if (op == "$count") {
+		count++;
+		return;
+	}
+	if (input == nullptr) {
+		return;
+	}
+	if (op == "$sum" || op == "$avg") {
+		if (!input->is_number()) {
+			return;
+		}
+		sum += input->get<double>();
+		// Once a value is not an integer or the exact sum would overflow, the double sum is the result
+		if (integral && input->is_number_unsigned()) {
+			uint64_t unsignedValue = input->get<uint64_t>();
+			integral = unsignedValue <= static_cast<uint64_t>(INT64_MAX) &&
+				addInteger(integerSum, static_cast<int64_t>(unsignedValue));
+		}
+		else if (integral && input->is_number_integer()) {
+			integral = addInteger(integerSum, input->get<int64_t>());
+		}
+		else {
+			integral = false;
+		}
+	}
+	else {
+		if (input->is_structured()) {
+			return;
+		}
+		std::string encoded = parseValue(*input);
+		if (count == 0 || (op == "$min" ? encoded < key : encoded > key)) {
+			key = encoded;
+			value = *input;
+		}
+	}
+	count++;
+}
+
+void Collection::Accumulator::merge(const Accumulator& other) {
+	if (op == "$min" || op == "$max") {
+		if (other.count > 0 && (count == 0 || (op == "$min" ? other.key < key : other.key > key))) {
+			key = other.key;
+			value = other.value;
+		}
+	}
+	else {
+		sum += other.sum;
+		integral = integral && other.integral && addInteger(integerSum, other.integerSum);
+	}
+	count += other.count;
+}
+
+json Collection::Accumulator::result() const {
+	if (op == "$count") {
+		return count;
+	}
+	if (op == "$sum") {
+		return integral ? json(integerSum) : json(sum);
+	}
+	if (op == "$avg") {
+		if (count == 0) {
+			return nullptr;
+		}
+		return integral ? json(static_cast<double>(integerSum) / count) : json(sum / count);
+	}
+	return value;
+}
+
+json Collection::Accumulator::state() const {
+	return json::array({ count, sum, integerSum, integral, value });
+}
+
+void Collection::Accumulator::restore(const json& state) {
+	count = state[0].get<uint64_t>();
+	sum = state[1].get<double>();
+	integerSum = state[2].get<int64_t>();
+	integral = state[3].get<bool>();
+	value = state[4];
+	key = (count > 0 && (op == "$min" || op == "$max")) ? parseValue(value) : "";
+}
+
+Status Collection::aggregate(const json& filterOption, const json& aggregates, json& result) {
+	std::vector<Accumulator> accumulators;
+	Status status = parseAccumulators(aggregates, accumulators);
+	if (!status.ok()) {
+		return status;
+	}
+	std::shared_ptr<const std::set<std::string>> indexSet = engine_->getIndexSet(name_);
+	const std::set<std::string>& indexes = *indexSet;
+
+	// $min and $max of an indexed field are the first and last keys in the range of the filter,
+	// as long as the filter holds no condition on another field
+	std::vector<IndexPredicate> predicates;
+	bool any = false;
+	bool simpleFilter = parseFilterConditions(filterOption, predicates, any).ok() && !any && predicates.size() <= 1;
+	// The keys of a multikey index are elements, not the values of the field
+	std::shared_ptr<const std::set<std::string>> multikey = engine_->getMultikeyIndexes(name_);
+	for (Accumulator& accumulator : accumulators) {
+		if ((accumulator.op != "$min" && accumulator.op != "$max") || !simpleFilter || indexes.count(accumulator.field) == 0 ||
+			multikey->count(accumulator.field) != 0) {
+			continue;
+		}
+		IndexPredicate range;
+		if (!predicates.empty()) {
+			range = predicates[0];
+			if (range.field != accumulator.field || !range.values.empty()) {
+				continue;
+			}
+		}
+		accumulator.done = true;
+		if (range.empty()) {
+			continue;
+		}
+		IndexRangeStream end(engine_, getIndexCfName(accumulator.field), range.lowerBound, range.upperBound, accumulator.op == "$max");
+		if (!end.valid()) {
+			if (!end.status().ok()) {
+				return end.status();
+			}
+			continue;
+		}
+		rocksdb::Slice encoded;
+		rocksdb::Slice docId;
+		char type;
+		if (!IndexKey::parse(end.key(), &encoded, &docId, &type)) {
+			return Status::Corruption("Invalid index key");
+		}
+		status = decodeIndexValue(encoded, type, accumulator.value);
+		if (!status.ok()) {
+			return status;
+		}
+	}
+
+	// The other aggregates are computed in one pass over the matches
+	std::vector<std::string> fields;
+	bool counting = false;
+	bool pending = false;
+	for (const Accumulator& accumulator : accumulators) {
+		if (accumulator.done) {
+			continue;
+		}
+		pending = true;
+		counting = counting || accumulator.op == "$count";
+		if (!accumulator.field.empty() && std::find(fields.begin(), fields.end(), accumulator.field) == fields.end()) {
+			fields.push_back(accumulator.field);
+		}
+	}
+	if (pending) {
+		std::unique_ptr<DocIdStream> stream;
+		if (!filterOption.is_null() && !filterOption.empty()) {
+			status = createFindStream(filterOption, QueryOptions(), indexes, stream);
+		}
+		else if (!counting && fields.size() == 1 && indexes.count(fields[0]) != 0 && multikey->count(fields[0]) == 0) {
+			// Every document holding the field has an entry in its index, the keys hold the values
+			stream.reset(new IndexRangeStream(engine_, getIndexCfName(fields[0]), "", ""));
+			status = stream->status();
+		}
+		else {
+			status = createScanStream(std::vector<IndexPredicate>(), false, stream);
+		}
+		if (!status.ok()) {
+			return status;
+		}
+		// A scan of the index of the only field holds its value in the keys, other covered
+		// fields are decoded from the index entries
+		const IndexRangeStream* scan = stream->indexScan();
+		bool keyValues = fields.size() == 1 && scan != nullptr && scan->indexCf() == getIndexCfName(fields[0]) &&
+			multikey->count(fields[0]) == 0;
+		QueryCursor::EntryDecoder decoder;
+		if (!fields.empty() && !keyValues) {
+			decoder = coveredDecoder(*stream, fields);
+		}
+		json values = json::object();
+		for (; stream->valid(); stream->next()) {
+			if (keyValues) {
+				rocksdb::Slice encoded;
+				rocksdb::Slice docId;
+				char type;
+				if (!IndexKey::parse(stream->indexScan()->key(), &encoded, &docId, &type)) {
+					return Status::Corruption("Invalid index key");
+				}
+				status = decodeIndexValue(encoded, type, values[fields[0]]);
+			}
+			else if (!fields.empty()) {
+				status = readMatchFields(*stream, decoder, fields, values);
+			}
+			if (status.isNotFound()) {
+				continue;
+			}
+			if (!status.ok()) {
+				return status;
+			}
+			for (Accumulator& accumulator : accumulators) {
+				if (!accumulator.done) {
+					accumulator.add(FieldPath::find(values, accumulator.field));
+				}
+			}
+		}
+		if (!stream->status().ok()) {
+			return stream->status();
+		}
+	}
+
+	result = json::object();
+	for (const Accumulator& accumulator : accumulators) {
+		result[accumulator.name] = accumulator.result();
+	}
+	return Status::OK();
+}
+
+Status Collection::readMatchFields(const DocIdStream& stream, const QueryCursor::EntryDecoder& decoder,
+	const std::vector<std::string>& fields, json& values) {
+	if (decoder) {
+		const IndexRangeStream* scan = stream.indexScan();
+		Document doc;
+		Status status = decoder(scan->key(), scan->value(), &doc);
+		if (!status.ok()) {
+			return status;
+		}
+		values = std::move(doc.data());
+		return Status::OK();
+	}
+	rocksdb::PinnableSlice serialized;
+	Status status = engine_->get(name_, stream.id().ToString(), &serialized);
+	if (!status.ok()) {
+		return status;
+	}
+	const char* data;
+	size_t dataSize;
+	if (!MsgpackReader::findField(serialized.data(), serialized.size(), "data", &data, &dataSize) ||
+		!MsgpackReader::extractFields(data, dataSize, fields, values)) {
+		return Status::Corruption("Failed to read document " + stream.id().ToString());
+	}
+	return Status::OK();
+}
+
+Status Collection::group(const json& filterOption, const std::string& field, const json& aggregates, json& groups, size_t memoryBudget) {
+	std::vector<Accumulator> accumulators;
+	Status status = parseAccumulators(aggregates, accumulators);
+	if (!status.ok()) {
+		return status;
+	}
+	std::shared_ptr<const std::set<std::string>> indexSet = engine_->getIndexSet(name_);
+	const std::set<std::string>& indexes = *indexSet;
+	groups = json::array();
+	// Same choice as for a sort on the group field: walk its index, or collect the matches of the filter
+	SortPlan plan;
+	status = planSort(filterOption, field, 0, indexes, plan);
+	if (!status.ok()) {
+		return status;
+	}
+	if (plan.index == field) {
+		return groupOnIndex(plan, field, accumulators, groups);
+	}
+	return groupInHashTable(filterOption, field, accumulators, indexes, memoryBudget, groups);
+}
+
+Status Collection::groupOnIndex(const SortPlan& plan, const std::string& field, const std::vector<Accumulator>& accumulators, json& groups) {
+	// Fields read besides the group value, which the keys hold
+	std::vector<std::string> valueFields;
+	for (const Accumulator& accumulator : accumulators) {
+		if (!accumulator.field.empty() && accumulator.field != field &&
+			std::find(valueFields.begin(), valueFields.end(), accumulator.field) == valueFields.end()) {
+			valueFields.push_back(accumulator.field);
+		}
+	}
+	std::shared_ptr<const IndexIncludes> includes = engine_->getIndexIncludes(name_);
+	auto include = includes->find(field);
+	bool covered = true;
+	for (const std::string& valueField : valueFields) {
+		covered = covered && include != includes->end() &&
+			std::find(include->second.begin(), include->second.end(), valueField) != include->second.end();
+	}
+	std::vector<std::string> readFields = predicateFields(plan.checks);
+	bool readDocuments = !plan.checks.empty() || !covered;
+	if (readDocuments) {
+		for (const std::string& valueField : valueFields) {
+			if (std::find(readFields.begin(), readFields.end(), valueField) == readFields.end()) {
+				readFields.push_back(valueField);
+			}
+		}
+	}
+
+	// Entries of a value are adjacent, its groups are complete when the walk reaches the next value.
+	// Values of different types with the same encoding, e.g. "true" and true, are separate groups whose
+	// entries interleave in doc id order, they are emitted in type tag order like groupInHashTable
+	IndexRangeStream walk(engine_, getIndexCfName(field), plan.lowerBound, plan.upperBound);
+	struct Group {
+		json value;
+		std::vector<Accumulator> accumulators;
+	};
+	std::map<char, Group> current;
+	std::string currentValue;
+	auto emit = [&groups, &current]() {
+		for (const auto& typed : current) {
+			json entry = { {"_id", typed.second.value} };
+			for (const Accumulator& accumulator : typed.second.accumulators) {
+				entry[accumulator.name] = accumulator.result();
+			}
+			groups.push_back(entry);
+		}
+		current.clear();
+	};
+	json values = json::object();
+	for (; walk.valid(); walk.next()) {
+		rocksdb::Slice encoded;
+		rocksdb::Slice docId;
+		char type;
+		if (!IndexKey::parse(walk.key(), &encoded, &docId, &type)) {
+			return Status::Corruption("Invalid index key");
+		}
+		// Arrays and objects belong to no group, as in groupInHashTable
+		if (type == IndexKey::kJson) {
+			continue;
+		}
+		if (readDocuments) {
+			Status status = readMatchFields(walk, QueryCursor::EntryDecoder(), readFields, values);
+			if (status.isNotFound()) {
+				continue;
+			}
+			if (!status.ok()) {
+				return status;
+			}
+			if (!plan.checks.empty() && !matchesFields(docId, values, plan.checks, plan.any)) {
+				continue;
+			}
+		}
+		else if (!valueFields.empty()) {
+			try {
+				values = walk.value().empty() ? json::object() :
+					json::from_msgpack(walk.value().data(), walk.value().data() + walk.value().size());
+			}
+			catch (const std::exception& e) {
+				return Status::Corruption("Failed to deserialize index entry: " + std::string(e.what()));
+			}
+		}
+		if (!current.empty() && encoded != rocksdb::Slice(currentValue)) {
+			emit();
+		}
+		currentValue = encoded.ToString();
+		auto group = current.find(type);
+		if (group == current.end()) {
+			group = current.emplace(type, Group()).first;
+			Status status = decodeIndexValue(encoded, type, group->second.value);
+			if (!status.ok()) {
+				return status;
+			}
+			group->second.accumulators = accumulators;
+		}
+		FieldPath::set(values, field, group->second.value);
+		for (Accumulator& accumulator : group->second.accumulators) {
+			accumulator.add(FieldPath::find(values, accumulator.field));
+		}
+	}
+	if (!walk.status().ok()) {
+		return walk.status();
+	}
+	if (!current.empty()) {
+		emit();
+	}
+	return Status::OK();
+}
+
+namespace {
+	// Sorted run of partial groups written when the hash table outgrows its budget.
+	// Records are keyLength(4) key stateLength(4) msgpack([group value, accumulator states...])
+	class GroupRun {
+	public:
+		GroupRun() : file_(std::tmpfile()) {}
+		~GroupRun() {
+			if (file_ != nullptr) {
+				std::fclose(file_);
+			}
+		}
+		bool ok() const { return file_ != nullptr; }
+
+		bool write(const std::string& key, const json& state) {
+			std::vector<uint8_t> encoded = json::to_msgpack(state);
+			return writeBlock(key.data(), key.size()) && writeBlock(encoded.data(), encoded.size());
+		}
+
+		// Start reading the records back, from the first one
+		bool rewind() {
+			return std::fseek(file_, 0, SEEK_SET) == 0 && next();
+		}
+
+		// Move to the next record, false at the end of the run or on a read error
+		bool next() {
+			std::string state;
+			valid_ = readBlock(key_) && readBlock(state);
+			if (valid_) {
+				state_ = json::from_msgpack(state);
+			}
+			return valid_;
+		}
+
+		bool valid() const { return valid_; }
+		const std::string& key() const { return key_; }
+		const json& state() const { return state_; }
+
+	private:
+		bool writeBlock(const void* data, size_t size) {
+			uint32_t length = static_cast<uint32_t>(size);
+			return std::fwrite(&length, sizeof(length), 1, file_) == 1 && (size == 0 || std::fwrite(data, size, 1, file_) == 1);
+		}
+		bool readBlock(std::string& block) {
+			uint32_t length;
+			if (std::fread(&length, sizeof(length), 1, file_) != 1) {
+				return false;
+			}
+			block.resize(length);
+			return length == 0 || std::fread(&block[0], length, 1, file_) == 1;
+		}
+		std::FILE* file_;
+		std::string key_;
+		json state_;
+		bool valid_ = false;
+	};
+}
+
+Status Collection::groupInHashTable(const json& filterOption, const std::string& field, const std::vector<Accumulator>& accumulators,
+	const std::set<std::string>& indexes, size_t memoryBudget, json& groups) {
+	std::unique_ptr<DocIdStream> stream;
+	Status status;
+	if (filterOption.is_null() || filterOption.empty()) {
+		status = createScanStream(std::vector<IndexPredicate>(), false, stream);
+	}
+	else {
+		status = createFindStream(filterOption, QueryOptions(), indexes, stream);
+	}
+	if (!status.ok()) {
+		return status;
+	}
+	std::vector<std::string> fields(1, field);
+	for (const Accumulator& accumulator : accumulators) {
+		if (!accumulator.field.empty() && std::find(fields.begin(), fields.end(), accumulator.field) == fields.end()) {
+			fields.push_back(accumulator.field);
+		}
+	}
+	QueryCursor::EntryDecoder decoder = coveredDecoder(*stream, fields);
+
+	// Groups are keyed by their encoded value and type tag, "true" and true or null and "" encode alike.
+	// The keys order them like the index, by value first
+	struct Group {
+		json value;
+		std::vector<Accumulator> accumulators;
+	};
+	std::unordered_map<std::string, Group> table;
+	size_t memory = 0;
+	const size_t groupSize = sizeof(Group) + accumulators.size() * sizeof(Accumulator) + 64;
+	std::vector<std::unique_ptr<GroupRun>> runs;
+	auto sortedKeys = [&table]() -> std::vector<std::string> {
+		std::vector<std::string> keys;
+		keys.reserve(table.size());
+		for (const auto& entry : table) {
+			keys.push_back(entry.first);
+		}
+		std::sort(keys.begin(), keys.end());
+		return keys;
+	};
+	auto spill = [&]() -> Status {
+		std::unique_ptr<GroupRun> run(new GroupRun());
+		if (!run->ok()) {
+			return Status::IOError("Failed to create a spill file for $group");
+		}
+		for (const std::string& key : sortedKeys()) {
+			const Group& group = table[key];
+			json state = json::array({ group.value });
+			for (const Accumulator& accumulator : group.accumulators) {
+				state.push_back(accumulator.state());
+			}
+			if (!run->write(key, state)) {
+				return Status::IOError("Failed to write a spill file for $group");
+			}
+		}
+		runs.push_back(std::move(run));
+		table.clear();
+		memory = 0;
+		return Status::OK();
+	};
+
+	json values = json::object();
+	for (; stream->valid(); stream->next()) {
+		status = readMatchFields(*stream, decoder, fields, values);
+		if (status.isNotFound()) {
+			continue;
+		}
+		if (!status.ok()) {
+			return status;
+		}
+		// Documents without the field, or with an array or object in it, have no index entry and no group
+		const json* value = FieldPath::find(values, field);
+		if (value == nullptr || value->is_structured()) {
+			continue;
+		}
+		std::string key = parseValue(*value) + '\0' + indexValueType(*value);
+		auto it = table.find(key);
+		if (it == table.end()) {
+			Group group;
+			group.value = *value;
+			group.accumulators = accumulators;
+			it = table.emplace(key, std::move(group)).first;
+			memory += groupSize + 2 * key.size();
+		}
+		for (Accumulator& accumulator : it->second.accumulators) {
+			accumulator.add(FieldPath::find(values, accumulator.field));
+		}
+		if (memory > memoryBudget) {
+			status = spill();
+			if (!status.ok()) {
+				return status;
+			}
+		}
+	}
+	if (!stream->status().ok()) {
+		return stream->status();
+	}
+
+	auto emit = [&groups](const json& value, const std::vector<Accumulator>& state) {
+		json entry = { {"_id", value} };
+		for (const Accumulator& accumulator : state) {
+			entry[accumulator.name] = accumulator.result();
+		}
+		groups.push_back(entry);
+	};
+	if (runs.empty()) {
+		for (const std::string& key : sortedKeys()) {
+			emit(table[key].value, table[key].accumulators);
+		}
+		return Status::OK();
+	}
+
+	// Merge the sorted runs, the partial states of a group are combined as its records come up
+	status = spill();
+	if (!status.ok()) {
+		return status;
+	}
+	auto greater = [&runs](size_t a, size_t b) { return runs[a]->key() > runs[b]->key(); };
+	std::vector<size_t> heap;
+	for (size_t i = 0; i < runs.size(); i++) {
+		if (runs[i]->rewind()) {
+			heap.push_back(i);
+		}
+	}
+	std::make_heap(heap.begin(), heap.end(), greater);
+	while (!heap.empty()) {
+		std::string key = runs[heap.front()]->key();
+		json value;
+		std::vector<Accumulator> merged = accumulators;
+		while (!heap.empty() && runs[heap.front()]->key() == key) {
+			std::pop_heap(heap.begin(), heap.end(), greater);
+			GroupRun* run = runs[heap.back()].get();
+			const json& state = run->state();
+			value = state[0];
+			for (size_t i = 0; i < merged.size(); i++) {
+				Accumulator partial = accumulators[i];
+				partial.restore(state[i + 1]);
+				merged[i].merge(partial);
+			}
+			if (run->next()) {
+				std::push_heap(heap.begin(), heap.end(), greater);
+			}
+			else {
+				heap.pop_back();
+			}
+		}
+		emit(value, merged);
+	}
+	return Status::OK();
+}
+
+Status Collection::explain(const json& filterOption, json& plan, const QueryOptions& options) {
+	std::shared_ptr<const std::set<std::string>> indexSet = engine_->getIndexSet(name_);
+	const std::set<std::string>& indexes = *indexSet;
+	json filter;
+	std::string sortField;
+	bool descending = false;
+	Status sortStatus = splitSort(filterOption, options, filter, sortField, descending);
+	if (!sortStatus.ok()) {
+		return sortStatus;
+	}
+	if (!sortField.empty()) {
+		SortPlan sortPlan;
+		sortStatus = planSort(filter, sortField, options.limit == 0 ? 0 : options.skip + options.limit, indexes, sortPlan);
+		if (!sortStatus.ok()) {
+			return sortStatus;
+		}
+		json node = { {"operator", "$orderBy"}, {"field", sortField}, {"order", descending ? "desc" : "asc"},
+			{"estimate", sortPlan.estimate}, {"checks", predicateFields(sortPlan.checks)} };
+		if (sortPlan.index.empty()) {
+			node["scan"] = "heap";
+		}
+		else {
+			node["scan"] = "index";
+			node["index"] = sortPlan.index;
+		}
+		plan = json::array({ node });
+		return Status::OK();
+	}
+	// Single operator outside of $and, scanned on its own index
+	auto describeOperator = [this, &indexes](const std::string& op, const json& ops, json& node) {
+		IndexPredicate predicate;
+		Status status = parsePredicate(op, ops, predicate);
+		if (!status.ok()) {
+			return status;
+		}
+		if (!resolvePredicateIndex(predicate, indexes).ok()) {
+			predicate.indexed = false;
+		}
+		else {
+			predicate.estimate = estimatePredicate(predicate);
+		}
+		node = describePredicate(predicate);
+		return Status::OK();
+	};
+	plan = json::array();
+	for (auto it = filterOption.begin(); it != filterOption.end(); it++) {
+		const std::string& op = it.key();
+		json node = { {"operator", op} };
+		if (op == "$and") {
+			std::vector<IndexPredicate> predicates;
+			size_t probeCount = 0;
+			Status status = parseAndConditions(it.value(), predicates);
+			if (!status.ok()) {
+				return status;
+			}
+			planAnd(predicates, indexes, probeCount);
+			node["probe"] = json::array();
+			node["fetch"] = json::array();
+			for (size_t i = 0; i < predicates.size(); i++) {
+				if (i == 0) {
+					node["driver"] = describePredicate(predicates[i]);
+				}
+				else {
+					node[i <= probeCount ? "probe" : "fetch"].push_back(describePredicate(predicates[i]));
+				}
+			}
+		}
+		else if (op == "$or") {
+			node["clauses"] = json::array();
+			if (it.value().is_array()) {
+				for (const json& item : it.value()) {
+					for (auto element = item.begin(); element != item.end(); element++) {
+						json clause;
+						Status status = describeOperator(element.key(), element.value(), clause);
+						if (!status.ok()) {
+							return status;
+						}
+						node["clauses"].push_back(clause);
+					}
+				}
+			}
+		}
+		else if (op == "$orderBy") {
+			if (it.value().is_object() && !it.value().empty()) {
+				node["field"] = it.value().begin().key();
+			}
+		}
+		else {
+			json scan;
+			Status status = describeOperator(op, it.value(), scan);
+			if (!status.ok()) {
+				return status;
+			}
+			node.update(scan);
+		}
+		plan.push_back(node);
+	}
+	return Status::OK();
+}
+
+QueryCursor::EntryDecoder Collection::coveredDecoder(const DocIdStream& stream, const std::vector<std::string>& projection) {
+	const IndexRangeStream* scan = stream.indexScan();
+	if (scan == nullptr) {
+		return QueryCursor::EntryDecoder();
+	}
+	std::string index = scan->indexCf().substr(getIndexCfName("").size());
+	std::vector<std::string> included;
+	std::shared_ptr<const IndexIncludes> includes = engine_->getIndexIncludes(name_);
+	auto include = includes->find(index);
+	if (include != includes->end()) {
+		included = include->second;
+	}
+	// The value of a single field index is read back from the key, a multikey key holds one element
+	std::string keyField = (index.find(',') == std::string::npos && !isMultikey(index)) ? index : "";
+	for (const std::string& field : projection) {
+		if (field != "_id" && field != keyField && std::find(included.begin(), included.end(), field) == included.end()) {
+			return QueryCursor::EntryDecoder();
+		}
+	}
+	return [this, keyField, projection](const rocksdb::Slice& key, const rocksdb::Slice& value, Document* doc) {
+		rocksdb::Slice encoded;
+		rocksdb::Slice docId;
+		char type;
+		if (!IndexKey::parse(key, &encoded, &docId, &type)) {
+			return Status::Corruption("Invalid index key");
+		}
+		json fields;
+		try {
+			fields = value.empty() ? json::object() :
+				json::from_msgpack(value.data(), value.data() + value.size());
+		}
+		catch (const std::exception& e) {
+			return Status::Corruption("Failed to deserialize index entry: " + std::string(e.what()));
+		}
+		json data = json::object();
+		for (const std::string& field : projection) {
+			if (field == "_id") {
+				data[field] = docId.ToString();
+			}
+			else if (field == keyField) {
+				json value;
+				Status status = decodeIndexValue(encoded, type, value);
+				if (!status.ok()) {
+					return status;
+				}
+				FieldPath::set(data, field, value);
+			}
+			else if (const json* value = FieldPath::find(fields, field)) {
+				FieldPath::set(data, field, *value);
+			}
+		}
+		*doc = Document(docId.ToString(), std::move(data));
+		return Status::OK();
+	};
+}
+
+Status Collection::decodeIndexValue(const rocksdb::Slice& encoded, char type, json& value) {
+	std::string bytes = encoded.ToString();
+	if ((type == IndexKey::kInt || type == IndexKey::kDouble) && bytes.size() != 8) {
+		return Status::Corruption("Invalid numeric index value");
+	}
+	switch (type) {
+	case IndexKey::kString:
+		value = bytes;
+		break;
+	case IndexKey::kInt:
+		value = decodeIntKey(bytes);
+		break;
+	case IndexKey::kDouble:
+		value = decodeDoubleKey(bytes);
+		break;
+	case IndexKey::kBool:
+		value = (bytes == "true");
+		break;
+	case IndexKey::kNull:
+		value = nullptr;
+		break;
+	default:
+		try {
+			value = json::parse(bytes);
+		}
+		catch (const std::exception& e) {
+			return Status::Corruption("Failed to parse index value: " + std::string(e.what()));
+		}
+	}
+	return Status::OK();
+}
+
+Status Collection::find(const json& filterOption, std::unique_ptr<QueryCursor>& cursor, const QueryOptions& options) {
+	std::shared_ptr<const std::set<std::string>> indexSet = engine_->getIndexSet(name_);
+	std::unique_ptr<DocIdStream> stream;
+	Status status = createFindStream(filterOption, options, *indexSet, stream);
+	if (!status.ok()) {
+		return status;
+	}
+	return openCursor(std::move(stream), options, cursor);
+}
+
+Status Collection::prepare(const json& filterOption, std::unique_ptr<PreparedQuery>& query) {
+	query.reset(new PreparedQuery(this, filterOption));
+	Status status = query->compile();
+	if (!status.ok()) {
+		query.reset();
+	}
+	return status;
+}
+
+Status Collection::collectIds(DocIdStream& stream, std::vector<std::string>& ids) {
+	const IndexRangeStream* scan = stream.indexScan();
+	if (stream.status().ok() && scan != nullptr && scan == &stream && scan->rangeScan()) {
+		// The whole range is returned, a large one is split and read on several threads
+		return engine_->fetchDocIdsForRange(scan->indexCf(), scan->lowerBound(), scan->upperBound(), ids, scan->reverse());
+	}
+	for (; stream.valid(); stream.next()) {
+		ids.push_back(stream.id().ToString());
+	}
+	return stream.status();
+}
+
+Status Collection::openCursor(std::unique_ptr<DocIdStream> stream, const QueryOptions& options, std::unique_ptr<QueryCursor>& cursor) {
+	QueryCursor::EntryDecoder decoder;
+	if (!options.projection.empty()) {
+		decoder = coveredDecoder(*stream, options.projection);
+	}
+	cursor = std::make_unique<QueryCursor>(name_, engine_, std::move(stream), options, decoder);
+	return Status::OK();
+}
+
+std::vector<std::string> Collection::findDocument(const json& filterOption) {
+	std::vector<std::string> docIds;
+	std::string cacheKey;
+	uint64_t generation = 0;
+	if (queryCache_.enabled()) {
+		cacheKey = QueryCache::key(filterOption);
+		// A write committed while the query runs keeps its result out of the cache, see QueryCache::insert
+		if (queryCache_.lookup(cacheKey, docIds, &generation)) {
+			return docIds;
+		}
+	}
+	std::shared_ptr<const std::set<std::string>> indexSet = engine_->getIndexSet(name_);
+	std::unique_ptr<DocIdStream> stream;
+	Status status = createFindStream(filterOption, QueryOptions(), *indexSet, stream);
+	if (!status.ok()) {
+		std::cerr << "Error while finding doc:" << status.message() << std::endl;
+		return docIds;
+	}
+	status = collectIds(*stream, docIds);
+	if (!status.ok()) {
+		std::cerr << "Error while finding doc:" << status.message() << std::endl;
+	}
+	else if (!cacheKey.empty()) {
+		queryCache_.insert(cacheKey, filterOption, docIds, generation);
+	}
+	return docIds;
+}
+
+void Collection::setQueryCacheCapacity(size_t capacity) {
+	queryCache_.setCapacity(capacity);
+}
+
+QueryCacheStats Collection::queryCacheStats() const {
+	return queryCache_.stats();
+}
+
+void Collection::invalidateQueryCache(const std::set<std::string>& fields) {
+	if (!fields.empty()) {
+		queryCache_.invalidate(fields);
+	}
+}
+
+Status Collection::updateDocument(const std::string& id, const nlohmann::json& update, bool upsert) {
+	std::lock_guard<std::mutex> lock(collection_mutex_);
+	Document doc;
+	Status status = readDocument(id, doc);
+	bool exists = true;
+
+	if (status.isNotFound()) {
+		if (upsert) {
+			doc = Document(id, json::object());
+			doc.setValue("_id", id);
+			exists = false;
+		}
+		else {
+			return status;
+		}
+	}
+	else if (!status.ok()) {
 		std::cerr << "Failed to read doc:: " << status.message() << std::endl;
 		return status;
 	}
-	doc.applyUpdate(update);
+	Document updated = doc;
+	updated.applyUpdate(update);
+
+	// Index entries change together with the document in one batch. Only the entries that differ are
+	// written, so a $push or $pull on a multikey field adds or removes the entry of that element
+	WriteBatch batch(engine_);
+	std::shared_ptr<const std::set<std::string>> multikey = engine_->getMultikeyIndexes(name_);
+	for (const std::string& index : *engine_->getIndexSet(name_)) {
+		bool elements = multikey->count(index) != 0;
+		std::vector<std::string> before;
+		std::vector<std::string> after;
+		if (exists && hasIndexField(doc.data(), index)) {
+			before = documentIndexKeys(doc.data(), index, id, elements);
+			std::sort(before.begin(), before.end());
+		}
+		if (hasIndexField(updated.data(), index)) {
+			after = documentIndexKeys(updated.data(), index, id, elements);
+			std::sort(after.begin(), after.end());
+		}
+		for (const std::string& key : before) {
+			if (!std::binary_search(after.begin(), after.end(), key)) {
+				status = batch.remove(getIndexCfName(index), key);
+				if (!status.ok()) {
+					return status;
+				}
+			}
+		}
+		if (after.empty()) {
+			continue;
+		}
+		// Kept entries are rewritten when the fields they include changed
+		std::string value = indexEntryValue(updated, index);
+		bool rewrite = !before.empty() && value != indexEntryValue(doc, index);
+		for (const std::string& key : after) {
+			if (rewrite || !std::binary_search(before.begin(), before.end(), key)) {
+				status = batch.putIndex(getIndexCfName(index), key, value);
+				if (!status.ok()) {
+					return status;
+				}
+			}
+		}
+	}
+	auto serialized = updated.to_msgpack();
+	status = batch.put(name_, id, serialized);
+	if (!status.ok()) {
+		return status;
+	}
+	status = engine_->write(batch);
+	if (queryCache_.enabled()) {
+		// Only the fields whose value changed can change which filters match
+		std::set<std::string> fields;
+		collectFields(doc.data(), fields);
+		collectFields(updated.data(), fields);
+		for (auto it = fields.begin(); it != fields.end();) {
+			auto before = doc.data().find(*it);
+			auto after = updated.data().find(*it);
+			bool same = before != doc.data().end() && after != updated.data().end() && *before == *after;
+			it = same ? fields.erase(it) : std::next(it);
+		}
+		invalidateQueryCache(fields);
+	}
+	return status;
+}
+
+bool Collection::isMultikey(const std::string& index) {
+	return engine_->getMultikeyIndexes(name_)->count(index) != 0;
+}
 
-	return createDocument(doc);
+std::string Collection::indexEntryValue(const Document& doc, const std::string& index) {
+	std::string value;
+	std::shared_ptr<const IndexIncludes> includes = engine_->getIndexIncludes(name_);
+	auto include = includes->find(index);
+	if (include != includes->end()) {
+		std::vector<uint8_t> packed = json::to_msgpack(QueryCursor::project(doc.data(), include->second));
+		value.assign(packed.begin(), packed.end());
+	}
+	return value;
 }
 
-Status Collection::insertIfIndexFieldExists(const Document& doc, const std::string& index) {
-	// if index column has any values then add its entry in table
-	std::stringstream key;
-	key << parseValue(doc.data()[index]) << "#" << doc.id();
-	return engine_->putIndex(getIndexCfName(index), key.str(), doc.id());
+Status Collection::insertIfIndexFieldExists(const Document& doc, const std::string& index, WriteBatch& batch) {
+	// if index column has any values then add its entries in table, the doc id is part of the key
+	std::string value = indexEntryValue(doc, index);
+	for (const std::string& key : documentIndexKeys(doc.data(), index, doc.id(), isMultikey(index))) {
+		Status status = batch.putIndex(getIndexCfName(index), key, value);
+		if (!status.ok()) {
+			return status;
+		}
+	}
+	return Status::OK();
 }
 
-Status Collection::deleteIfIndexFieldExists(const Document& doc, const std::string& index) {
-	// if index column has any values then add its entry in table
-	std::stringstream key;
-	key << parseValue(doc.data()[index]) << "#" << doc.id();
-	return engine_->remove(getIndexCfName(index), key.str());
+Status Collection::deleteIfIndexFieldExists(const Document& doc, const std::string& index, WriteBatch& batch) {
+	// if index column has any values then remove its entries from table
+	for (const std::string& key : documentIndexKeys(doc.data(), index, doc.id(), isMultikey(index))) {
+		Status status = batch.remove(getIndexCfName(index), key);
+		if (!status.ok()) {
+			return status;
+		}
+	}
+	return Status::OK();
 }
 
 Status Collection::importFromJsonFile(const std::string& filePath) {
@@ -469,7 +2487,9 @@ Status Collection::importFromJsonFile(const std::string& filePath) {
 		int successCount = 0;
 		int failureCount = 0;
 
-		// Iterate through array of objects
+		// Collect the array into documents and write them in groups
+		std::vector<Document> docs;
+		docs.reserve(jsonData.size());
 		for (const auto& item : jsonData) {
 			// Ensure each item is an object
 			if (!item.is_object()) {
@@ -485,18 +2505,21 @@ Status Collection::importFromJsonFile(const std::string& filePath) {
 			}
 			else {
 				// Generate a unique ID if not provided
-				docId = "doc_" + std::to_string(successCount + failureCount);
+				docId = "doc_" + std::to_string(docs.size() + failureCount);
 			}
-			Document doc(docId, item);
-			Status status = createDocument(doc);
+			docs.emplace_back(docId, item);
+		}
 
-			if (status.ok()) {
+		std::vector<Status> statuses;
+		insertMany(docs, statuses);
+		for (size_t i = 0; i < docs.size(); i++) {
+			if (statuses[i].ok()) {
 				successCount++;
 			}
 			else {
 				failureCount++;
-				std::cerr << "Failed to import document " << docId << ": "
-					<< status.message() << std::endl;
+				std::cerr << "Failed to import document " << docs[i].id() << ": "
+					<< statuses[i].message() << std::endl;
 			}
 		}
 
@@ -519,7 +2542,24 @@ Status Collection::exportAllToJsonAsync(const std::string& exportPath) {
 }
 
 bool Collection::hasIndexField(const json& doc, const std::string& field) {
-	return doc.contains(field);
+	for (const std::string& name : indexFields(field)) {
+		if (FieldPath::find(doc, name) == nullptr) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<std::string> Collection::indexFields(const std::string& index) {
+	std::vector<std::string> fields;
+	size_t start = 0;
+	size_t comma;
+	while ((comma = index.find(',', start)) != std::string::npos) {
+		fields.push_back(index.substr(start, comma - start));
+		start = comma + 1;
+	}
+	fields.push_back(index.substr(start));
+	return fields;
 }
 
 // Simple ID generation
@@ -554,8 +2594,6 @@ void Collection::waitForExportOperation() {
 }
 
 Collection::~Collection() {
-	for (std::string index : engine_->getIndexNames(name_)) {
-		deleteIndex(index);
-	}
+	// Indexes are kept in the catalog, they are only dropped by deleteIndex and dropCollection
 	waitForExportOperation();
 }
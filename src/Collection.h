@@ -4,6 +4,11 @@
 #include "StorageEngine.h"
 #include "Document.h"
 #include "Cursor.h"
+#include "QueryCursor.h"
+#include "MsgpackReader.h"
+#include "FieldPath.h"
+#include "QueryCache.h"
+#include "PreparedQuery.h"
 #ifdef _WIN32
 #include <process.h>
 #pragma comment(lib, "ws2_32.lib")
@@ -33,14 +38,31 @@ namespace anudb {
 		// Create a document in the collection
 		Status createDocument(Document& doc);
 
+		// Create documents in groups of batchSize, each group committed as a single write.
+		// statuses receives the outcome of every document in input order
+		Status insertMany(std::vector<Document>& docs, std::vector<Status>& statuses, size_t batchSize = 1000);
+
 		// Delete a document from the collection
 		Status deleteDocument(const std::string& id);
 
+		// Delete documents in groups of batchSize, each group committed as a single write
+		Status deleteMany(const std::vector<std::string>& ids, std::vector<Status>& statuses, size_t batchSize = 1000);
+
 		// Get indexes
 		Status getIndex(std::vector<std::string>& indexes) const;
 
-		// Create an index
-		Status createIndex(const std::string& index);
+		// Create an index. A comma separated list of fields creates a compound index, see below.
+		// options {"include": [fields]} stores these fields in every index entry, queries projecting
+		// only included fields (and the indexed field itself) are answered without reading documents.
+		// {"multikey": true} indexes every distinct element of an array value on its own, so $eq and $in
+		// on one element are index lookups. Such an index does not order or group its field.
+		// An existing index is not changed, delete it first to create it with other options
+		Status createIndex(const std::string& index, const json& options = json::object());
+
+		// Create a compound index, e.g. createIndex({"device", "ts"}). Keys hold the values of the fields
+		// in order, so equality on the leading fields plus a range on the next one is a single index scan.
+		// The index is named after its fields joined by commas ("device,ts")
+		Status createIndex(std::initializer_list<std::string> fields);
 
 		// Remove an index
 		Status deleteIndex(const std::string& index);
@@ -51,9 +73,16 @@ namespace anudb {
 		// Read a document from the collection`-
 		Status readDocument(const std::string& id, Document& doc);
 
+		// Read documents by id with one batched lookup, missing ids are skipped
+		Status readDocuments(const std::vector<std::string>& ids, std::vector<Document>& docs);
+
 		// Read all documents from the collection
 		Status readAllDocuments(std::vector<Document>& docIds, uint64_t limit = 10);
 
+		// Read a page of documents in id order. continuation is the token returned with the previous page,
+		// empty for the first one, and is set to the token of the next page, empty after the last one
+		Status readAllDocuments(std::vector<Document>& docIds, uint64_t limit, std::string& continuation);
+
 		// Read all documents from the collection
 		Status exportAllToJsonAsync(const std::string &exportPath);
 
@@ -66,32 +95,205 @@ namespace anudb {
 		// find document from the collection whose filter option is matchin
 		std::vector<std::string> findDocument(const json& filterOption);
 
+		// Keep the ids returned by findDocument for up to capacity distinct filters, 0 (the default) disables
+		// the cache. A repeated filter is answered from the cache until a write changes one of the fields it
+		// reads, creating or deleting an index empties it
+		void setQueryCacheCapacity(size_t capacity);
+
+		// Hits, misses and invalidations of the findDocument cache
+		QueryCacheStats queryCacheStats() const;
+
+		// Streaming variant of findDocument, matches are pulled from the index as the cursor advances
+		// and skip/limit are applied before any document is read. options.projection limits the returned
+		// fields, when the scanned index holds all of them the documents are not read at all.
+		// options.sortField, or an $orderBy next to the filter, orders the matches: an index on the sort
+		// field is walked in order until skip + limit matches are found, otherwise the matches are ranked
+		// in a heap of skip + limit entries. The cursor must not outlive the collection
+		Status find(const json& filterOption, std::unique_ptr<QueryCursor>& cursor, const QueryOptions& options = QueryOptions());
+
+		// Parse a filter once for queries run many times with different values. Operands written as
+		// {"$param": name} are set with PreparedQuery::bind, e.g. {"$eq": {"device": {"$param": "device"}}}.
+		// The prepared query must not outlive the collection
+		Status prepare(const json& filterOption, std::unique_ptr<PreparedQuery>& query);
+
+		// Aggregate the matches of a filter without returning them. aggregates maps result names to
+		// {"$count": {}}, {"$sum": field}, {"$min": field}, {"$max": field} or {"$avg": field}. Values come
+		// from the scanned index keys or included fields when they hold the field, $min and $max of an indexed
+		// field filtered on nothing else read a single key. $sum and $avg skip values that are not numbers,
+		// $min and $max compare values like the index does
+		Status aggregate(const json& filterOption, const json& aggregates, json& result);
+
+		// Aggregate the matches of a filter per value of field, groups is set to an array of
+		// {"_id": value, name: result...} ordered like the index of field, aggregates as for aggregate().
+		// Documents without the field or with an array or object in it belong to no group. When field is
+		// indexed its index is walked in order and each group is complete once the walk leaves its value,
+		// otherwise the groups are built in a hash table that is written to sorted runs in temporary files
+		// whenever it outgrows memoryBudget bytes, and the runs are merged at the end
+		Status group(const json& filterOption, const std::string& field, const json& aggregates, json& groups,
+			size_t memoryBudget = 32 * 1024 * 1024);
+
+		// Describe how a filter would be executed: the index scanned for each operator, the estimated
+		// number of entries, and for $and which condition drives the scan and how the others are checked.
+		// A sorted query is described by the walk or heap that orders it
+		Status explain(const json& filterOption, json& plan, const QueryOptions& options = QueryOptions());
+
 		void waitForExportOperation();
 
 		~Collection();
 	private:
+		friend class PreparedQuery;
+		friend class Database;
+
+		// Running result of one aggregate, see aggregate()
+		struct Accumulator {
+			std::string name;
+			std::string op;
+			std::string field;
+			bool done = false;         // Answered from the ends of an index
+			uint64_t count = 0;        // Values seen, matches for $count
+			double sum = 0;
+			int64_t integerSum = 0;    // Exact sum while every value is an integer
+			bool integral = true;
+			std::string key;           // Encoded $min/$max value, compared like index values
+			json value;
+
+			// Add the field value of a match, nullptr when the match does not hold the field
+			void add(const json* input);
+			// Add the values seen by another accumulator of the same aggregate
+			void merge(const Accumulator& other);
+			json result() const;
+			// Partial result written to a spill file and read back by restore
+			json state() const;
+			void restore(const json& state);
+		};
+
 		std::string name_;
 		StorageEngine* engine_;
 		std::thread export_thread_;
+		QueryCache queryCache_;
+		// Drop the cached results that the writes of documents could change, fields are the changed fields
+		void invalidateQueryCache(const std::set<std::string>& fields);
 		std::string getIndexCfName(const std::string& index);
 		// Simple ID generation
 		std::string generateId() const;
-		// Check index field exist
+		// Check index field exist, every field of a compound index
 		bool hasIndexField(const json& doc, const std::string& field);
+		// Fields of an index, more than one for a compound index
+		std::vector<std::string> indexFields(const std::string& index);
+		// Index holds one entry per array element, see createIndex
+		bool isMultikey(const std::string& index);
+		// Value of the index entries of doc, the fields included in the index
+		std::string indexEntryValue(const Document& doc, const std::string& index);
 		// Insert doc id from index table
-		Status insertIfIndexFieldExists(const Document& doc, const std::string& index);
+		Status insertIfIndexFieldExists(const Document& doc, const std::string& index, WriteBatch& batch);
 		// Delete doc id from index table
-		Status deleteIfIndexFieldExists(const Document& doc, const std::string& index);
+		Status deleteIfIndexFieldExists(const Document& doc, const std::string& index, WriteBatch& batch);
+		// Document stored under id that a create would overwrite, found is false when there is none
+		Status readOverwritten(const std::string& id, Document& previous, bool& found);
+		// Add the entries of the stored documents to a registered index, after createIndex and when
+		// Database::open rebuilds an index written in an older key layout
+		Status backfillIndex(const std::string& index);
+		// Add document and its index entries to batch, previous is the document it overwrites if any
+		Status addDocumentToBatch(Document& doc, const std::set<std::string>& indexes, WriteBatch& batch, const Document* previous);
+		// Add removal of document and its index entries to batch
+		Status removeDocumentFromBatch(const Document& doc, const std::set<std::string>& indexes, WriteBatch& batch);
 		// parse value
-		std::string parseValue(const json& val);
+		static std::string parseValue(const json& val);
+		// Type tag of value stored in index keys
+		char indexValueType(const json& value);
+		// Index key of docId for value, see IndexKey
+		std::string makeIndexKey(const json& value, const std::string& docId);
+		// Index key of a document in index, the values of a compound index are joined by '\0'
+		std::string makeDocumentIndexKey(const json& doc, const std::string& index, const std::string& docId);
+		// Index keys of a document, one per distinct element of an array value when multikey is set
+		std::vector<std::string> documentIndexKeys(const json& doc, const std::string& index, const std::string& docId, bool multikey);
 
-		Status findDocumentsUsingEq(const json& eqOps, std::set<std::string>& indexes, std::vector<std::string>& docIds);
-		Status findDocumentsUsingGt(const json& gtOps, std::set<std::string>& indexes, std::vector<std::string>& docIds);
-		Status findDocumentsUsingLt(const json& ltOps, std::set<std::string>& indexes, std::vector<std::string>& docIds);
+		// Resolve a single field operator ($eq, $gt, $lt, $gte, $lte, $between, $in) to index key bounds
+		Status parsePredicate(const std::string& op, const json& ops, IndexPredicate& predicate);
+		Status parsePredicate(const std::string& op, const std::string& field, const json& operand, IndexPredicate& predicate);
+		// Pick the index scanned for a predicate, the field's own index or a compound index starting with it.
+		// conditions are the conditions of the $and holding the predicate, see conditionsCoverIndex
+		Status resolvePredicateIndex(IndexPredicate& predicate, const std::set<std::string>& indexes,
+			const std::vector<IndexPredicate>& conditions = std::vector<IndexPredicate>());
+		// A compound index only holds the documents having all of its fields. It answers conditions of an $and
+		// when each of its fields has one of them, which a document without the field never meets
+		bool conditionsCoverIndex(const std::string& index, const std::vector<IndexPredicate>& conditions);
+		// Replace equality predicates on the leading fields of a compound index, plus a predicate on the
+		// next field, by a single predicate on that index
+		void applyCompoundIndexes(std::vector<IndexPredicate>& predicates, const std::set<std::string>& indexes);
+		std::unique_ptr<DocIdStream> createPredicateStream(const IndexPredicate& predicate);
+		// Approximate number of index entries matching a resolved predicate
+		uint64_t estimatePredicate(const IndexPredicate& predicate);
+		// Id stream of a single condition, a scan when no index holds its field
+		Status createConditionStream(IndexPredicate predicate, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		// Conditions of an $and, those on the same field merged into a single predicate
+		Status parseAndConditions(const json& andOps, std::vector<IndexPredicate>& predicates);
+		// Add a condition of an $and, merged into the predicate on the same field if there is one.
+		// Conditions compared element by element stay apart, see markMultikey
+		void addAndCondition(std::vector<IndexPredicate>& predicates, const IndexPredicate& predicate);
+		Status parseOrConditions(const json& orOps, std::vector<IndexPredicate>& predicates);
+		// Conditions of a filter holding a single condition, an $and or an $or, any is set for $or
+		Status parseFilterConditions(const json& filterOption, std::vector<IndexPredicate>& predicates, bool& any);
+		// Order the conditions of an $and by estimated size, predicates[0] drives the scan, the next
+		// probeCount are intersected with it on the index and the rest are checked on the documents
+		void planAnd(std::vector<IndexPredicate>& predicates, const std::set<std::string>& indexes, size_t& probeCount);
+		// Ids of the index entries in the predicate's range, ordered by doc id
+		Status createSortedStream(const IndexPredicate& predicate, std::unique_ptr<DocIdStream>& stream);
+		// Id streams of the parsed conditions of an $and or an $or
+		Status createAndStream(std::vector<IndexPredicate> predicates, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		Status createOrStream(std::vector<IndexPredicate> predicates, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		// Id stream for a whole filter
+		Status createQueryStream(const json& filterOption, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		// Every id of a stream that was not moved yet
+		Status collectIds(DocIdStream& stream, std::vector<std::string>& ids);
+		// Cursor reading the documents of stream, projected from the index entries when they hold the projection
+		Status openCursor(std::unique_ptr<DocIdStream> stream, const QueryOptions& options, std::unique_ptr<QueryCursor>& cursor);
+		// Id stream of a find, ordered when options or the filter's $orderBy ask for it
+		Status createFindStream(const json& filterOption, const QueryOptions& options, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		// Sort field and filter of a find, $orderBy is taken out of the filter when it orders other conditions
+		Status splitSort(const json& filterOption, const QueryOptions& options, json& filter, std::string& sortField, bool& descending);
+		// Walk an index in the order of sortField when that reads fewer documents than ranking the matches of
+		// the filter, k is the number of matches needed, 0 for all of them
+		Status planSort(const json& filterOption, const std::string& sortField, uint64_t k, const std::set<std::string>& indexes, SortPlan& plan);
+		// after is the position of the last match of a previous page, only the matches ranked after it are returned
+		Status createSortStream(const json& filterOption, const std::string& sortField, bool descending, uint64_t k,
+			const std::string& after, const std::set<std::string>& indexes, std::unique_ptr<DocIdStream>& stream);
+		json describePredicate(const IndexPredicate& predicate);
+		// Fields read by a set of predicates
+		std::vector<std::string> predicateFields(const std::vector<IndexPredicate>& predicates);
+		// Evaluate predicates on the stored bytes of a document, only the fields in fields are decoded.
+		// any selects $or semantics, otherwise every predicate has to match
+		bool matchesSerialized(const rocksdb::Slice& docId, const rocksdb::Slice& serialized,
+			const std::vector<IndexPredicate>& predicates, const std::vector<std::string>& fields, bool any);
+		// Evaluate predicates on fields already decoded from a document, see matchesSerialized
+		bool matchesFields(const rocksdb::Slice& docId, const json& partial, const std::vector<IndexPredicate>& predicates, bool any);
+		// Flag the predicates compared element by element on array values: those on a multikey index
+		// and those on a field no index holds, so scans agree with a multikey index created later
+		void markMultikey(std::vector<IndexPredicate>& predicates);
+		// Check for FilteredStream, evaluates the predicates on the stored document of each id
+		FilteredStream::Predicate documentCheck(const std::vector<IndexPredicate>& predicates, bool any);
+		// Collection scan for filters on fields without an index, runs on several threads over disjoint key ranges
+		Status createScanStream(const std::vector<IndexPredicate>& predicates, bool any, std::unique_ptr<DocIdStream>& stream);
+		// Decoder answering projection from the entries of the index scanned by stream, empty if the index
+		// does not hold every projected field
+		QueryCursor::EntryDecoder coveredDecoder(const DocIdStream& stream, const std::vector<std::string>& projection);
+		// JSON value of an encoded index value, the inverse of parseValue
+		Status decodeIndexValue(const rocksdb::Slice& encoded, char type, json& value);
+		// Aggregates of aggregate() and group() with their names, in the order given
+		static Status parseAccumulators(const json& aggregates, std::vector<Accumulator>& accumulators);
+		// Values of fields for the current id of stream, from the scanned index entry with a decoder
+		// (see coveredDecoder), otherwise from the stored document
+		Status readMatchFields(const DocIdStream& stream, const QueryCursor::EntryDecoder& decoder,
+			const std::vector<std::string>& fields, json& values);
+		// group() on the index of field, within the bounds of plan
+		Status groupOnIndex(const SortPlan& plan, const std::string& field, const std::vector<Accumulator>& accumulators, json& groups);
+		// group() over the matches of a filter in a hash table of groups, spilled to sorted runs past memoryBudget
+		Status groupInHashTable(const json& filterOption, const std::string& field, const std::vector<Accumulator>& accumulators,
+			const std::set<std::string>& indexes, size_t memoryBudget, json& groups);
 
-		std::string encodeIntKey(int value);
+		static std::string encodeIntKey(int value);
 		int64_t decodeIntKey(const std::string& encoded);
-		std::string encodeDoubleKey(double value);
+		static std::string encodeDoubleKey(double value);
 		double decodeDoubleKey(const std::string& encoded);
 		std::mutex collection_mutex_;
 	};
@@ -35,8 +35,7 @@ Status Cursor::current(Document* doc) {
     }
 
     rocksdb::Slice valueSlice = iterator_->value();
-    std::vector<uint8_t> value(valueSlice.data(), valueSlice.data() + valueSlice.size());
-    *doc = Document::from_msgpack(value);
+    *doc = Document::from_msgpack(reinterpret_cast<const uint8_t*>(valueSlice.data()), valueSlice.size());
 
     return Status::OK();
 }
@@ -4,7 +4,21 @@ using namespace anudb;
 
 Status Database::open() {
     isDbOpen_ = true;
-    return engine_.open();
+    Status status = engine_.open();
+    if (!status.ok()) {
+        return status;
+    }
+    // Indexes written in an older key layout were emptied by the engine, they are rebuilt from the documents
+    for (const auto& entry : engine_.getIndexesToRebuild()) {
+        Collection* collection = getCollection(entry.first);
+        for (const std::string& index : entry.second) {
+            status = collection ? collection->backfillIndex(index) : engine_.dropIndex(entry.first, index);
+            if (!status.ok()) {
+                return status;
+            }
+        }
+    }
+    return engine_.finishIndexRebuild();
 }
 
 Status Database::close() {
@@ -13,6 +27,10 @@ Status Database::close() {
     return engine_.close();
 }
 
+size_t Database::getMemoryUsage() const {
+    return engine_.getMemoryUsage();
+}
+
 bool Database::isDbOpen() {
     return isDbOpen_;
 }
@@ -8,9 +8,13 @@ namespace anudb {
     // Database class representing the main ANUDB interface
     class Database {
     public:
-        Database(const std::string& dbPath) : engine_(dbPath) {}
+        // memoryBudget caps block cache and memtables of all collections and indexes together,
+        // 0 keeps the default per column family sizing
+        Database(const std::string& dbPath, size_t memoryBudget = 0) : engine_(dbPath, memoryBudget) {}
         Status open();
         Status close();
+        // Memory currently held by the block cache and memtables
+        size_t getMemoryUsage() const;
         Status createCollection(const std::string& name);
         Status dropCollection(const std::string& name);
 		Status readDocument(const std::string& collectionName, const std::string& id, Document& doc);
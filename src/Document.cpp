@@ -171,6 +171,11 @@ std::vector<uint8_t> Document::to_msgpack() const {
 
 // Deserialize from MessagePack format
 Document Document::from_msgpack(const std::vector<uint8_t>& msgpack_data) {
-    json j = json::from_msgpack(msgpack_data);
-    return Document{ j["_id"], j["data"] };
+    return from_msgpack(msgpack_data.data(), msgpack_data.size());
+}
+
+// Deserialize directly from a MessagePack buffer
+Document Document::from_msgpack(const uint8_t* data, size_t size) {
+    json j = json::from_msgpack(data, data + size);
+    return Document{ j["_id"].get<std::string>(), std::move(j["data"]) };
 }
\ No newline at end of file
@@ -42,6 +42,9 @@ namespace anudb {
         // Deserialize from MessagePack format
         static Document from_msgpack(const std::vector<uint8_t>& msgpack_data);
 
+        // Deserialize directly from a MessagePack buffer without copying it first
+        static Document from_msgpack(const uint8_t* data, size_t size);
+
     private:
         std::string id_;
         json data_;
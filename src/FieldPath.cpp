@@ -0,0 +1,83 @@
+#include "FieldPath.h"
+#include <unordered_map>
+
+using namespace anudb;
+
+std::string FieldPath::root(const std::string& field) {
+    return field.substr(0, field.find('.'));
+}
+
+const FieldPath::Compiled& FieldPath::compile(const std::string& field) {
+    // Per thread, so lookups take no lock. Filters name few distinct fields, the bound only guards
+    // against clients sending arbitrary names
+    static thread_local std::unordered_map<std::string, Compiled> compiled;
+    auto it = compiled.find(field);
+    if (it != compiled.end()) {
+        return it->second;
+    }
+    if (compiled.size() >= 1024) {
+        compiled.clear();
+    }
+    Compiled path;
+    std::string pointer;
+    size_t start = 0;
+    while (true) {
+        size_t dot = field.find('.', start);
+        path.keys.push_back(field.substr(start, dot == std::string::npos ? std::string::npos : dot - start));
+        // Json pointer escaping, see RFC 6901
+        pointer.push_back('/');
+        for (char c : path.keys.back()) {
+            if (c == '~') {
+                pointer += "~0";
+            }
+            else if (c == '/') {
+                pointer += "~1";
+            }
+            else {
+                pointer.push_back(c);
+            }
+        }
+        if (dot == std::string::npos) {
+            break;
+        }
+        start = dot + 1;
+    }
+    path.pointer = json::json_pointer(pointer);
+    return compiled.emplace(field, std::move(path)).first->second;
+}
+
+const json* FieldPath::find(const json& doc, const std::string& field) {
+    if (!doc.is_object()) {
+        return nullptr;
+    }
+    if (!nested(field)) {
+        auto it = doc.find(field);
+        return it == doc.end() ? nullptr : &*it;
+    }
+    const json* node = &doc;
+    for (const std::string& key : compile(field).keys) {
+        if (!node->is_object()) {
+            return nullptr;
+        }
+        auto it = node->find(key);
+        if (it == node->end()) {
+            return nullptr;
+        }
+        node = &*it;
+    }
+    return node;
+}
+
+const json& FieldPath::value(const json& doc, const std::string& field) {
+    static const json missing;
+    const json* found = find(doc, field);
+    return found != nullptr ? *found : missing;
+}
+
+void FieldPath::set(json& doc, const std::string& field, const json& value) {
+    if (!nested(field)) {
+        doc[field] = value;
+        return;
+    }
+    doc[compile(field).pointer] = value;
+}
@@ -0,0 +1,40 @@
+#ifndef FIELD_PATH_H
+#define FIELD_PATH_H
+
+#include "json.hpp"
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace anudb {
+
+    // Document fields named by a dotted path, "metadata.unique_id" is the unique_id key of the metadata
+    // object. A path is compiled once per thread into its keys and a json pointer, lookups then walk the
+    // keys without parsing the path. Names without a dot are top level fields
+    class FieldPath {
+    public:
+        static bool nested(const std::string& field) { return field.find('.') != std::string::npos; }
+
+        // Top level field holding the value, the field itself when it is not nested
+        static std::string root(const std::string& field);
+
+        // Value of field in doc, nullptr when a key on the path is missing or holds no object
+        static const json* find(const json& doc, const std::string& field);
+
+        // Value of field in doc, null when it is missing
+        static const json& value(const json& doc, const std::string& field);
+
+        // Set field in doc, the objects missing on its path are created
+        static void set(json& doc, const std::string& field, const json& value);
+
+    private:
+        struct Compiled {
+            std::vector<std::string> keys;
+            json::json_pointer pointer;
+        };
+        static const Compiled& compile(const std::string& field);
+    };
+}
+
+#endif // FIELD_PATH_H
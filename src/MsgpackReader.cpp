@@ -0,0 +1,211 @@
+#include "MsgpackReader.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace anudb;
+
+uint64_t MsgpackReader::readLength(const uint8_t* data, size_t pos, size_t width) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++) {
+        value = (value << 8) | data[pos + i];
+    }
+    return value;
+}
+
+size_t MsgpackReader::skipValue(const uint8_t* data, size_t size, size_t pos) {
+    // Containers add their elements to the values still to skip, so nesting needs no recursion
+    uint64_t pending = 1;
+    while (pending > 0) {
+        if (pos >= size) {
+            return 0;
+        }
+        pending--;
+        uint8_t type = data[pos];
+        size_t header = 1;        // Bytes before the payload, including any length field
+        size_t lengthWidth = 0;   // Width of a length field following the type byte
+        uint64_t payload = 0;
+        if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) {
+            // fixint, nil, bool
+        }
+        else if (type <= 0x8f) {
+            pending += 2 * static_cast<uint64_t>(type & 0x0f);
+        }
+        else if (type <= 0x9f) {
+            pending += type & 0x0f;
+        }
+        else if (type <= 0xbf) {
+            payload = type & 0x1f;
+        }
+        else {
+            switch (type) {
+            case 0xc4: case 0xd9: lengthWidth = 1; break;   // bin8, str8
+            case 0xc5: case 0xda: lengthWidth = 2; break;   // bin16, str16
+            case 0xc6: case 0xdb: lengthWidth = 4; break;   // bin32, str32
+            case 0xc7: lengthWidth = 1; header = 1; payload = 1; break;   // ext8, the type byte is part of the payload
+            case 0xc8: lengthWidth = 2; header = 1; payload = 1; break;
+            case 0xc9: lengthWidth = 4; header = 1; payload = 1; break;
+            case 0xca: payload = 4; break;
+            case 0xcb: payload = 8; break;
+            case 0xcc: case 0xd0: payload = 1; break;
+            case 0xcd: case 0xd1: payload = 2; break;
+            case 0xce: case 0xd2: payload = 4; break;
+            case 0xcf: case 0xd3: payload = 8; break;
+            case 0xd4: payload = 2; break;   // fixext, type byte plus data
+            case 0xd5: payload = 3; break;
+            case 0xd6: payload = 5; break;
+            case 0xd7: payload = 9; break;
+            case 0xd8: payload = 17; break;
+            case 0xdc: case 0xde: lengthWidth = 2; break;   // array16, map16
+            case 0xdd: case 0xdf: lengthWidth = 4; break;   // array32, map32
+            default:
+                return 0;
+            }
+        }
+        if (lengthWidth > 0) {
+            if (pos + 1 + lengthWidth > size) {
+                return 0;
+            }
+            uint64_t length = readLength(data, pos + 1, lengthWidth);
+            header += lengthWidth;
+            if (type == 0xdc || type == 0xdd) {
+                pending += length;
+            }
+            else if (type == 0xde || type == 0xdf) {
+                pending += 2 * length;
+            }
+            else {
+                payload += length;
+            }
+        }
+        if (payload > size || pos + header + payload > size) {
+            return 0;
+        }
+        pos += header + static_cast<size_t>(payload);
+    }
+    return pos;
+}
+
+bool MsgpackReader::readMapHeader(const uint8_t* data, size_t size, uint64_t* count, size_t* pos) {
+    if (size == 0) {
+        return false;
+    }
+    if ((data[0] & 0xf0) == 0x80) {
+        *count = data[0] & 0x0f;
+        *pos = 1;
+    }
+    else if (data[0] == 0xde && size >= 3) {
+        *count = readLength(data, 1, 2);
+        *pos = 3;
+    }
+    else if (data[0] == 0xdf && size >= 5) {
+        *count = readLength(data, 1, 4);
+        *pos = 5;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool MsgpackReader::readKey(const uint8_t* data, size_t pos, size_t keyEnd, size_t* keyStart) {
+    // Keys written by nlohmann::json are strings: fixstr, str8, str16 or str32
+    uint8_t type = data[pos];
+    if (type >= 0xa0 && type <= 0xbf) {
+        *keyStart = pos + 1;
+    }
+    else if (type == 0xd9) {
+        *keyStart = pos + 2;
+    }
+    else if (type == 0xda) {
+        *keyStart = pos + 3;
+    }
+    else if (type == 0xdb) {
+        *keyStart = pos + 5;
+    }
+    else {
+        return false;
+    }
+    return *keyStart <= keyEnd;
+}
+
+bool MsgpackReader::extractFields(const char* data, size_t size, const std::vector<std::string>& fields, json& out) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    out = json::object();
+    uint64_t count;
+    size_t pos;
+    if (!readMapHeader(bytes, size, &count, &pos)) {
+        return false;
+    }
+    // A nested field is read with the whole top level value holding it, see FieldPath. Fields sharing
+    // that value count once
+    auto rootLength = [](const std::string& field) { return std::min(field.find('.'), field.size()); };
+    size_t remaining = 0;
+    for (size_t i = 0; i < fields.size(); i++) {
+        size_t length = rootLength(fields[i]);
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = rootLength(fields[j]) == length && fields[j].compare(0, length, fields[i], 0, length) == 0;
+        }
+        remaining += seen ? 0 : 1;
+    }
+    for (uint64_t i = 0; i < count && remaining > 0; i++) {
+        size_t keyEnd = skipValue(bytes, size, pos);
+        if (keyEnd == 0) {
+            return false;
+        }
+        size_t valueEnd = skipValue(bytes, size, keyEnd);
+        if (valueEnd == 0) {
+            return false;
+        }
+        size_t keyStart;
+        if (readKey(bytes, pos, keyEnd, &keyStart)) {
+            size_t keyLength = keyEnd - keyStart;
+            for (const std::string& field : fields) {
+                if (rootLength(field) == keyLength && std::memcmp(field.data(), bytes + keyStart, keyLength) == 0) {
+                    std::string root = keyLength == field.size() ? std::string() : field.substr(0, keyLength);
+                    const std::string& key = root.empty() ? field : root;
+                    if (!out.contains(key)) {
+                        try {
+                            out[key] = json::from_msgpack(bytes + keyEnd, bytes + valueEnd);
+                        }
+                        catch (const std::exception&) {
+                            return false;
+                        }
+                        remaining--;
+                    }
+                    break;
+                }
+            }
+        }
+        pos = valueEnd;
+    }
+    return true;
+}
+
+bool MsgpackReader::findField(const char* data, size_t size, const std::string& field, const char** value, size_t* valueSize) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    uint64_t count;
+    size_t pos;
+    if (!readMapHeader(bytes, size, &count, &pos)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        size_t keyEnd = skipValue(bytes, size, pos);
+        if (keyEnd == 0) {
+            return false;
+        }
+        size_t valueEnd = skipValue(bytes, size, keyEnd);
+        if (valueEnd == 0) {
+            return false;
+        }
+        size_t keyStart;
+        if (readKey(bytes, pos, keyEnd, &keyStart) && keyEnd - keyStart == field.size() &&
+            std::memcmp(field.data(), bytes + keyStart, field.size()) == 0) {
+            *value = data + keyEnd;
+            *valueSize = valueEnd - keyEnd;
+            return true;
+        }
+        pos = valueEnd;
+    }
+    return false;
+}
@@ -0,0 +1,40 @@
+#ifndef MSGPACK_READER_H
+#define MSGPACK_READER_H
+
+#include "json.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace anudb {
+
+    // Reads selected top level fields straight from a serialized document. The values of other
+    // fields are skipped by their encoded length instead of being decoded, so filtering a stored
+    // document costs a walk over its bytes plus the decoding of the fields the filter needs
+    class MsgpackReader {
+    public:
+        // Decode the fields of a msgpack map that appear in fields into out, an object holding
+        // only the fields found. A dotted field ("metadata.unique_id") decodes its top level field.
+        // Returns false if data is not a well formed msgpack map
+        static bool extractFields(const char* data, size_t size, const std::vector<std::string>& fields, json& out);
+
+        // Locate the encoded value of field in a msgpack map without decoding anything.
+        // Returns false if the field is missing or data is not a well formed msgpack map
+        static bool findField(const char* data, size_t size, const std::string& field, const char** value, size_t* valueSize);
+
+    private:
+        // Read the element count of the map at the start of data, pos is set to its first key
+        static bool readMapHeader(const uint8_t* data, size_t size, uint64_t* count, size_t* pos);
+        // Bytes of the string key between pos and keyEnd, false if the key is not a string
+        static bool readKey(const uint8_t* data, size_t pos, size_t keyEnd, size_t* keyStart);
+        // Offset just past the value starting at pos, 0 if the value runs past size
+        static size_t skipValue(const uint8_t* data, size_t size, size_t pos);
+        // Read a big endian unsigned integer of width bytes at pos
+        static uint64_t readLength(const uint8_t* data, size_t pos, size_t width);
+    };
+}
+
+#endif // MSGPACK_READER_H
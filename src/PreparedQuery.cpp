@@ -0,0 +1,230 @@
+#include "PreparedQuery.h"
+#include "Collection.h"
+#include <algorithm>
+
+using namespace anudb;
+
+namespace {
+    // Name of the parameter when value is {"$param": name}
+    bool parameterName(const json& value, std::string* name) {
+        if (!value.is_object() || value.size() != 1 || value.begin().key() != "$param" || !value.begin().value().is_string()) {
+            return false;
+        }
+        *name = value.begin().value().get<std::string>();
+        return true;
+    }
+
+    void collectParameters(const json& value, std::vector<std::string>& names) {
+        std::string name;
+        if (parameterName(value, &name)) {
+            if (std::find(names.begin(), names.end(), name) == names.end()) {
+                names.push_back(name);
+            }
+        }
+        else if (value.is_structured()) {
+            for (const json& element : value) {
+                collectParameters(element, names);
+            }
+        }
+    }
+
+    json substitute(const json& value, const std::map<std::string, json>& values) {
+        std::string name;
+        if (parameterName(value, &name)) {
+            return values.at(name);
+        }
+        if (!value.is_structured()) {
+            return value;
+        }
+        json result = value;
+        for (auto it = result.begin(); it != result.end(); it++) {
+            *it = substitute(*it, values);
+        }
+        return result;
+    }
+}
+
+PreparedQuery::PreparedQuery(Collection* collection, const json& filter)
+    : collection_(collection), filter_(filter), shape_(kFilter) {
+}
+
+Status PreparedQuery::compile() {
+    if (!filter_.is_object()) {
+        return Status::InvalidArgument("A query filter has to be an object");
+    }
+    collectParameters(filter_, parameters_);
+    if (filter_.size() != 1 || filter_.begin().key() == "$orderBy") {
+        return Status::OK();
+    }
+    const std::string& op = filter_.begin().key();
+    std::vector<const json*> items;
+    if (op == "$and" || op == "$or") {
+        const json& list = filter_.begin().value();
+        if (!list.is_array()) {
+            return Status::InvalidArgument("Operator " + op + " expects an array of conditions");
+        }
+        for (const json& item : list) {
+            if (!item.is_object()) {
+                return Status::InvalidArgument("Operator " + op + " expects an array of conditions");
+            }
+            for (auto element = item.begin(); element != item.end(); element++) {
+                items.push_back(&element.value());
+                conditions_.push_back(Condition());
+                conditions_.back().op = element.key();
+            }
+        }
+        shape_ = (op == "$and") ? kAnd : kOr;
+    }
+    else {
+        items.push_back(&filter_.begin().value());
+        conditions_.push_back(Condition());
+        conditions_.back().op = op;
+        shape_ = kCondition;
+    }
+    for (size_t i = 0; i < conditions_.size(); i++) {
+        const json& ops = *items[i];
+        if (!ops.is_object() || ops.empty()) {
+            return Status::InvalidArgument("Operator " + conditions_[i].op + " expects {field: value}");
+        }
+        Condition& condition = conditions_[i];
+        condition.field = ops.begin().key();
+        condition.operand = ops.begin().value();
+        collectParameters(condition.operand, condition.parameters);
+        if (condition.parameters.empty()) {
+            Status status = encode(i);
+            if (!status.ok()) {
+                return status;
+            }
+        }
+    }
+    return Status::OK();
+}
+
+Status PreparedQuery::encode(size_t index) {
+    Condition& condition = conditions_[index];
+    Status status;
+    std::string name;
+    if (parameterName(condition.operand, &name)) {
+        // The operand is the parameter itself, its value is encoded without building a filter
+        status = collection_->parsePredicate(condition.op, condition.field, values_.at(name), condition.predicate);
+    }
+    else {
+        status = collection_->parsePredicate(condition.op, condition.field, substitute(condition.operand, values_), condition.predicate);
+    }
+    condition.encoded = status.ok();
+    return status;
+}
+
+Status PreparedQuery::bind(const std::string& name, const json& value) {
+    if (std::find(parameters_.begin(), parameters_.end(), name) == parameters_.end()) {
+        return Status::InvalidArgument("Unknown query parameter " + name);
+    }
+    values_[name] = value;
+    for (size_t i = 0; i < conditions_.size(); i++) {
+        const std::vector<std::string>& used = conditions_[i].parameters;
+        if (std::find(used.begin(), used.end(), name) == used.end()) {
+            continue;
+        }
+        bool complete = true;
+        for (const std::string& parameter : used) {
+            complete = complete && values_.count(parameter) != 0;
+        }
+        if (complete) {
+            Status status = encode(i);
+            if (!status.ok()) {
+                return status;
+            }
+        }
+    }
+    return Status::OK();
+}
+
+json PreparedQuery::boundFilter() const {
+    return substitute(filter_, values_);
+}
+
+Status PreparedQuery::createStream(const QueryOptions& options, std::unique_ptr<DocIdStream>& stream) {
+    for (const std::string& parameter : parameters_) {
+        if (values_.count(parameter) == 0) {
+            return Status::InvalidArgument("Query parameter " + parameter + " is not bound");
+        }
+    }
+    refreshIndexes();
+    if (shape_ == kFilter || !options.sortField.empty()) {
+        return collection_->createFindStream(boundFilter(), options, *indexSet_, stream);
+    }
+    const std::set<std::string>& indexes = usableIndexes_;
+    for (const Condition& condition : conditions_) {
+        if (!condition.encoded) {
+            return Status::InvalidArgument("Condition on " + condition.field + " could not be encoded");
+        }
+    }
+    std::string position;
+    if (!options.continuation.empty() && !QueryCursor::decodeToken(options.continuation, &position)) {
+        return Status::InvalidArgument("Invalid continuation token");
+    }
+    Status status;
+    if (shape_ == kCondition) {
+        status = collection_->createConditionStream(conditions_[0].predicate, indexes, stream);
+    }
+    else {
+        std::vector<IndexPredicate> predicates;
+        for (const Condition& condition : conditions_) {
+            if (shape_ == kAnd) {
+                collection_->addAndCondition(predicates, condition.predicate);
+            }
+            else {
+                predicates.push_back(condition.predicate);
+            }
+        }
+        status = (shape_ == kAnd) ? collection_->createAndStream(std::move(predicates), indexes, stream) :
+            collection_->createOrStream(std::move(predicates), indexes, stream);
+    }
+    if (!status.ok()) {
+        return status;
+    }
+    if (!position.empty()) {
+        stream->resume(position);
+    }
+    return stream->status();
+}
+
+void PreparedQuery::refreshIndexes() {
+    // The version is read first, a set taken after a later change is only refreshed once more
+    uint64_t version = collection_->engine_->getIndexVersion();
+    if (indexSet_ && version == indexVersion_) {
+        return;
+    }
+    indexSet_ = collection_->engine_->getIndexSet(collection_->name_);
+    indexVersion_ = version;
+    usableIndexes_.clear();
+    for (const std::string& index : *indexSet_) {
+        bool usable = true;
+        for (const std::string& field : collection_->indexFields(index)) {
+            usable = usable && std::any_of(conditions_.begin(), conditions_.end(),
+                [&field](const Condition& condition) { return condition.field == field; });
+        }
+        if (usable) {
+            usableIndexes_.insert(index);
+        }
+    }
+}
+
+Status PreparedQuery::find(std::unique_ptr<QueryCursor>& cursor, const QueryOptions& options) {
+    std::unique_ptr<DocIdStream> stream;
+    Status status = createStream(options, stream);
+    if (!status.ok()) {
+        return status;
+    }
+    return collection_->openCursor(std::move(stream), options, cursor);
+}
+
+Status PreparedQuery::findDocument(std::vector<std::string>& ids) {
+    ids.clear();
+    std::unique_ptr<DocIdStream> stream;
+    Status status = createStream(QueryOptions(), stream);
+    if (!status.ok()) {
+        return status;
+    }
+    return collection_->collectIds(*stream, ids);
+}
@@ -0,0 +1,69 @@
+#ifndef PREPARED_QUERY_H
+#define PREPARED_QUERY_H
+
+#include "QueryCursor.h"
+#include <map>
+
+namespace anudb {
+
+    class Collection;
+
+    // Filter parsed once by Collection::prepare and run many times. Operands of conditions may be
+    // parameters, {"$param": name}, set with bind() before a run. Conditions with constant operands are
+    // encoded into index key bounds when the query is prepared and bind() encodes the conditions using
+    // the parameter, so a run only plans and opens the index scans. The indexes that can serve the
+    // conditions are looked up again only after an index of the database is created or dropped. Filters
+    // with several top level operators or an $orderBy are planned on each run with the bound values in place
+    class PreparedQuery {
+    public:
+        // Set a parameter, the conditions using it are encoded again
+        Status bind(const std::string& name, const json& value);
+
+        // Names of the parameters of the filter, in the order they appear
+        const std::vector<std::string>& parameters() const { return parameters_; }
+
+        // Run with the bound values, see Collection::find. Every parameter has to be bound
+        Status find(std::unique_ptr<QueryCursor>& cursor, const QueryOptions& options = QueryOptions());
+
+        // Ids of the matches, see Collection::findDocument
+        Status findDocument(std::vector<std::string>& ids);
+
+    private:
+        friend class Collection;
+        PreparedQuery(Collection* collection, const json& filter);
+
+        // Split the filter into conditions and encode those without parameters
+        Status compile();
+        Status encode(size_t condition);
+        Status createStream(const QueryOptions& options, std::unique_ptr<DocIdStream>& stream);
+        // Take the index set again when the index catalog changed since the last run
+        void refreshIndexes();
+        // The filter with every parameter replaced by its value
+        json boundFilter() const;
+
+        // {field: operand} of a single field operator, see Collection::parsePredicate
+        struct Condition {
+            std::string op;
+            std::string field;
+            json operand;                          // May hold parameters
+            std::vector<std::string> parameters;   // Parameters used by operand
+            IndexPredicate predicate;              // Encoded once every parameter is bound
+            bool encoded = false;
+        };
+        enum Shape { kCondition, kAnd, kOr, kFilter };
+
+        Collection* collection_;
+        json filter_;
+        Shape shape_;
+        std::vector<Condition> conditions_;
+        std::vector<std::string> parameters_;
+        std::map<std::string, json> values_;
+        // Index set of the last run and its catalog version. usableIndexes_ holds the indexes whose
+        // fields all have a condition, the only ones the planner can pick for the conditions
+        std::shared_ptr<const std::set<std::string>> indexSet_;
+        std::set<std::string> usableIndexes_;
+        uint64_t indexVersion_ = 0;
+    };
+}
+
+#endif // PREPARED_QUERY_H
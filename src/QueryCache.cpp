@@ -0,0 +1,118 @@
+#include "QueryCache.h"
+#include "FieldPath.h"
+#include <algorithm>
+
+using namespace anudb;
+
+void QueryCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    evict();
+}
+
+std::string QueryCache::key(const json& filter) {
+    // json objects keep their keys sorted, the dump is canonical
+    return filter.dump();
+}
+
+std::vector<std::string> QueryCache::filterFields(const json& filter) {
+    std::vector<std::string> fields;
+    std::vector<const json*> pending(1, &filter);
+    while (!pending.empty()) {
+        const json* node = pending.back();
+        pending.pop_back();
+        if (node->is_array()) {
+            for (const json& element : *node) {
+                pending.push_back(&element);
+            }
+        }
+        else if (node->is_object()) {
+            for (auto it = node->begin(); it != node->end(); it++) {
+                if (!it.key().empty() && it.key()[0] == '$') {
+                    pending.push_back(&it.value());
+                }
+                else {
+                    // Writes report the top level fields they change, a nested field is read from its top level one
+                    std::string field = FieldPath::root(it.key());
+                    if (std::find(fields.begin(), fields.end(), field) == fields.end()) {
+                        fields.push_back(field);
+                    }
+                }
+            }
+        }
+    }
+    return fields;
+}
+
+bool QueryCache::lookup(const std::string& key, std::vector<std::string>& ids, uint64_t* generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        stats_.misses++;
+        *generation = generation_;
+        return false;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    ids = it->second->ids;
+    stats_.hits++;
+    return true;
+}
+
+void QueryCache::insert(const std::string& key, const json& filter, const std::vector<std::string>& ids, uint64_t generation) {
+    std::vector<std::string> fields = filterFields(filter);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation != generation_ || capacity_ == 0 || index_.count(key) != 0) {
+        return;
+    }
+    Entry entry;
+    entry.key = key;
+    entry.fields = std::move(fields);
+    entry.ids = ids;
+    entries_.push_front(std::move(entry));
+    index_[key] = entries_.begin();
+    evict();
+}
+
+void QueryCache::invalidate(const std::set<std::string>& fields) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_++;
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        // A filter without fields, such as {}, may match any document
+        bool stale = it->fields.empty();
+        for (const std::string& field : it->fields) {
+            if (fields.count(field) != 0) {
+                stale = true;
+                break;
+            }
+        }
+        if (stale) {
+            index_.erase(it->key);
+            it = entries_.erase(it);
+            stats_.invalidations++;
+        }
+        else {
+            it++;
+        }
+    }
+}
+
+void QueryCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_++;
+    entries_.clear();
+    index_.clear();
+}
+
+QueryCacheStats QueryCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueryCacheStats stats = stats_;
+    stats.entries = entries_.size();
+    return stats;
+}
+
+void QueryCache::evict() {
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+    }
+}
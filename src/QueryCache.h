@@ -0,0 +1,75 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include "json.hpp"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace anudb {
+
+    // Counters of a query cache, see Collection::setQueryCacheCapacity
+    struct QueryCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0;   // Entries dropped because a write changed a field they filter on
+        size_t entries = 0;
+    };
+
+    // Ids matched by recently used filters, least recently used entries are evicted past the capacity.
+    // Each entry remembers the fields its filter reads, a write drops the entries reading a field it changed.
+    // A result computed while a write was committed could be stale, so results are only stored when no
+    // invalidation happened since the lookup that missed
+    class QueryCache {
+    public:
+        explicit QueryCache(size_t capacity = 0) : capacity_(capacity) {}
+
+        // Maximum number of filters kept, 0 disables the cache and drops its entries
+        void setCapacity(size_t capacity);
+        bool enabled() const { return capacity_.load(std::memory_order_relaxed) != 0; }
+
+        // Canonical form of a filter, object keys are ordered so equal filters give equal keys
+        static std::string key(const json& filter);
+
+        // Top level document fields read by a filter, from every key that is not an operator
+        static std::vector<std::string> filterFields(const json& filter);
+
+        // Copy the ids cached for key, counts a hit or a miss. On a miss generation is set to the
+        // counter of invalidations, to be passed to insert with the computed result
+        bool lookup(const std::string& key, std::vector<std::string>& ids, uint64_t* generation);
+
+        // Store the ids matched by filter, ignored if an invalidation happened since the lookup
+        void insert(const std::string& key, const json& filter, const std::vector<std::string>& ids, uint64_t generation);
+
+        // Drop the entries whose filter reads one of fields, or no field at all, called once a write is committed
+        void invalidate(const std::set<std::string>& fields);
+
+        // Drop every entry, results may change order when the indexes change
+        void clear();
+
+        QueryCacheStats stats() const;
+
+    private:
+        struct Entry {
+            std::string key;
+            std::vector<std::string> fields;
+            std::vector<std::string> ids;
+        };
+        void evict();
+        std::atomic<size_t> capacity_;
+        std::list<Entry> entries_;   // Most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+        uint64_t generation_ = 0;
+        QueryCacheStats stats_;
+        mutable std::mutex mutex_;
+    };
+}
+
+#endif // QUERY_CACHE_H
@@ -0,0 +1,581 @@
+#include "QueryCursor.h"
+#include "FieldPath.h"
+
+#include <algorithm>
+
+using namespace anudb;
+
+void DocIdStream::seek(const rocksdb::Slice& target) {
+    while (valid() && id().compare(target) < 0) {
+        next();
+    }
+}
+
+void DocIdStream::resume(const rocksdb::Slice& position) {
+    // Ordered by id, the stream continues at the first id greater than position
+    std::string target = position.ToString();
+    seek(target);
+    if (valid() && id() == rocksdb::Slice(target)) {
+        next();
+    }
+}
+
+IndexRangeStream::IndexRangeStream(StorageEngine* engine, const std::string& indexCf, const std::string& lowerBound,
+    const std::string& upperBound, bool reverse, bool prefixSeek)
+    : indexCf_(indexCf), lowerBound_(lowerBound), upperBound_(upperBound), reverse_(reverse), prefixSeek_(false), valueIndex_(0) {
+
+    // A prefix seek needs the lower bound to be the start of a value, see IndexKey::lowerBound
+    prefixSeek = prefixSeek && !lowerBound_.empty() && lowerBound_.back() == '\0';
+    prefixSeek_ = prefixSeek;
+    // The slices point into the members, which live as long as the iterator
+    lowerSlice_ = rocksdb::Slice(lowerBound_);
+    upperSlice_ = rocksdb::Slice(upperBound_);
+    rocksdb::ReadOptions readOptions = prefixSeek ? RocksDBOptimizer::getReadOptions() : RocksDBOptimizer::getScanReadOptions();
+    if (!lowerBound_.empty()) {
+        readOptions.iterate_lower_bound = &lowerSlice_;
+    }
+    if (!upperBound_.empty()) {
+        readOptions.iterate_upper_bound = &upperSlice_;
+    }
+    status_ = engine->newIterator(indexCf, readOptions, iterator_);
+    if (!status_.ok()) {
+        return;
+    }
+    if (prefixSeek) {
+        // Seek to a key inside the prefix domain so that the prefix bloom filters are consulted
+        iterator_->Seek(IndexKey::seekKey(lowerBound_.substr(0, lowerBound_.size() - 1)));
+    }
+    else if (reverse_) {
+        iterator_->SeekToLast();
+    }
+    else {
+        iterator_->SeekToFirst();
+    }
+}
+
+IndexRangeStream::IndexRangeStream(StorageEngine* engine, const std::string& indexCf, std::vector<std::string> values, bool prefixSeek)
+    : indexCf_(indexCf), reverse_(false), prefixSeek_(prefixSeek), values_(std::move(values)), valueIndex_(0) {
+    rocksdb::ReadOptions readOptions = prefixSeek ? RocksDBOptimizer::getReadOptions() : RocksDBOptimizer::getScanReadOptions();
+    status_ = engine->newIterator(indexCf, readOptions, iterator_);
+    if (!status_.ok()) {
+        return;
+    }
+    seekValue();
+}
+
+void IndexRangeStream::seekValue() {
+    // Values are sorted, the iterator only moves forward. A seek is needed only when the iterator is
+    // behind the value, a key past it means nothing is stored for the value
+    for (; valueIndex_ < values_.size(); valueIndex_++) {
+        const std::string& start = values_[valueIndex_];
+        if (!iterator_->Valid() || iterator_->key().compare(start) < 0) {
+            if (!iterator_->status().ok()) {
+                return;
+            }
+            iterator_->Seek(IndexKey::seekKey(start.substr(0, start.size() - 1)));
+        }
+        if (iterator_->Valid() && iterator_->key().starts_with(start)) {
+            return;
+        }
+    }
+}
+
+bool IndexRangeStream::valid() const {
+    return iterator_ && iterator_->Valid() && (values_.empty() || valueIndex_ < values_.size());
+}
+
+void IndexRangeStream::next() {
+    if (!values_.empty()) {
+        iterator_->Next();
+        if (!iterator_->Valid() || !iterator_->key().starts_with(values_[valueIndex_])) {
+            // A prefix iterator stops at the end of the value, the next one has to be sought
+            valueIndex_++;
+            seekValue();
+        }
+    }
+    else if (reverse_) {
+        iterator_->Prev();
+    }
+    else {
+        iterator_->Next();
+    }
+}
+
+rocksdb::Slice IndexRangeStream::id() const {
+    // The value holds the included fields, the doc id is read from the key
+    return IndexKey::docId(iterator_->key());
+}
+
+Status IndexRangeStream::status() const {
+    if (!status_.ok()) {
+        return status_;
+    }
+    if (iterator_ && !iterator_->status().ok()) {
+        return Status::IOError(iterator_->status().ToString());
+    }
+    return Status::OK();
+}
+
+void IndexRangeStream::seek(const rocksdb::Slice& target) {
+    if (!prefixSeek_ || reverse_ || !values_.empty()) {
+        DocIdStream::seek(target);
+        return;
+    }
+    if (!valid() || id().compare(target) >= 0) {
+        return;
+    }
+    // Entries of a single value are ordered by doc id, so the index can seek straight to the target.
+    // Type 0 sorts before every type tag, the key is the first one of target within the value
+    iterator_->Seek(IndexKey::make(lowerBound_.substr(0, lowerBound_.size() - 1), target.ToString(), 0));
+}
+
+void IndexRangeStream::resume(const rocksdb::Slice& position) {
+    if (!iterator_ || !status_.ok()) {
+        return;
+    }
+    std::string key = position.ToString();
+    if (!values_.empty()) {
+        // Values before the one holding the key are done, a key before every value changes nothing
+        valueIndex_ = std::upper_bound(values_.begin(), values_.end(), key) - values_.begin();
+        if (valueIndex_ == 0) {
+            seekValue();
+            return;
+        }
+        valueIndex_--;
+        iterator_->Seek(key);
+        if (iterator_->Valid() && iterator_->key() == rocksdb::Slice(key)) {
+            iterator_->Next();
+        }
+        if (!iterator_->Valid() || !iterator_->key().starts_with(values_[valueIndex_])) {
+            valueIndex_++;
+            seekValue();
+        }
+        return;
+    }
+    // Keys are unique, the bounds of the read options still apply
+    if (reverse_) {
+        iterator_->SeekForPrev(key);
+        if (iterator_->Valid() && iterator_->key() == rocksdb::Slice(key)) {
+            iterator_->Prev();
+        }
+    }
+    else {
+        iterator_->Seek(key);
+        if (iterator_->Valid() && iterator_->key() == rocksdb::Slice(key)) {
+            iterator_->Next();
+        }
+    }
+}
+
+void VectorStream::seek(const rocksdb::Slice& target) {
+    // Gallop from the current position, targets are usually close by
+    size_t step = 1;
+    size_t low = pos_;
+    while (low + step < ids_.size() && rocksdb::Slice(ids_[low + step]).compare(target) < 0) {
+        low += step;
+        step *= 2;
+    }
+    size_t high = std::min(low + step + 1, ids_.size());
+    pos_ = std::lower_bound(ids_.begin() + low, ids_.begin() + high, target,
+        [](const std::string& id, const rocksdb::Slice& value) { return rocksdb::Slice(id).compare(value) < 0; }) - ids_.begin();
+}
+
+void VectorStream::resume(const rocksdb::Slice& position) {
+    if (positions_.empty()) {
+        DocIdStream::resume(position);
+        return;
+    }
+    // Positions are unique but not sorted, the ids up to the one at position are done
+    for (size_t i = pos_; i < positions_.size(); i++) {
+        if (rocksdb::Slice(positions_[i]) == position) {
+            pos_ = i + 1;
+            return;
+        }
+    }
+}
+
+ConcatStream::ConcatStream(std::vector<std::unique_ptr<DocIdStream>> streams)
+    : streams_(std::move(streams)), current_(0) {
+    skipExhausted();
+}
+
+void ConcatStream::skipExhausted() {
+    // An error ends the whole stream, it is reported through status()
+    while (current_ < streams_.size() && !streams_[current_]->valid() && streams_[current_]->status().ok()) {
+        current_++;
+    }
+}
+
+bool ConcatStream::valid() const {
+    return current_ < streams_.size() && streams_[current_]->valid();
+}
+
+void ConcatStream::next() {
+    streams_[current_]->next();
+    skipExhausted();
+}
+
+rocksdb::Slice ConcatStream::id() const {
+    return streams_[current_]->id();
+}
+
+Status ConcatStream::status() const {
+    return current_ < streams_.size() ? streams_[current_]->status() : Status::OK();
+}
+
+std::string ConcatStream::position() const {
+    std::string position(4, '\0');
+    for (size_t i = 0; i < 4; i++) {
+        position[i] = static_cast<char>((current_ >> (8 * (3 - i))) & 0xFF);
+    }
+    return position + streams_[current_]->position();
+}
+
+void ConcatStream::resume(const rocksdb::Slice& position) {
+    if (position.size() < 4) {
+        return;
+    }
+    size_t stream = 0;
+    for (size_t i = 0; i < 4; i++) {
+        stream = (stream << 8) | static_cast<unsigned char>(position[i]);
+    }
+    // The streams before are done
+    current_ = std::min(stream, streams_.size());
+    if (current_ < streams_.size()) {
+        streams_[current_]->resume(rocksdb::Slice(position.data() + 4, position.size() - 4));
+    }
+    skipExhausted();
+}
+
+FilteredStream::FilteredStream(std::unique_ptr<DocIdStream> input, Predicate predicate)
+    : input_(std::move(input)), predicate_(std::move(predicate)) {
+    skipRejected();
+}
+
+void FilteredStream::skipRejected() {
+    while (input_->valid()) {
+        Status status;
+        if (predicate_(input_->id(), &status)) {
+            return;
+        }
+        if (!status.ok()) {
+            status_ = status;
+            return;
+        }
+        input_->next();
+    }
+}
+
+void FilteredStream::seek(const rocksdb::Slice& target) {
+    input_->seek(target);
+    skipRejected();
+}
+
+void FilteredStream::resume(const rocksdb::Slice& position) {
+    input_->resume(position);
+    skipRejected();
+}
+
+bool FilteredStream::valid() const {
+    return status_.ok() && input_->valid();
+}
+
+void FilteredStream::next() {
+    input_->next();
+    skipRejected();
+}
+
+rocksdb::Slice FilteredStream::id() const {
+    return input_->id();
+}
+
+Status FilteredStream::status() const {
+    return status_.ok() ? input_->status() : status_;
+}
+
+IntersectStream::IntersectStream(std::vector<std::unique_ptr<DocIdStream>> streams)
+    : streams_(std::move(streams)), valid_(false) {
+    align();
+}
+
+void IntersectStream::align() {
+    valid_ = false;
+    if (streams_.empty()) {
+        return;
+    }
+    // Seek the inputs in turn to the largest id seen so far until they all agree
+    std::string target;
+    size_t agreed = 0;
+    for (size_t i = 0; agreed < streams_.size(); i = (i + 1) % streams_.size()) {
+        DocIdStream* stream = streams_[i].get();
+        if (agreed > 0) {
+            stream->seek(target);
+        }
+        if (!stream->valid()) {
+            return;
+        }
+        if (agreed > 0 && stream->id() == rocksdb::Slice(target)) {
+            agreed++;
+        }
+        else {
+            target = stream->id().ToString();
+            agreed = 1;
+        }
+    }
+    valid_ = true;
+}
+
+void IntersectStream::seek(const rocksdb::Slice& target) {
+    if (!valid_ || streams_[0]->id().compare(target) >= 0) {
+        return;
+    }
+    streams_[0]->seek(target);
+    align();
+}
+
+bool IntersectStream::valid() const {
+    return valid_;
+}
+
+void IntersectStream::next() {
+    streams_[0]->next();
+    align();
+}
+
+rocksdb::Slice IntersectStream::id() const {
+    return streams_[0]->id();
+}
+
+Status IntersectStream::status() const {
+    for (const std::unique_ptr<DocIdStream>& stream : streams_) {
+        Status status = stream->status();
+        if (!status.ok()) {
+            return status;
+        }
+    }
+    return Status::OK();
+}
+
+UnionStream::UnionStream(std::vector<std::unique_ptr<DocIdStream>> streams)
+    : streams_(std::move(streams)) {
+    for (size_t i = 0; i < streams_.size(); i++) {
+        push(i);
+    }
+}
+
+bool UnionStream::greater(size_t a, size_t b) const {
+    return streams_[a]->id().compare(streams_[b]->id()) > 0;
+}
+
+void UnionStream::push(size_t stream) {
+    if (!streams_[stream]->valid()) {
+        // An error ends the whole stream, it is reported through status()
+        Status status = streams_[stream]->status();
+        if (!status.ok()) {
+            status_ = status;
+            heap_.clear();
+        }
+        return;
+    }
+    heap_.push_back(stream);
+    std::push_heap(heap_.begin(), heap_.end(), [this](size_t a, size_t b) { return greater(a, b); });
+}
+
+void UnionStream::seek(const rocksdb::Slice& target) {
+    // target may point into the id of an input, which moves when the input is sought
+    std::string start = target.ToString();
+    std::vector<size_t> inputs;
+    inputs.swap(heap_);
+    for (size_t stream : inputs) {
+        streams_[stream]->seek(start);
+        push(stream);
+    }
+}
+
+bool UnionStream::valid() const {
+    return status_.ok() && !heap_.empty();
+}
+
+void UnionStream::next() {
+    // Advance every input positioned on the current id, this drops the duplicates
+    std::string current = id().ToString();
+    while (status_.ok() && !heap_.empty() && streams_[heap_.front()]->id() == rocksdb::Slice(current)) {
+        std::pop_heap(heap_.begin(), heap_.end(), [this](size_t a, size_t b) { return greater(a, b); });
+        size_t stream = heap_.back();
+        heap_.pop_back();
+        streams_[stream]->next();
+        push(stream);
+    }
+}
+
+rocksdb::Slice UnionStream::id() const {
+    return streams_[heap_.front()]->id();
+}
+
+Status UnionStream::status() const {
+    return status_;
+}
+
+bool IndexPredicate::matches(const rocksdb::Slice& indexKey) const {
+    if (!lowerBound.empty() && indexKey.compare(rocksdb::Slice(lowerBound)) < 0) {
+        return false;
+    }
+    if (!upperBound.empty() && indexKey.compare(rocksdb::Slice(upperBound)) >= 0) {
+        return false;
+    }
+    if (values.empty()) {
+        return true;
+    }
+    // The only value that can start the key is the last one not greater than it
+    auto it = std::upper_bound(values.begin(), values.end(), indexKey,
+        [](const rocksdb::Slice& key, const std::string& value) { return key.compare(rocksdb::Slice(value)) < 0; });
+    return it != values.begin() && indexKey.starts_with(rocksdb::Slice(*(it - 1)));
+}
+
+bool IndexPredicate::empty() const {
+    return !lowerBound.empty() && !upperBound.empty() && lowerBound >= upperBound;
+}
+
+void IndexPredicate::intersect(const IndexPredicate& other) {
+    if (!other.lowerBound.empty() && (lowerBound.empty() || other.lowerBound > lowerBound)) {
+        lowerBound = other.lowerBound;
+    }
+    if (!other.upperBound.empty() && (upperBound.empty() || other.upperBound < upperBound)) {
+        upperBound = other.upperBound;
+    }
+    equality = equality || other.equality;
+    reverse = false;
+    if (values.empty() && other.values.empty()) {
+        return;
+    }
+    std::vector<std::string> candidates = values.empty() ? other.values : values;
+    std::vector<std::string> narrowed;
+    for (const std::string& value : candidates) {
+        bool inBounds = (lowerBound.empty() || value >= lowerBound) && (upperBound.empty() || value < upperBound);
+        if (inBounds && (other.values.empty() || std::binary_search(other.values.begin(), other.values.end(), value))) {
+            narrowed.push_back(value);
+        }
+    }
+    values = std::move(narrowed);
+    if (values.empty()) {
+        // No value is left, cross the bounds so that nothing matches
+        lowerBound = IndexKey::upperBound("");
+        upperBound = IndexKey::lowerBound("");
+    }
+}
+
+QueryCursor::QueryCursor(const std::string& collectionName, StorageEngine* engine, std::unique_ptr<DocIdStream> stream,
+    const QueryOptions& options, EntryDecoder decoder)
+    : collectionName_(collectionName), engine_(engine), stream_(std::move(stream)), limit_(options.limit), returned_(0),
+    projection_(options.projection), decoder_(std::move(decoder)) {
+    // Skipped entries only advance the index iterator, no ids are copied and no documents are read
+    for (uint64_t i = 0; i < options.skip && stream_->valid(); i++) {
+        stream_->next();
+    }
+}
+
+bool QueryCursor::withinLimit() const {
+    return limit_ == 0 || returned_ < limit_;
+}
+
+bool QueryCursor::isValid() const {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    return withinLimit() && stream_->valid();
+}
+
+void QueryCursor::next() {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    if (!withinLimit() || !stream_->valid()) return;
+    returned_++;
+    // Do not touch the index once the limit is reached
+    if (withinLimit()) {
+        stream_->next();
+    }
+}
+
+std::string QueryCursor::currentId() {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    if (!withinLimit() || !stream_->valid()) return "";
+    return stream_->id().ToString();
+}
+
+Status QueryCursor::current(Document* doc) {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    if (!withinLimit() || !stream_->valid()) {
+        return Status::InvalidArgument("Invalid cursor position");
+    }
+    const IndexRangeStream* scan = stream_->indexScan();
+    if (decoder_ && scan != nullptr) {
+        // Covered query, every projected field is stored in the index entry
+        return decoder_(scan->key(), scan->value(), doc);
+    }
+    rocksdb::PinnableSlice serialized;
+    Status status = engine_->get(collectionName_, stream_->id().ToString(), &serialized);
+    if (!status.ok()) {
+        return status;
+    }
+    try {
+        *doc = Document::from_msgpack(reinterpret_cast<const uint8_t*>(serialized.data()), serialized.size());
+    }
+    catch (const std::exception& e) {
+        return Status::Corruption("Failed to deserialize document: " + std::string(e.what()));
+    }
+    if (!projection_.empty()) {
+        *doc = Document(doc->id(), project(doc->data(), projection_));
+    }
+    return Status::OK();
+}
+
+std::string QueryCursor::continuationToken() const {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    // Once the limit is reached next() leaves the stream on the last returned match
+    if (!stream_->valid()) return "";
+    return encodeToken(stream_->position());
+}
+
+std::string QueryCursor::encodeToken(const std::string& position) {
+    static const char digits[] = "0123456789abcdef";
+    std::string token;
+    token.reserve(position.size() * 2);
+    for (unsigned char c : position) {
+        token.push_back(digits[c >> 4]);
+        token.push_back(digits[c & 0x0f]);
+    }
+    return token;
+}
+
+bool QueryCursor::decodeToken(const std::string& token, std::string* position) {
+    if (token.size() % 2 != 0) {
+        return false;
+    }
+    auto digit = [](char c) {
+        return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+    };
+    position->clear();
+    for (size_t i = 0; i < token.size(); i += 2) {
+        int high = digit(token[i]);
+        int low = digit(token[i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        position->push_back(static_cast<char>((high << 4) | low));
+    }
+    return true;
+}
+
+json QueryCursor::project(const json& data, const std::vector<std::string>& fields) {
+    json projected = json::object();
+    for (const std::string& field : fields) {
+        // A dotted field is copied into the same nested place, see FieldPath
+        const json* value = FieldPath::find(data, field);
+        if (value != nullptr) {
+            FieldPath::set(projected, field, *value);
+        }
+    }
+    return projected;
+}
+
+Status QueryCursor::status() const {
+    std::lock_guard<std::mutex> lock(cursor_mutex_);
+    return stream_->status();
+}
@@ -0,0 +1,287 @@
+#ifndef QUERY_CURSOR_H
+#define QUERY_CURSOR_H
+
+#include "StorageEngine.h"
+#include "Document.h"
+#include <functional>
+#include <memory>
+
+namespace anudb {
+
+    class IndexRangeStream;
+
+    // Stream of matching document ids, produced lazily by a query plan
+    class DocIdStream {
+    public:
+        virtual ~DocIdStream() {}
+
+        // Check if the stream points to a valid id
+        virtual bool valid() const = 0;
+
+        // Move to the next id
+        virtual void next() = 0;
+
+        // Id at the current position, only valid until the next call to next()
+        virtual rocksdb::Slice id() const = 0;
+
+        // Error that ended the stream early, OK when the stream is simply exhausted
+        virtual Status status() const = 0;
+
+        // Move forward to the first id not less than target, only meaningful on streams ordered by id
+        virtual void seek(const rocksdb::Slice& target);
+
+        // Index scan whose current entry is the current id, nullptr when ids come from several sources
+        virtual const IndexRangeStream* indexScan() const { return nullptr; }
+
+        // Place of the current id in the order of the stream, the id itself for streams ordered by id
+        virtual std::string position() const { return id().ToString(); }
+
+        // Move past the entry at position, taken from a stream of the same plan. Only entries after it are
+        // read, so a page further down costs the same as the first one
+        virtual void resume(const rocksdb::Slice& position);
+    };
+
+    // Doc ids of the index entries between two index key bounds, read straight from the index iterator
+    class IndexRangeStream : public DocIdStream {
+    public:
+        // Bounds are index key bounds (see IndexKey), an empty bound leaves that side open.
+        // prefixSeek restricts the scan to the value prefix of lowerBound so that prefix bloom filters are used
+        IndexRangeStream(StorageEngine* engine, const std::string& indexCf, const std::string& lowerBound,
+            const std::string& upperBound, bool reverse = false, bool prefixSeek = false);
+
+        // Entries of several values, each one the start of a key (see IndexKey::lowerBound), sorted.
+        // One iterator visits them in order with forward seeks, ids come out by value then doc id
+        IndexRangeStream(StorageEngine* engine, const std::string& indexCf, std::vector<std::string> values, bool prefixSeek);
+
+        bool valid() const override;
+        void next() override;
+        rocksdb::Slice id() const override;
+        Status status() const override;
+        void seek(const rocksdb::Slice& target) override;
+        const IndexRangeStream* indexScan() const override { return this; }
+        // The index key, entries are ordered by value then doc id
+        std::string position() const override { return key().ToString(); }
+        void resume(const rocksdb::Slice& position) override;
+
+        // Current index entry, the value holds the fields included in the index
+        rocksdb::Slice key() const { return iterator_->key(); }
+        rocksdb::Slice value() const { return iterator_->value(); }
+        const std::string& indexCf() const { return indexCf_; }
+
+        // Scan of a key range between bounds, not of values or of the prefix of a single value
+        bool rangeScan() const { return values_.empty() && !prefixSeek_; }
+        const std::string& lowerBound() const { return lowerBound_; }
+        const std::string& upperBound() const { return upperBound_; }
+        bool reverse() const { return reverse_; }
+
+    private:
+        void seekValue();
+        std::string indexCf_;
+        std::string lowerBound_;
+        std::string upperBound_;
+        rocksdb::Slice lowerSlice_;
+        rocksdb::Slice upperSlice_;
+        bool reverse_;
+        bool prefixSeek_;
+        std::vector<std::string> values_;
+        size_t valueIndex_;
+        std::unique_ptr<rocksdb::Iterator> iterator_;
+        Status status_;
+    };
+
+    // Ids that were already materialized
+    class VectorStream : public DocIdStream {
+    public:
+        explicit VectorStream(std::vector<std::string> ids) : ids_(std::move(ids)), pos_(0) {}
+
+        // Ids in another order than by id, positions holds the place of each one (e.g. its sort key)
+        VectorStream(std::vector<std::string> ids, std::vector<std::string> positions)
+            : ids_(std::move(ids)), positions_(std::move(positions)), pos_(0) {}
+
+        bool valid() const override { return pos_ < ids_.size(); }
+        void next() override { pos_++; }
+        rocksdb::Slice id() const override { return rocksdb::Slice(ids_[pos_]); }
+        Status status() const override { return Status::OK(); }
+        void seek(const rocksdb::Slice& target) override;
+        std::string position() const override { return positions_.empty() ? ids_[pos_] : positions_[pos_]; }
+        void resume(const rocksdb::Slice& position) override;
+
+    private:
+        std::vector<std::string> ids_;
+        std::vector<std::string> positions_;
+        size_t pos_;
+    };
+
+    // Streams one after another, used when a filter holds several top level operators
+    class ConcatStream : public DocIdStream {
+    public:
+        explicit ConcatStream(std::vector<std::unique_ptr<DocIdStream>> streams);
+
+        bool valid() const override;
+        void next() override;
+        rocksdb::Slice id() const override;
+        Status status() const override;
+        // The number of the current stream (4 bytes) followed by the position in it
+        std::string position() const override;
+        void resume(const rocksdb::Slice& position) override;
+
+    private:
+        void skipExhausted();
+        std::vector<std::unique_ptr<DocIdStream>> streams_;
+        size_t current_;
+    };
+
+    // Ids present in every input, the inputs must be ordered by id. Inputs leapfrog each other
+    // with seek() so that long runs of non matching ids are skipped instead of read
+    class IntersectStream : public DocIdStream {
+    public:
+        explicit IntersectStream(std::vector<std::unique_ptr<DocIdStream>> streams);
+
+        bool valid() const override;
+        void next() override;
+        rocksdb::Slice id() const override;
+        Status status() const override;
+        void seek(const rocksdb::Slice& target) override;
+
+    private:
+        void align();
+        std::vector<std::unique_ptr<DocIdStream>> streams_;
+        bool valid_;
+    };
+
+    // Ids present in any input, each returned once. The inputs must be ordered by id, they are merged
+    // through a min heap so the output is ordered by id as well
+    class UnionStream : public DocIdStream {
+    public:
+        explicit UnionStream(std::vector<std::unique_ptr<DocIdStream>> streams);
+
+        bool valid() const override;
+        void next() override;
+        rocksdb::Slice id() const override;
+        Status status() const override;
+        void seek(const rocksdb::Slice& target) override;
+
+    private:
+        bool greater(size_t a, size_t b) const;
+        void push(size_t stream);
+        std::vector<std::unique_ptr<DocIdStream>> streams_;
+        std::vector<size_t> heap_;
+        Status status_;
+    };
+
+    // Ids of an input stream that pass a check, the check may end the stream with an error
+    class FilteredStream : public DocIdStream {
+    public:
+        typedef std::function<bool(const rocksdb::Slice& id, Status* status)> Predicate;
+
+        FilteredStream(std::unique_ptr<DocIdStream> input, Predicate predicate);
+
+        bool valid() const override;
+        void next() override;
+        rocksdb::Slice id() const override;
+        Status status() const override;
+        void seek(const rocksdb::Slice& target) override;
+        const IndexRangeStream* indexScan() const override { return input_->indexScan(); }
+        std::string position() const override { return input_->position(); }
+        void resume(const rocksdb::Slice& position) override;
+
+    private:
+        void skipRejected();
+        std::unique_ptr<DocIdStream> input_;
+        Predicate predicate_;
+        Status status_;
+    };
+
+    // Single field predicate resolved to a range of index keys
+    struct IndexPredicate {
+        std::string field;
+        std::string index;        // Index holding the bounds, a compound index when field lists several fields
+        std::string lowerBound;   // Index key bounds, see IndexKey. Empty leaves that side open
+        std::string upperBound;
+        bool reverse = false;     // Scan from the upper end
+        bool equality = false;    // Bounds cover a single value, the scan can use prefix bloom filters
+        std::vector<std::string> values;   // Starts of the keys of each $in value, sorted. Empty when not a list
+        bool indexed = true;      // False when no index holds the field, documents are scanned instead
+        bool multikey = false;    // A document matches when one element of an array value does, see Collection::markMultikey
+        uint64_t estimate = 0;    // Approximate number of matching index entries
+
+        // Check an index key of the field against the bounds and the values
+        bool matches(const rocksdb::Slice& indexKey) const;
+
+        // No key can match, the bounds are crossed
+        bool empty() const;
+
+        // Narrow the bounds to the keys matching both predicates on the same field
+        void intersect(const IndexPredicate& other);
+    };
+
+    // Ordered walk of an index chosen for a sorted query, see Collection::planSort
+    struct SortPlan {
+        std::string index;        // Index walked in sort order, empty when the matches are ranked in a bounded heap
+        std::string lowerBound;   // Index key bounds of the walk, equal values of the leading fields and the sort field range
+        std::string upperBound;
+        std::vector<IndexPredicate> checks;   // Conditions left to check on the documents
+        bool any = false;         // The checks are alternatives ($or), otherwise all have to match
+        uint64_t estimate = 0;    // Approximate number of documents read
+    };
+
+    // Paging of a query, skip and limit are applied on the id stream before any document is read
+    struct QueryOptions {
+        uint64_t skip = 0;
+        uint64_t limit = 0;   // 0 means no limit
+        std::vector<std::string> projection;   // Fields returned for each match, empty returns whole documents
+        std::string sortField;   // Matches ordered by this field, documents without it are left out. Empty keeps the plan's order
+        bool sortDescending = false;
+        std::string continuation;   // Token of the last match of a previous page of the same query, see QueryCursor::continuationToken
+    };
+
+    // Cursor over the documents matching a query, ids are pulled from the index on demand
+    class QueryCursor {
+    public:
+        // Builds the projected result of a covered query from the current index entry
+        typedef std::function<Status(const rocksdb::Slice& key, const rocksdb::Slice& value, Document* doc)> EntryDecoder;
+
+        // With a decoder the documents are never read, see Collection::find
+        QueryCursor(const std::string& collectionName, StorageEngine* engine, std::unique_ptr<DocIdStream> stream,
+            const QueryOptions& options = QueryOptions(), EntryDecoder decoder = EntryDecoder());
+
+        // Check if the cursor points to a matching document
+        bool isValid() const;
+
+        // Move to the next matching document
+        void next();
+
+        // Get the ID of the current document
+        std::string currentId();
+
+        // Read the current document, only the projected fields when a projection is set
+        Status current(Document* doc);
+
+        // Copy of the listed fields of data, missing fields are left out
+        static json project(const json& data, const std::vector<std::string>& fields);
+
+        // Token for QueryOptions::continuation to resume the same query after the current match, or after
+        // the last returned one when the limit was reached. Empty once the matches are exhausted
+        std::string continuationToken() const;
+
+        // Continuation tokens are hex encoded stream positions, decodeToken fails on any other string
+        static std::string encodeToken(const std::string& position);
+        static bool decodeToken(const std::string& token, std::string* position);
+
+        // Error that ended the query early, OK when all matches were returned
+        Status status() const;
+
+    private:
+        bool withinLimit() const;
+        std::string collectionName_;
+        StorageEngine* engine_;
+        std::unique_ptr<DocIdStream> stream_;
+        uint64_t limit_;
+        uint64_t returned_;
+        std::vector<std::string> projection_;
+        EntryDecoder decoder_;
+        mutable std::mutex cursor_mutex_;  // Ensures thread-safety
+    };
+};
+
+#endif //QUERY_CURSOR_H
@@ -20,15 +20,14 @@ void executeQuery(Collection* collection, const json& query, const std::string&
     docIds = collection->findDocument(query);
 
     std::cout << "Found " << docIds.size() << " document(s)" << std::endl;
-    for (const std::string& docId : docIds) {
-        Document doc;
-        Status status = collection->readDocument(docId, doc);
-        if (status.ok()) {
-            printDocument(doc);
-        }
-        else {
-            std::cerr << "Failed to read document " << docId << ": " << status.message() << std::endl;
-        }
+    std::vector<Document> docs;
+    Status status = collection->readDocuments(docIds, docs);
+    if (!status.ok()) {
+        std::cerr << "Failed to read documents: " << status.message() << std::endl;
+        return;
+    }
+    for (const Document& doc : docs) {
+        printDocument(doc);
     }
 }
 
@@ -276,6 +275,13 @@ int main() {
     };
     executeQuery(products, ltPrice, "Price < 500.0");
 
+    json betweenPrice = {
+        {"$between", {
+            {"price", {50.0, 500.0}}
+        }}
+    };
+    executeQuery(products, betweenPrice, "50.0 <= Price <= 500.0");
+
     // 5. AND queries
     std::cout << "\n===== AND Queries =====\n";
 
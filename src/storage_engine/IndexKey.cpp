@@ -0,0 +1,89 @@
+#include "IndexKey.h"
+
+using namespace anudb;
+
+const int IndexKey::kFormatVersion;
+const char IndexKey::kString;
+const char IndexKey::kInt;
+const char IndexKey::kDouble;
+const char IndexKey::kBool;
+const char IndexKey::kNull;
+const char IndexKey::kJson;
+const size_t IndexKey::kTrailerSize;
+
+std::string IndexKey::make(const std::string& value, const std::string& docId, char type) {
+	std::string key;
+	key.reserve(value.size() + docId.size() + kTrailerSize + 1);
+	key.append(value);
+	key.push_back('\0');
+	key.append(docId);
+	key.push_back('\0');
+	key.push_back(type);
+	key.push_back(static_cast<char>((docId.size() >> 8) & 0xFF));
+	key.push_back(static_cast<char>(docId.size() & 0xFF));
+	return key;
+}
+
+std::string IndexKey::seekKey(const std::string& value) {
+	return make(value, "", '\0');
+}
+
+std::string IndexKey::lowerBound(const std::string& value) {
+	std::string bound = value;
+	bound.push_back('\0');
+	return bound;
+}
+
+std::string IndexKey::upperBound(const std::string& value) {
+	std::string bound = value;
+	bound.push_back('\x01');
+	return bound;
+}
+
+size_t IndexKey::prefixLength(const rocksdb::Slice& key) {
+	const size_t size = key.size();
+	if (size < kTrailerSize + 1) {
+		return 0;
+	}
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(key.data());
+	size_t docIdLength = (static_cast<size_t>(data[size - 2]) << 8) | data[size - 1];
+	if (size < kTrailerSize + 1 + docIdLength) {
+		return 0;
+	}
+	size_t prefixLength = size - kTrailerSize - docIdLength;
+	if (data[size - kTrailerSize] != '\0' || data[prefixLength - 1] != '\0') {
+		return 0;
+	}
+	return prefixLength;
+}
+
+bool IndexKey::parse(const rocksdb::Slice& key, rocksdb::Slice* value, rocksdb::Slice* docId, char* type) {
+	size_t length = prefixLength(key);
+	if (length == 0) {
+		return false;
+	}
+	if (value != nullptr) {
+		*value = rocksdb::Slice(key.data(), length - 1);
+	}
+	if (docId != nullptr) {
+		*docId = rocksdb::Slice(key.data() + length, key.size() - kTrailerSize - length);
+	}
+	if (type != nullptr) {
+		*type = key[key.size() - 3];
+	}
+	return true;
+}
+
+rocksdb::Slice IndexKey::docId(const rocksdb::Slice& key) {
+	rocksdb::Slice id;
+	parse(key, nullptr, &id, nullptr);
+	return id;
+}
+
+rocksdb::Slice IndexKeyPrefixTransform::Transform(const rocksdb::Slice& key) const {
+	return rocksdb::Slice(key.data(), IndexKey::prefixLength(key));
+}
+
+bool IndexKeyPrefixTransform::InDomain(const rocksdb::Slice& key) const {
+	return IndexKey::prefixLength(key) != 0;
+}
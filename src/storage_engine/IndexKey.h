@@ -0,0 +1,63 @@
+#ifndef INDEX_KEY_H
+#define INDEX_KEY_H
+
+#include "rocksdb/slice.h"
+#include "rocksdb/slice_transform.h"
+
+#include <string>
+
+namespace anudb {
+
+	// Index keys are laid out as
+	//     value '\0' docId '\0' type docIdLength(2 bytes, big endian)
+	// The '\0' after the value keeps values in byte order ("a" sorts before "a!"), the one
+	// after the doc id keeps doc ids of one value in byte order ("d1" before "d10").
+	// The fixed trailer lets value and doc id be split without searching for a delimiter.
+	// Compound indexes join the values of their fields with '\0' (v1 '\0' v2), which keeps
+	// the order field by field and makes "v1 '\0'" the start of every key with that first value.
+	class IndexKey {
+	public:
+		// Version of the layout recorded in the index catalog, index column families written with
+		// another version are rebuilt when the database is opened
+		static const int kFormatVersion = 2;
+
+		// Type tags stored in the trailer
+		static const char kString = 's';
+		static const char kInt = 'i';
+		static const char kDouble = 'd';
+		static const char kBool = 'b';
+		static const char kNull = 'n';
+		static const char kJson = 'j';
+
+		static const size_t kTrailerSize = 4;
+
+		static std::string make(const std::string& value, const std::string& docId, char type);
+
+		// Smallest key holding value, used as seek target for lookups on value
+		static std::string seekKey(const std::string& value);
+
+		// Bounds covering value for iterate_lower_bound / iterate_upper_bound.
+		// lowerBound(value) is the first key of value, upperBound(value) the first key after it
+		static std::string lowerBound(const std::string& value);
+		static std::string upperBound(const std::string& value);
+
+		// Split a key into its parts, returns false if the key is not an index key
+		static bool parse(const rocksdb::Slice& key, rocksdb::Slice* value, rocksdb::Slice* docId, char* type);
+
+		// Doc id of a key, empty if the key is not an index key
+		static rocksdb::Slice docId(const rocksdb::Slice& key);
+
+		// Length of value plus its separator, 0 if the key is not an index key
+		static size_t prefixLength(const rocksdb::Slice& key);
+	};
+
+	// Prefix extractor for index column families, the prefix is the encoded value
+	// so that prefix bloom filters answer "does this SST hold value v"
+	class IndexKeyPrefixTransform : public rocksdb::SliceTransform {
+	public:
+		const char* Name() const override { return "anudb.IndexKeyPrefix"; }
+		rocksdb::Slice Transform(const rocksdb::Slice& key) const override;
+		bool InDomain(const rocksdb::Slice& key) const override;
+	};
+}
+#endif // INDEX_KEY_H
@@ -0,0 +1,69 @@
+#include "ScanPool.h"
+
+using namespace anudb;
+
+ScanPool::~ScanPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	ready_.notify_all();
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+}
+
+void ScanPool::run(size_t count, const std::function<void(size_t)>& task) {
+	if (count == 0) {
+		return;
+	}
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	job->task = &task;
+	job->count = count;
+	job->next = 0;
+	job->done = 0;
+	if (count > 1 && size_ > 0) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		while (workers_.size() < size_) {
+			workers_.emplace_back(&ScanPool::work, this);
+		}
+		// One entry per worker that can help, the caller takes the first task itself
+		for (size_t i = 1; i < count && i <= size_; i++) {
+			queue_.push_back(job);
+		}
+	}
+	ready_.notify_all();
+	help(*job);
+
+	// Tasks claimed by workers may still be running
+	std::unique_lock<std::mutex> lock(job->mutex);
+	job->finished.wait(lock, [&job]() { return job->done == job->count; });
+}
+
+void ScanPool::help(Job& job) {
+	size_t i;
+	// task is only read for a claimed index, the caller waits for those before it returns
+	while ((i = job.next++) < job.count) {
+		(*job.task)(i);
+		std::lock_guard<std::mutex> lock(job.mutex);
+		if (++job.done == job.count) {
+			job.finished.notify_all();
+		}
+	}
+}
+
+void ScanPool::work() {
+	for (;;) {
+		std::shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			ready_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+			if (queue_.empty()) {
+				return;
+			}
+			job = queue_.front();
+			queue_.pop_front();
+		}
+		help(*job);
+	}
+}
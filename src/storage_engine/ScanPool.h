@@ -0,0 +1,53 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace anudb {
+
+	// Fixed set of worker threads shared by the range scans of a storage engine. Concurrent scans queue
+	// their ranges on the same workers instead of each starting threads of its own, so the threads in
+	// flight stay at the pool size plus the callers. Workers are started by the first run
+	class ScanPool {
+	public:
+		explicit ScanPool(size_t threads) : size_(threads) {}
+		~ScanPool();
+
+		// Call task(i) for every i in [0, count) and return once all calls are done. The calling thread
+		// runs tasks as well, so a scan completes even when every worker is busy with other scans.
+		// task must not throw
+		void run(size_t count, const std::function<void(size_t)>& task);
+
+		size_t size() const { return size_; }
+
+	private:
+		// Tasks of one run, claimed in order by the caller and the workers helping it
+		struct Job {
+			const std::function<void(size_t)>* task;
+			size_t count;
+			std::atomic<size_t> next;
+			size_t done;
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+
+		// Run the unclaimed tasks of job
+		static void help(Job& job);
+		void work();
+
+		size_t size_;
+		std::vector<std::thread> workers_;
+		std::deque<std::shared_ptr<Job>> queue_;
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		bool stopping_ = false;
+	};
+}
+#endif // SCAN_POOL_H
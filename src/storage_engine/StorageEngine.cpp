@@ -27,6 +27,8 @@ Status StorageEngine::open() {
 	config.enable_pipelined_write = true;            // Optimize write path
 	config.enable_direct_io = false;                 // Better for most flash storage on edge devices
 	config.prefix_length = 8;                        // Efficient prefix length for indexing
+	config.memory_budget = memoryBudget_;            // Shared cap for cache and memtables
+	RocksDBOptimizer::applyMemoryBudget(config);
 
 	options = RocksDBOptimizer::getOptimizedOptions(config);
 
@@ -49,6 +51,15 @@ Status StorageEngine::open() {
 	options.new_table_reader_for_compaction_inputs = false; // Save memory
 	options.OptimizeForSmallDb();
 
+	// Documents and indexes are read differently, give each its own profile on one shared cache
+	blockCache_ = rocksdb::NewLRUCache(config.block_cache_size, 6, false, 0.5);
+	writeBufferManager_ = RocksDBOptimizer::getWriteBufferManager(config, blockCache_);
+	if (writeBufferManager_) {
+		options.write_buffer_manager = writeBufferManager_;
+	}
+	documentCfOptions_ = RocksDBOptimizer::getDocumentCFOptions(config, blockCache_);
+	indexCfOptions_ = RocksDBOptimizer::getIndexCFOptions(config, blockCache_);
+
 	// Get list of existing column families
 	std::vector<std::string> columnFamilies;
 	rocksdb::Status s = rocksdb::DB::ListColumnFamilies(options, dbPath_, &columnFamilies);
@@ -64,7 +75,7 @@ Status StorageEngine::open() {
 
 	std::vector<rocksdb::ColumnFamilyDescriptor> columnFamilyDescriptors;
 	for (const auto& cf : columnFamilies) {
-		columnFamilyDescriptors.emplace_back(cf, rocksdb::ColumnFamilyOptions());
+		columnFamilyDescriptors.emplace_back(cf, getColumnFamilyOptions(cf));
 	}
 
 	// Open the database with column families
@@ -85,10 +96,21 @@ Status StorageEngine::open() {
 			if (db_) db_->DestroyColumnFamilyHandle(h);
 			});
 	}
-	// Print estimated memory usage
-	size_t estimated_mem = RocksDBOptimizer::estimateMemoryUsage(config);
-	//std::cout << "Estimated memory usage by storage engine: " << (estimated_mem >> 20) << "MB\n";
-
+	// Make sure the index catalog exists before collections are used
+	if (columnFamilies_.find(catalog_name_) == columnFamilies_.end()) {
+		Status status = createCollection(catalog_name_);
+		if (!status.ok()) {
+			return status;
+		}
+	}
+	Status status = loadIndexCatalog();
+	if (!status.ok()) {
+		return status;
+	}
+	status = checkIndexFormat();
+	if (!status.ok()) {
+		return status;
+	}
 	return Status::OK();
 }
 
@@ -109,6 +131,14 @@ Status StorageEngine::close() {
 
 		// Clear the reference map first (this doesn't destroy handles)
 		columnFamilies_.clear();
+		{
+			std::lock_guard<std::mutex> lock(catalog_mutex_);
+			indexCatalog_.clear();
+			indexIncludes_.clear();
+			indexMultikey_.clear();
+			indexVersion_++;
+		}
+		indexesToRebuild_.clear();
 
 		// Clear the ownership vector which will destroy all handles properly
 		ownedHandles_.clear();
@@ -128,6 +158,24 @@ Status StorageEngine::close() {
 	return Status::OK();
 }
 
+size_t StorageEngine::getMemoryUsage() const {
+	if (!db_) {
+		return 0;
+	}
+	size_t usage = blockCache_ ? blockCache_->GetUsage() : 0;
+	if (writeBufferManager_) {
+		// Memtable memory is already reserved in the block cache
+		return usage;
+	}
+	for (const auto& it : columnFamilies_) {
+		uint64_t memtableSize = 0;
+		if (db_->GetIntProperty(it.second, rocksdb::DB::Properties::kCurSizeAllMemTables, &memtableSize)) {
+			usage += memtableSize;
+		}
+	}
+	return usage;
+}
+
 Status StorageEngine::createCollection(const std::string& name) {
 	// Check if collection already exists
 	if (columnFamilies_.find(name) != columnFamilies_.end()) {
@@ -136,7 +184,7 @@ Status StorageEngine::createCollection(const std::string& name) {
 
 	// Create column family for the collection
 	rocksdb::ColumnFamilyHandle* handle;
-	rocksdb::Status s = db_->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), name, &handle);
+	rocksdb::Status s = db_->CreateColumnFamily(getColumnFamilyOptions(name), name, &handle);
 
 	if (!s.ok()) {
 		return Status::IOError(s.ToString());
@@ -166,6 +214,12 @@ Status StorageEngine::dropCollection(const std::string& name) {
 	}
 	// Remove from our map
 	columnFamilies_.erase(it);
+
+	// A dropped collection takes its catalog entry with it
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	if (indexCatalog_.count(name) > 0) {
+		return saveIndexCatalog(name, std::set<std::string>());
+	}
 	return Status::OK();
 }
 
@@ -221,15 +275,15 @@ Status StorageEngine::fetchDocIdsByOrder(const std::string& collection, const st
 	if (it == columnFamilies_.end()) {
 		return Status::NotFound("Collection not found: " + collection);
 	}
-	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
+	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getScanReadOptions(), it->second);
 	if (asc) {
 		for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
-			docIds.push_back(iterator->value().ToString());
+			docIds.push_back(IndexKey::docId(iterator->key()).ToString());
 		}
 	}
 	else {
 		for (iterator->SeekToLast(); iterator->Valid(); iterator->Prev()) {
-			docIds.push_back(iterator->value().ToString());
+			docIds.push_back(IndexKey::docId(iterator->key()).ToString());
 		}
 	}
 
@@ -238,68 +292,340 @@ Status StorageEngine::fetchDocIdsByOrder(const std::string& collection, const st
 	return Status::OK();
 }
 
-Status StorageEngine::fetchDocIdsForEqual(const std::string& collection, const std::string& prefix, std::vector<std::string>& docIds) const {
+Status StorageEngine::fetchDocIdsForEqual(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const {
 	//std::lock_guard<std::mutex> lock(db_mutex_);
 
 	auto it = columnFamilies_.find(collection);
 	if (it == columnFamilies_.end()) {
 		return Status::NotFound("Collection not found: " + collection);
 	}
+	// Prefix seek, SST files without the value are skipped by the prefix bloom filter
+	const std::string prefix = IndexKey::lowerBound(value);
 	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
-	for (iterator->Seek(prefix); iterator->Valid() && iterator->key().starts_with(prefix); iterator->Next()) {
-		docIds.push_back(iterator->value().ToString());
+	for (iterator->Seek(IndexKey::seekKey(value)); iterator->Valid() && iterator->key().starts_with(prefix); iterator->Next()) {
+		docIds.push_back(IndexKey::docId(iterator->key()).ToString());
 	}
 	// delete iterator
 	delete iterator;
 	return Status::OK();
 }
 
-Status StorageEngine::fetchDocIdsForGreater(const std::string& collection, const std::string& prefix, std::vector<std::string>& docIds) const {
-	//std::lock_guard<std::mutex> lock(db_mutex_);
+Status StorageEngine::fetchDocIdsForGreater(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const {
+	return fetchDocIdsForRange(collection, IndexKey::upperBound(value), "", docIds);
+}
 
-	auto it = columnFamilies_.find(collection);
-	if (it == columnFamilies_.end()) {
-		return Status::NotFound("Collection not found: " + collection);
+Status StorageEngine::fetchDocIdsForLesser(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const {
+	return fetchDocIdsForRange(collection, "", IndexKey::lowerBound(value), docIds, true);
+}
+
+Status StorageEngine::fetchDocIdsForRange(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+	std::vector<std::string>& docIds, bool reverse) const {
+	// Iterate bounds stop the scan inside RocksDB, blocks outside the range are never read.
+	// A large range is split and its parts read on several threads
+	size_t first = docIds.size();
+	Status status = parallelScan(collection, lowerBound, upperBound, defaultScanThreads(), true,
+		[](const rocksdb::Slice& key, const rocksdb::Slice&, std::string& result) {
+			rocksdb::Slice docId = IndexKey::docId(key);
+			result.assign(docId.data(), docId.size());
+			return true;
+		}, docIds);
+	if (status.ok() && reverse) {
+		std::reverse(docIds.begin() + first, docIds.end());
 	}
-	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
-	for (iterator->Seek(prefix); iterator->Valid() && iterator->key().starts_with(prefix); iterator->Next());
-	for (; iterator->Valid(); iterator->Next()) {
-		docIds.push_back(iterator->value().ToString());
+	return status;
+}
+
+uint64_t StorageEngine::estimateIndexEntries(const std::string& collection, const std::string& lowerBound, const std::string& upperBound) const {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(collection);
+	if (handle == nullptr) {
+		return 0;
+	}
+	// Index values never start with this many 0xff bytes, so it stands in for an open upper bound
+	const std::string upper = upperBound.empty() ? std::string(16, '\xff') : upperBound;
+	rocksdb::Range range(lowerBound, upper);
+
+	uint64_t memtableEntries = 0;
+	uint64_t memtableBytes = 0;
+	db_->GetApproximateMemTableStats(handle, range, &memtableEntries, &memtableBytes);
+
+	rocksdb::SizeApproximationOptions sizeOptions;
+	sizeOptions.include_memtabtles = false;
+	sizeOptions.include_files = true;
+	sizeOptions.files_size_error_margin = 0.1;
+	uint64_t sstBytes = 0;
+	if (!db_->GetApproximateSizes(sizeOptions, handle, &range, 1, &sstBytes).ok()) {
+		return memtableEntries;
 	}
 
-	// delete iterator
-	delete iterator;
+	// Size estimates work in whole data blocks, a range within a few of them can come out as 0
+	// bytes however many entries it holds. Such a range is cheap to count instead
+	if (sstBytes < kExactEstimateBytes) {
+		rocksdb::ReadOptions readOptions = RocksDBOptimizer::getScanReadOptions();
+		rocksdb::Slice lowerSlice(lowerBound);
+		rocksdb::Slice upperSlice(upper);
+		readOptions.iterate_lower_bound = &lowerSlice;
+		readOptions.iterate_upper_bound = &upperSlice;
+		std::unique_ptr<rocksdb::Iterator> iterator(db_->NewIterator(readOptions, handle));
+		uint64_t entries = 0;
+		for (iterator->SeekToFirst(); iterator->Valid() && entries < kExactEstimateEntries; iterator->Next()) {
+			entries++;
+		}
+		if (iterator->status().ok()) {
+			return entries;
+		}
+	}
+	if (sstBytes == 0) {
+		return memtableEntries;
+	}
+
+	// Convert bytes to entries with the average entry size of the SST files,
+	// estimate-num-keys also counts the memtables
+	uint64_t totalKeys = 0;
+	uint64_t activeEntries = 0;
+	uint64_t immutableEntries = 0;
+	uint64_t sstTotalBytes = 0;
+	db_->GetIntProperty(handle, rocksdb::DB::Properties::kEstimateNumKeys, &totalKeys);
+	db_->GetIntProperty(handle, rocksdb::DB::Properties::kNumEntriesActiveMemTable, &activeEntries);
+	db_->GetIntProperty(handle, rocksdb::DB::Properties::kNumEntriesImmMemTables, &immutableEntries);
+	db_->GetIntProperty(handle, rocksdb::DB::Properties::kTotalSstFilesSize, &sstTotalBytes);
+	uint64_t sstKeys = totalKeys > activeEntries + immutableEntries ? totalKeys - activeEntries - immutableEntries : 0;
+	if (sstKeys == 0 || sstTotalBytes == 0) {
+		return memtableEntries + 1;
+	}
+	return memtableEntries + std::max<uint64_t>(1, sstBytes * sstKeys / sstTotalBytes);
+}
+
+Status StorageEngine::newIterator(const std::string& collection, const rocksdb::ReadOptions& options, std::unique_ptr<rocksdb::Iterator>& iterator) const {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(collection);
+	if (handle == nullptr) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+	iterator.reset(db_->NewIterator(options, handle));
 	return Status::OK();
 }
 
-Status StorageEngine::fetchDocIdsForLesser(const std::string& collection, const std::string& prefix, std::vector<std::string>& docIds) const {
-	//std::lock_guard<std::mutex> lock(db_mutex_);
+namespace {
+	// count - 1 keys spaced evenly between first and last, from the 8 bytes following their common prefix
+	void interpolateKeys(const std::string& first, const std::string& last, size_t count, std::vector<std::string>& keys) {
+		size_t common = 0;
+		while (common < first.size() && common < last.size() && first[common] == last[common]) {
+			common++;
+		}
+		auto word = [common](const std::string& key) {
+			uint64_t value = 0;
+			for (size_t i = 0; i < 8; i++) {
+				value = (value << 8) | (common + i < key.size() ? static_cast<unsigned char>(key[common + i]) : 0);
+			}
+			return value;
+		};
+		uint64_t low = word(first);
+		uint64_t high = word(last);
+		if (high <= low) {
+			return;
+		}
+		for (size_t i = 1; i < count; i++) {
+			uint64_t value = low + (high - low) / count * i;
+			std::string key = first.substr(0, common);
+			for (int shift = 56; shift >= 0; shift -= 8) {
+				key.push_back(static_cast<char>((value >> shift) & 0xFF));
+			}
+			keys.push_back(key);
+		}
+	}
+}
 
-	auto it = columnFamilies_.find(collection);
-	if (it == columnFamilies_.end()) {
-		return Status::NotFound("Collection not found: " + collection);
+size_t StorageEngine::defaultScanThreads() {
+	return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+std::vector<std::string> StorageEngine::splitKeyRange(const std::string& collection, const std::string& lowerBound,
+	const std::string& upperBound, size_t parts, uint64_t minBytes) const {
+	std::vector<std::string> splits;
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(collection);
+	if (handle == nullptr || parts < 2) {
+		return splits;
 	}
-	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
-	iterator->SeekForPrev(prefix);
-	if (iterator->Valid() && iterator->key().starts_with(prefix)) {
-		iterator->Prev();
+	rocksdb::SizeApproximationOptions sizeOptions;
+	sizeOptions.include_memtabtles = true;
+	sizeOptions.include_files = true;
+	sizeOptions.files_size_error_margin = 0.1;
+	// Keys never start with this many 0xff bytes, so it stands in for an open upper bound
+	const std::string upper = upperBound.empty() ? std::string(16, '\xff') : upperBound;
+	rocksdb::Range whole(lowerBound, upper);
+	uint64_t totalBytes = 0;
+	if (!db_->GetApproximateSizes(sizeOptions, handle, &whole, 1, &totalBytes).ok()) {
+		return splits;
+	}
+	// A range too small to pay for the threads is scanned as one
+	parts = static_cast<size_t>(std::min<uint64_t>(parts, totalBytes / std::max<uint64_t>(minBytes, 1)));
+	if (parts < 2) {
+		return splits;
 	}
-	for (; iterator->Valid(); iterator->Prev()) {
-		std::string key = "";
-		const char* p = iterator->key().data();
-		while (*p != '#') {
-			key.push_back(*p);
-			p++;
+
+	rocksdb::ReadOptions readOptions = RocksDBOptimizer::getScanReadOptions();
+	rocksdb::Slice lowerSlice(lowerBound);
+	rocksdb::Slice upperSlice(upperBound);
+	if (!lowerBound.empty()) {
+		readOptions.iterate_lower_bound = &lowerSlice;
+	}
+	if (!upperBound.empty()) {
+		readOptions.iterate_upper_bound = &upperSlice;
+	}
+	std::unique_ptr<rocksdb::Iterator> iterator(db_->NewIterator(readOptions, handle));
+	iterator->SeekToFirst();
+	if (!iterator->Valid()) {
+		return splits;
+	}
+	std::string first = iterator->key().ToString();
+	iterator->SeekToLast();
+	if (!iterator->Valid()) {
+		return splits;
+	}
+	std::string last = iterator->key().ToString();
+
+	// Candidate split points are the SST file boundaries, which hold whole files on each side, and keys
+	// interpolated between the first and the last key, which also divide large files and the memtables
+	std::vector<std::string> candidates;
+	rocksdb::ColumnFamilyMetaData metadata;
+	db_->GetColumnFamilyMetaData(handle, &metadata);
+	for (const rocksdb::LevelMetaData& level : metadata.levels) {
+		for (const rocksdb::SstFileMetaData& file : level.files) {
+			candidates.push_back(file.smallestkey);
+			candidates.push_back(file.largestkey);
 		}
-		docIds.push_back(iterator->value().ToString());
+	}
+	interpolateKeys(first, last, parts * 8, candidates);
+	candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+		[&first, &last](const std::string& key) { return key <= first || key > last; }), candidates.end());
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	if (candidates.empty()) {
+		return splits;
 	}
 
-	// delete iterator
-	delete iterator;
+	// Bytes before each candidate, the splits are the candidates closest to equal shares
+	std::vector<rocksdb::Range> ranges;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		ranges.emplace_back(i == 0 ? rocksdb::Slice(first) : rocksdb::Slice(candidates[i - 1]), candidates[i]);
+	}
+	ranges.emplace_back(candidates.back(), upper);
+	std::vector<uint64_t> sizes(ranges.size(), 0);
+	if (!db_->GetApproximateSizes(sizeOptions, handle, ranges.data(), static_cast<int>(ranges.size()), sizes.data()).ok()) {
+		return splits;
+	}
+	uint64_t sum = 0;
+	for (uint64_t size : sizes) {
+		sum += size;
+	}
+	uint64_t before = 0;
+	for (size_t i = 0; i < candidates.size() && splits.size() + 1 < parts; i++) {
+		before += sizes[i];
+		if (before * parts >= sum * (splits.size() + 1)) {
+			splits.push_back(candidates[i]);
+		}
+	}
+	return splits;
+}
+
+Status StorageEngine::scanRanges(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+	const std::vector<std::string>& splits, const std::function<Status(size_t range, rocksdb::Iterator* iterator)>& scan) const {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(collection);
+	if (handle == nullptr) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+	const rocksdb::Snapshot* snapshot = db_->GetSnapshot();
+	std::vector<Status> statuses(splits.size() + 1);
+	auto scanRange = [&](size_t range) {
+		rocksdb::ReadOptions readOptions = RocksDBOptimizer::getScanReadOptions();
+		readOptions.snapshot = snapshot;
+		rocksdb::Slice lower(range == 0 ? lowerBound : splits[range - 1]);
+		rocksdb::Slice upper(range < splits.size() ? splits[range] : upperBound);
+		if (!lower.empty()) {
+			readOptions.iterate_lower_bound = &lower;
+		}
+		if (!upper.empty()) {
+			readOptions.iterate_upper_bound = &upper;
+		}
+		std::unique_ptr<rocksdb::Iterator> iterator(db_->NewIterator(readOptions, handle));
+		try {
+			statuses[range] = scan(range, iterator.get());
+		}
+		catch (const std::exception& e) {
+			// Worker threads must not throw, the scan fails instead
+			statuses[range] = Status::Corruption(e.what());
+		}
+		if (statuses[range].ok() && !iterator->status().ok()) {
+			statuses[range] = Status::IOError(iterator->status().ToString());
+		}
+	};
+	// Ranges are queued on the engine's workers, the calling thread scans too
+	scanPool_.run(statuses.size(), scanRange);
+	db_->ReleaseSnapshot(snapshot);
+
+	for (const Status& status : statuses) {
+		if (!status.ok()) {
+			return status;
+		}
+	}
 	return Status::OK();
 }
 
+Status StorageEngine::parallelScan(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+	size_t threads, bool ordered, const ScanVisitor& visit, std::vector<std::string>& results) const {
+	std::vector<std::string> splits = splitKeyRange(collection, lowerBound, upperBound, threads);
+	std::vector<std::vector<std::string>> parts(splits.size() + 1);
+	std::mutex resultsMutex;
+	Status status = scanRanges(collection, lowerBound, upperBound, splits, [&](size_t range, rocksdb::Iterator* iterator) {
+		std::vector<std::string>& part = parts[range];
+		std::string result;
+		for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
+			if (visit(iterator->key(), iterator->value(), result)) {
+				part.push_back(std::move(result));
+				result.clear();
+			}
+		}
+		if (!ordered) {
+			// Handed over as soon as the range is done, without waiting for the ranges before it
+			std::lock_guard<std::mutex> lock(resultsMutex);
+			results.insert(results.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+			part.clear();
+		}
+		return Status::OK();
+	});
+	if (!status.ok()) {
+		return status;
+	}
+	for (std::vector<std::string>& part : parts) {
+		results.insert(results.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+	}
+	return Status::OK();
+}
+
+Status StorageEngine::scanCollection(const std::string& collection, size_t threads,
+	const std::function<bool(const rocksdb::Slice& key, const rocksdb::Slice& value)>& match,
+	std::vector<std::string>& keys) const {
+	return parallelScan(collection, "", "", threads, true,
+		[&match](const rocksdb::Slice& key, const rocksdb::Slice& value, std::string& result) {
+			if (!match(key, value)) {
+				return false;
+			}
+			result.assign(key.data(), key.size());
+			return true;
+		}, keys);
+}
+
 Status StorageEngine::get(const std::string& collection, const std::string& key, std::vector<uint8_t>* value) {
+	rocksdb::PinnableSlice result;
+	Status status = get(collection, key, &result);
+	if (!status.ok()) {
+		return status;
+	}
+
+	value->assign(result.data(), result.data() + result.size());
+	return Status::OK();
+}
+
+Status StorageEngine::get(const std::string& collection, const std::string& key, rocksdb::PinnableSlice* value) {
 	//std::lock_guard<std::mutex> lock(db_mutex_);
 
 	auto it = columnFamilies_.find(collection);
@@ -307,9 +633,9 @@ Status StorageEngine::get(const std::string& collection, const std::string& key,
 		return Status::NotFound("Collection not found: " + collection);
 	}
 
-	std::string result;
+	value->Reset();
 	rocksdb::Status s = db_->Get(RocksDBOptimizer::getReadOptions(), it->second,
-		rocksdb::Slice(key), &result);
+		rocksdb::Slice(key), value);
 
 	if (s.IsNotFound()) {
 		return Status::NotFound("Key not found: " + key);
@@ -318,29 +644,82 @@ Status StorageEngine::get(const std::string& collection, const std::string& key,
 		return Status::IOError(s.ToString());
 	}
 
-	value->assign(result.begin(), result.end());
 	return Status::OK();
 }
 
-Status StorageEngine::getAll(const std::string& collection, std::vector<std::vector<uint8_t>>& values) {
-	//std::lock_guard<std::mutex> lock(db_mutex_);
+Status StorageEngine::multiGet(const std::string& collection, const std::vector<std::string>& keys,
+	std::vector<std::vector<uint8_t>>& values, std::vector<Status>& statuses) {
+	std::vector<rocksdb::PinnableSlice> results;
+	Status status = multiGet(collection, keys, results, statuses);
+	if (!status.ok()) {
+		return status;
+	}
 
+	values.clear();
+	values.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (statuses[i].ok()) {
+			values[i].assign(results[i].data(), results[i].data() + results[i].size());
+		}
+	}
+	return Status::OK();
+}
+
+Status StorageEngine::multiGet(const std::string& collection, const std::vector<std::string>& keys,
+	std::vector<rocksdb::PinnableSlice>& values, std::vector<Status>& statuses) {
 	auto it = columnFamilies_.find(collection);
 	if (it == columnFamilies_.end()) {
 		return Status::NotFound("Collection not found: " + collection);
 	}
 	values.clear();
+	values.resize(keys.size());
+	statuses.assign(keys.size(), Status::OK());
+	if (keys.empty()) {
+		return Status::OK();
+	}
 
-	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
+	// RocksDB sorts the keys and resolves them with batched block lookups
+	std::vector<rocksdb::Slice> keySlices(keys.begin(), keys.end());
+	std::vector<rocksdb::Status> results_status(keys.size());
+	db_->MultiGet(RocksDBOptimizer::getReadOptions(), it->second, keys.size(),
+		keySlices.data(), values.data(), results_status.data());
 
-	for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
-		rocksdb::Slice value_slice = iterator->value();
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (results_status[i].IsNotFound()) {
+			statuses[i] = Status::NotFound("Key not found: " + keys[i]);
+		}
+		else if (!results_status[i].ok()) {
+			statuses[i] = Status::IOError(results_status[i].ToString());
+		}
+	}
+	return Status::OK();
+}
 
-		std::vector<uint8_t> value_vec(value_slice.data(), value_slice.data() + value_slice.size());
-		values.push_back(std::move(value_vec));
+Status StorageEngine::getAll(const std::string& collection, std::vector<std::vector<uint8_t>>& values) {
+	//std::lock_guard<std::mutex> lock(db_mutex_);
+
+	auto it = columnFamilies_.find(collection);
+	if (it == columnFamilies_.end()) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+	values.clear();
+
+	// Ranges of the collection are copied on several threads and joined in key order
+	std::vector<std::string> splits = splitKeyRange(collection, "", "", defaultScanThreads());
+	std::vector<std::vector<std::vector<uint8_t>>> parts(splits.size() + 1);
+	Status status = scanRanges(collection, "", "", splits, [&parts](size_t range, rocksdb::Iterator* iterator) {
+		for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
+			rocksdb::Slice value_slice = iterator->value();
+			parts[range].emplace_back(value_slice.data(), value_slice.data() + value_slice.size());
+		}
+		return Status::OK();
+	});
+	if (!status.ok()) {
+		return status;
+	}
+	for (std::vector<std::vector<uint8_t>>& part : parts) {
+		values.insert(values.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
 	}
-	// delete iterator
-	delete iterator;
 	return Status::OK();
 }
 
@@ -361,6 +740,77 @@ Status StorageEngine::remove(const std::string& collection, const std::string& k
 	return Status::OK();
 }
 
+Status StorageEngine::write(WriteBatch& batch) {
+	if (batch.count() == 0) {
+		return Status::OK();
+	}
+
+	rocksdb::Status s = db_->Write(RocksDBOptimizer::getWriteOptions(), &batch.batch_);
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+
+	return Status::OK();
+}
+
+rocksdb::ColumnFamilyHandle* StorageEngine::getColumnFamily(const std::string& name) const {
+	auto it = columnFamilies_.find(name);
+	if (it == columnFamilies_.end()) {
+		return nullptr;
+	}
+	return it->second;
+}
+
+rocksdb::ColumnFamilyOptions StorageEngine::getColumnFamilyOptions(const std::string& name) const {
+	if (name.find(index_delimiter_) != std::string::npos) {
+		return indexCfOptions_;
+	}
+	return documentCfOptions_;
+}
+
+Status WriteBatch::put(const std::string& collection, const std::string& key, const std::vector<uint8_t>& value) {
+	rocksdb::ColumnFamilyHandle* handle = engine_->getColumnFamily(collection);
+	if (handle == nullptr) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+
+	rocksdb::Status s = batch_.Put(handle, rocksdb::Slice(key),
+		rocksdb::Slice(reinterpret_cast<const char*>(value.data()), value.size()));
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+
+	return Status::OK();
+}
+
+Status WriteBatch::putIndex(const std::string& collection, const std::string& key, const std::string& value) {
+	rocksdb::ColumnFamilyHandle* handle = engine_->getColumnFamily(collection);
+	if (handle == nullptr) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+
+	rocksdb::Status s = batch_.Put(handle, rocksdb::Slice(key), rocksdb::Slice(value.c_str(), value.size()));
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+
+	return Status::OK();
+}
+
+Status WriteBatch::remove(const std::string& collection, const std::string& key) {
+	rocksdb::ColumnFamilyHandle* handle = engine_->getColumnFamily(collection);
+	if (handle == nullptr) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+
+	rocksdb::Status s = batch_.Delete(handle, rocksdb::Slice(key));
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+
+	return Status::OK();
+}
+
 bool StorageEngine::collectionExists(const std::string& name) const {
 	return columnFamilies_.find(name) != columnFamilies_.end();
 }
@@ -369,6 +819,7 @@ std::vector<std::string> StorageEngine::getCollectionNames() const {
 	std::vector<std::string> names;
 	for (const auto& pair : columnFamilies_) {
 		if (pair.first != rocksdb::kDefaultColumnFamilyName &&
+			pair.first != catalog_name_ &&
 			pair.first.find(index_delimiter_) == std::string::npos) {
 			names.push_back(pair.first);
 		}
@@ -376,19 +827,312 @@ std::vector<std::string> StorageEngine::getCollectionNames() const {
 	return names;
 }
 
-std::set<std::string> StorageEngine::getIndexNames(std::string collectionName) {
-	std::vector<std::string> names;
-	std::map<std::string, std::set<std::string>> index;
+std::set<std::string> StorageEngine::getIndexNames(const std::string& collectionName) const {
+	return *getIndexSet(collectionName);
+}
+
+std::shared_ptr<const std::set<std::string>> StorageEngine::getIndexSet(const std::string& collectionName) const {
+	static const std::shared_ptr<const std::set<std::string>> empty = std::make_shared<const std::set<std::string>>();
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	auto it = indexCatalog_.find(collectionName);
+	if (it == indexCatalog_.end()) {
+		return empty;
+	}
+	return it->second;
+}
+
+std::shared_ptr<const IndexIncludes> StorageEngine::getIndexIncludes(const std::string& collectionName) const {
+	static const std::shared_ptr<const IndexIncludes> empty = std::make_shared<const IndexIncludes>();
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	auto it = indexIncludes_.find(collectionName);
+	if (it == indexIncludes_.end()) {
+		return empty;
+	}
+	return it->second;
+}
+
+std::shared_ptr<const std::set<std::string>> StorageEngine::getMultikeyIndexes(const std::string& collectionName) const {
+	static const std::shared_ptr<const std::set<std::string>> empty = std::make_shared<const std::set<std::string>>();
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	auto it = indexMultikey_.find(collectionName);
+	if (it == indexMultikey_.end()) {
+		return empty;
+	}
+	return it->second;
+}
+
+std::string StorageEngine::getIndexCfName(const std::string& collection, const std::string& index) const {
+	return collection + index_delimiter_ + index;
+}
+
+Status StorageEngine::createIndex(const std::string& collection, const std::string& index, const std::vector<std::string>& include, bool multikey) {
+	if (!collectionExists(collection)) {
+		return Status::NotFound("Collection not found: " + collection);
+	}
+	// Options of an existing index are not changed in place, the index has to be dropped first
+	if (getIndexSet(collection)->count(index) > 0) {
+		return Status::InvalidArgument("Index already exists: " + index);
+	}
+	Status status = createCollection(getIndexCfName(collection, index));
+	if (!status.ok()) {
+		return status;
+	}
+
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	std::set<std::string> indexes;
+	auto it = indexCatalog_.find(collection);
+	if (it != indexCatalog_.end()) {
+		indexes = *it->second;
+	}
+	indexes.insert(index);
+	IndexIncludes includes;
+	auto included = indexIncludes_.find(collection);
+	if (included != indexIncludes_.end()) {
+		includes = *included->second;
+	}
+	includes.erase(index);
+	if (!include.empty()) {
+		includes[index] = include;
+	}
+	std::set<std::string> multikeyIndexes;
+	auto multi = indexMultikey_.find(collection);
+	if (multi != indexMultikey_.end()) {
+		multikeyIndexes = *multi->second;
+	}
+	multikeyIndexes.erase(index);
+	if (multikey) {
+		multikeyIndexes.insert(index);
+	}
+	return saveIndexCatalog(collection, indexes, includes, multikeyIndexes);
+}
+
+Status StorageEngine::dropIndex(const std::string& collection, const std::string& index) {
+	Status status = dropCollection(getIndexCfName(collection, index));
+	if (!status.ok()) {
+		return status;
+	}
+
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	auto it = indexCatalog_.find(collection);
+	if (it == indexCatalog_.end() || it->second->count(index) == 0) {
+		return Status::OK();
+	}
+	std::set<std::string> indexes = *it->second;
+	indexes.erase(index);
+	IndexIncludes includes;
+	auto included = indexIncludes_.find(collection);
+	if (included != indexIncludes_.end()) {
+		includes = *included->second;
+		includes.erase(index);
+	}
+	std::set<std::string> multikeyIndexes;
+	auto multi = indexMultikey_.find(collection);
+	if (multi != indexMultikey_.end()) {
+		multikeyIndexes = *multi->second;
+		multikeyIndexes.erase(index);
+	}
+	return saveIndexCatalog(collection, indexes, includes, multikeyIndexes);
+}
+
+Status StorageEngine::saveIndexCatalog(const std::string& collection, const std::set<std::string>& indexes,
+	const IndexIncludes& includes, const std::set<std::string>& multikey) {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(catalog_name_);
+	if (handle == nullptr) {
+		return Status::NotFound("Index catalog not found");
+	}
+
+	rocksdb::Status s;
+	if (indexes.empty()) {
+		s = db_->Delete(RocksDBOptimizer::getWriteOptions(), handle, collection);
+	}
+	else {
+		json entry = { {"indexes", indexes} };
+		if (!includes.empty()) {
+			entry["include"] = includes;
+		}
+		if (!multikey.empty()) {
+			entry["multikey"] = multikey;
+		}
+		std::vector<uint8_t> value = json::to_msgpack(entry);
+		s = db_->Put(RocksDBOptimizer::getWriteOptions(), handle, collection,
+			rocksdb::Slice(reinterpret_cast<const char*>(value.data()), value.size()));
+	}
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+
+	if (indexes.empty()) {
+		indexCatalog_.erase(collection);
+	}
+	else {
+		indexCatalog_[collection] = std::make_shared<const std::set<std::string>>(indexes);
+	}
+	if (indexes.empty() || includes.empty()) {
+		indexIncludes_.erase(collection);
+	}
+	else {
+		indexIncludes_[collection] = std::make_shared<const IndexIncludes>(includes);
+	}
+	if (indexes.empty() || multikey.empty()) {
+		indexMultikey_.erase(collection);
+	}
+	else {
+		indexMultikey_[collection] = std::make_shared<const std::set<std::string>>(multikey);
+	}
+	indexVersion_++;
+	return Status::OK();
+}
+
+Status StorageEngine::loadIndexCatalog() {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(catalog_name_);
+	if (handle == nullptr) {
+		return Status::NotFound("Index catalog not found");
+	}
+
+	std::lock_guard<std::mutex> lock(catalog_mutex_);
+	indexCatalog_.clear();
+	indexIncludes_.clear();
+	indexMultikey_.clear();
+	indexVersion_++;
+	std::map<std::string, std::set<std::string>> catalog;
+	std::map<std::string, IndexIncludes> includes;
+	std::map<std::string, std::set<std::string>> multikey;
+	std::set<std::string> stale;
+	std::unique_ptr<rocksdb::Iterator> iterator(db_->NewIterator(RocksDBOptimizer::getReadOptions(), handle));
+	for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
+		std::string collection = iterator->key().ToString();
+		if (collection == format_key_) {
+			continue;
+		}
+		rocksdb::Slice value = iterator->value();
+		try {
+			json entry = json::from_msgpack(value.data(), value.data() + value.size());
+			std::set<std::string>& indexes = catalog[collection];
+			for (const auto& item : entry["indexes"]) {
+				std::string index = item.get<std::string>();
+				// Entries whose column family is gone are dropped
+				if (columnFamilies_.count(getIndexCfName(collection, index)) != 0) {
+					indexes.insert(index);
+				}
+				else {
+					stale.insert(collection);
+				}
+			}
+			if (entry.contains("include")) {
+				for (auto item = entry["include"].begin(); item != entry["include"].end(); item++) {
+					if (indexes.count(item.key()) != 0) {
+						includes[collection][item.key()] = item.value().get<std::vector<std::string>>();
+					}
+				}
+			}
+			if (entry.contains("multikey")) {
+				for (const auto& item : entry["multikey"]) {
+					std::string index = item.get<std::string>();
+					if (indexes.count(index) != 0) {
+						multikey[collection].insert(index);
+					}
+				}
+			}
+		}
+		catch (const std::exception& e) {
+			return Status::Corruption("Failed to load index catalog: " + std::string(e.what()));
+		}
+	}
+	if (!iterator->status().ok()) {
+		return Status::IOError(iterator->status().ToString());
+	}
+
+	// Index column families created before the catalog existed are registered once
 	for (const auto& pair : columnFamilies_) {
-		if (pair.first != rocksdb::kDefaultColumnFamilyName &&
-			pair.first.find(index_delimiter_) != std::string::npos) {
-			size_t pos = pair.first.find(index_delimiter_);
-			std::string collectionName = pair.first.substr(0, pos);
-			std::string indexName = pair.first.substr(pos + index_delimiter_.length());
-			index[collectionName].insert(indexName);
+		size_t pos = pair.first.find(index_delimiter_);
+		if (pos == std::string::npos) {
+			continue;
+		}
+		std::string collection = pair.first.substr(0, pos);
+		std::string index = pair.first.substr(pos + index_delimiter_.length());
+		if (catalog[collection].insert(index).second) {
+			stale.insert(collection);
 		}
 	}
-	return index[collectionName];
+	for (const auto& entry : catalog) {
+		const IndexIncludes& included = includes[entry.first];
+		const std::set<std::string>& multikeyIndexes = multikey[entry.first];
+		if (stale.count(entry.first) != 0) {
+			Status status = saveIndexCatalog(entry.first, entry.second, included, multikeyIndexes);
+			if (!status.ok()) {
+				return status;
+			}
+		}
+		else if (!entry.second.empty()) {
+			indexCatalog_[entry.first] = std::make_shared<const std::set<std::string>>(entry.second);
+			if (!included.empty()) {
+				indexIncludes_[entry.first] = std::make_shared<const IndexIncludes>(included);
+			}
+			if (!multikeyIndexes.empty()) {
+				indexMultikey_[entry.first] = std::make_shared<const std::set<std::string>>(multikeyIndexes);
+			}
+		}
+	}
+	return Status::OK();
+}
+
+Status StorageEngine::checkIndexFormat() {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(catalog_name_);
+	if (handle == nullptr) {
+		return Status::NotFound("Index catalog not found");
+	}
+	std::string stored;
+	rocksdb::Status s = db_->Get(RocksDBOptimizer::getReadOptions(), handle, format_key_, &stored);
+	if (!s.ok() && !s.IsNotFound()) {
+		return Status::IOError(s.ToString());
+	}
+	if (s.ok() && stored == std::to_string(IndexKey::kFormatVersion)) {
+		return Status::OK();
+	}
+
+	// Keys written in an older layout cannot be parsed, the column families are recreated empty.
+	// The version is only recorded once they are rebuilt, an interrupted rebuild starts over
+	std::map<std::string, std::set<std::string>> indexes;
+	{
+		std::lock_guard<std::mutex> lock(catalog_mutex_);
+		for (const auto& entry : indexCatalog_) {
+			indexes[entry.first] = *entry.second;
+		}
+	}
+	for (const auto& entry : indexes) {
+		for (const std::string& index : entry.second) {
+			std::string name = getIndexCfName(entry.first, index);
+			Status status = dropCollection(name);
+			if (status.ok()) {
+				status = createCollection(name);
+			}
+			if (!status.ok()) {
+				return status;
+			}
+		}
+	}
+	indexesToRebuild_ = indexes;
+	if (indexesToRebuild_.empty()) {
+		return finishIndexRebuild();
+	}
+	return Status::OK();
+}
+
+std::map<std::string, std::set<std::string>> StorageEngine::getIndexesToRebuild() const {
+	return indexesToRebuild_;
+}
+
+Status StorageEngine::finishIndexRebuild() {
+	rocksdb::ColumnFamilyHandle* handle = getColumnFamily(catalog_name_);
+	if (handle == nullptr) {
+		return Status::NotFound("Index catalog not found");
+	}
+	rocksdb::Status s = db_->Put(RocksDBOptimizer::getWriteOptions(), handle, format_key_, std::to_string(IndexKey::kFormatVersion));
+	if (!s.ok()) {
+		return Status::IOError(s.ToString());
+	}
+	indexesToRebuild_.clear();
+	return Status::OK();
 }
 
 Status StorageEngine::exportAllToJson(const std::string& collection, const std::string& exportPath) {
@@ -425,38 +1169,59 @@ Status StorageEngine::exportAllToJson(const std::string& collection, const std::
 	}
 	// Start JSON array
 	file << "[\n";
-	bool first_entry = true;
 	auto it = columnFamilies_.find(collection);
 	if (it == columnFamilies_.end()) {
 		return Status::NotFound("Collection not found: " + collection);
 	}
-	rocksdb::Iterator* iterator = db_->NewIterator(RocksDBOptimizer::getReadOptions(), it->second);
 
-	for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
-		//std::unique_lock<std::mutex> lock(db_mutex_);
-		rocksdb::Slice value_slice = iterator->value();
+	// Ranges of the collection are decoded on several threads, each into its own part file,
+	// and the parts are appended to the dump in key order
+	std::vector<std::string> splits = splitKeyRange(collection, "", "", defaultScanThreads());
+	std::vector<std::string> part_files;
+	std::vector<char> part_empty(splits.size() + 1, 1);
+	for (size_t range = 0; range <= splits.size(); range++) {
+		part_files.push_back(temp_file + "." + std::to_string(range));
+	}
+	Status status = scanRanges(collection, "", "", splits, [&](size_t range, rocksdb::Iterator* iterator) {
+		std::ofstream part(part_files[range].c_str());
+		if (!part.is_open()) {
+			return Status::IOError("Failed to open file for writing: " + part_files[range]);
+		}
+		bool first_entry = true;
+		for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
+			rocksdb::Slice value_slice = iterator->value();
+
+			// Write comma if not the first entry
+			if (!first_entry) {
+				part << ",\n";
+			}
+			else {
+				first_entry = false;
+			}
 
-		// Write comma if not the first entry
-		if (!first_entry) {
-			file << ",\n";
+			std::vector<uint8_t> value_vec(value_slice.data(), value_slice.data() + value_slice.size());
+			part << json::from_msgpack(value_vec)["data"].dump(4);
+			// Add a microsecond sleep to prevent overwhelming system resources
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
 		}
-		else {
-			first_entry = false;
+		part_empty[range] = first_entry;
+		return part.good() ? Status::OK() : Status::IOError("Failed to write file: " + part_files[range]);
+	});
+	bool first_part = true;
+	for (size_t range = 0; range < part_files.size(); range++) {
+		if (status.ok() && !part_empty[range]) {
+			std::ifstream part(part_files[range].c_str());
+			if (!first_part) {
+				file << ",\n";
+			}
+			first_part = false;
+			file << part.rdbuf();
 		}
-
-		std::vector<uint8_t> value_vec(value_slice.data(), value_slice.data() + value_slice.size());
-		file << json::from_msgpack(value_vec)["data"].dump(4);
-		//lock.unlock();
-		// Add a microsecond sleep to prevent overwhelming system resources
-		std::this_thread::sleep_for(std::chrono::microseconds(100));
+		std::remove(part_files[range].c_str());
 	}
 	file << "\n]";
 	file.close();
 
-	// Check if iterator ended with an error
-	rocksdb::Status status = iterator->status();
-	delete iterator;
-
 	if (!status.ok()) {
 		// Remove the temporary file if there was an error
 		std::remove(temp_file.c_str());
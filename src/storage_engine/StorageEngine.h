@@ -4,14 +4,20 @@
 #include "json.hpp"
 
 #include "Status.h"
+#include "IndexKey.h"
+#include "ScanPool.h"
 
 #include "rocksdb/db.h"
 #include "rocksdb/table.h"
 #include "rocksdb/filter_policy.h"
+#include "rocksdb/metadata.h"
 #include "rocksdb/slice_transform.h"
 #include "rocksdb/utilities/options_util.h"
 #include "rocksdb/version.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb/write_buffer_manager.h"
 
+#include <atomic>
 #include <fstream>
 #include <sys/stat.h>  // For stat() function
 #ifdef _WIN32
@@ -20,7 +26,9 @@
 #include <unistd.h>  // For Unix-specific functions
 #include <sys/types.h>  // For mkdir on Unix
 #endif
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <set>
 #include <mutex>
 #include <thread>
@@ -28,29 +36,130 @@
 using json = nlohmann::json;
 namespace anudb {
 
+	class StorageEngine;
+
+	// Fields stored in the entries of each index of a collection, keyed by index name
+	typedef std::map<std::string, std::vector<std::string>> IndexIncludes;
+
+	// WriteBatch collects writes across a collection and its index column families
+	// so that they are committed to RocksDB atomically with a single WAL append
+	class WriteBatch {
+	public:
+		WriteBatch(StorageEngine* engine) : engine_(engine) {}
+
+		Status put(const std::string& collection, const std::string& key, const std::vector<uint8_t>& value);
+		Status putIndex(const std::string& collection, const std::string& key, const std::string& value);
+		Status remove(const std::string& collection, const std::string& key);
+		uint32_t count() const { return batch_.Count(); }
+		void clear() { batch_.Clear(); }
+
+	private:
+		friend class StorageEngine;
+		StorageEngine* engine_;
+		rocksdb::WriteBatch batch_;
+	};
+
 	// StorageEngine class that wraps RocksDB
 	class StorageEngine {
 	public:
-		StorageEngine(const std::string& dbPath) : dbPath_(dbPath), index_delimiter_("__index__"){}
+		// memoryBudget caps block cache and memtables of all column families together, 0 means no cap
+		StorageEngine(const std::string& dbPath, size_t memoryBudget = 0) : dbPath_(dbPath), db_(nullptr), index_delimiter_("__index__"), catalog_name_("__catalog__"), memoryBudget_(memoryBudget), format_key_("__format__"),
+			scanPool_(defaultScanThreads() - 1) {}
 		Status open();
 		Status close();
+		// Memory currently held by the block cache and memtables
+		size_t getMemoryUsage() const;
 
 		Status createCollection(const std::string& name);
 		Status dropCollection(const std::string& name);
 		Status put(const std::string& collection, const std::string& key, const std::vector<uint8_t>& value);
 		Status putIndex(const std::string& collection, const std::string& key, const std::string& value);
 		Status get(const std::string& collection, const std::string& key, std::vector<uint8_t>* value);
+		// Zero-copy lookup, value pins the block cache entry until it is reset or destroyed
+		Status get(const std::string& collection, const std::string& key, rocksdb::PinnableSlice* value);
+		// Batched point lookups, statuses and values are filled in the order of keys
+		Status multiGet(const std::string& collection, const std::vector<std::string>& keys,
+			std::vector<std::vector<uint8_t>>& values, std::vector<Status>& statuses);
+		Status multiGet(const std::string& collection, const std::vector<std::string>& keys,
+			std::vector<rocksdb::PinnableSlice>& values, std::vector<Status>& statuses);
+		// Values of every document in key order, large collections are read on several threads
 		Status getAll(const std::string& collection, std::vector<std::vector<uint8_t>>& value);
 		Status remove(const std::string& collection, const std::string& key);
+		// Commit all writes collected in the batch atomically
+		Status write(WriteBatch& batch);
 		bool collectionExists(const std::string& name) const;
 		std::vector<std::string> getCollectionNames() const;
-		std::set<std::string> getIndexNames(std::string);
+		std::set<std::string> getIndexNames(const std::string& collection) const;
+		// Immutable snapshot of the index names of a collection, cheap to take on the write path
+		std::shared_ptr<const std::set<std::string>> getIndexSet(const std::string& collection) const;
+		// Changes whenever an index of any collection is created or dropped, or the catalog is loaded,
+		// so a caller can keep what it derived from getIndexSet until the version moves
+		uint64_t getIndexVersion() const { return indexVersion_.load(); }
+		// Fields stored in the index entries of a collection, indexes without included fields are absent
+		std::shared_ptr<const IndexIncludes> getIndexIncludes(const std::string& collection) const;
+		// Indexes of a collection holding one entry per array element, see Collection::createIndex
+		std::shared_ptr<const std::set<std::string>> getMultikeyIndexes(const std::string& collection) const;
+		// Create/drop the index column family of a collection and record it in the index catalog,
+		// include lists the document fields copied into the value of every index entry.
+		// Creating an index that already exists fails, whatever its options
+		Status createIndex(const std::string& collection, const std::string& index,
+			const std::vector<std::string>& include = std::vector<std::string>(), bool multikey = false);
+		Status dropIndex(const std::string& collection, const std::string& index);
+		// Indexes emptied by open() because their keys are in an older layout, see IndexKey::kFormatVersion.
+		// They are registered but hold no entries until rebuilt from the documents
+		std::map<std::string, std::set<std::string>> getIndexesToRebuild() const;
+		// Record that the indexes returned by getIndexesToRebuild hold the current layout
+		Status finishIndexRebuild();
+		// Write the documents to exportPath/collection.json, ranges of a large collection are decoded on several threads
 		Status exportAllToJson(const std::string& collection, const std::string& exportPath);
 		std::unordered_map<std::string, rocksdb::ColumnFamilyHandle*> getColumnFamilies() const;
-		Status fetchDocIdsForEqual(const std::string& collection, const std::string& key, std::vector<std::string>& docIds) const;
-		Status fetchDocIdsForGreater(const std::string& collection, const std::string& key, std::vector<std::string>& docIds) const;
-		Status fetchDocIdsForLesser(const std::string& collection, const std::string& prefix, std::vector<std::string>& docIds) const;
+		// value is the encoded index value, see IndexKey
+		Status fetchDocIdsForEqual(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const;
+		Status fetchDocIdsForGreater(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const;
+		Status fetchDocIdsForLesser(const std::string& collection, const std::string& value, std::vector<std::string>& docIds) const;
+		// Collect doc ids of index keys in [lowerBound, upperBound), see IndexKey::lowerBound / upperBound.
+		// An empty bound leaves that side open, reverse returns the entries in descending order.
+		// Large ranges are read on several threads, see parallelScan
+		Status fetchDocIdsForRange(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+			std::vector<std::string>& docIds, bool reverse = false) const;
 		Status fetchDocIdsByOrder(const std::string& collection, const std::string& key, std::vector<std::string>& docIds) const;
+		// Approximate number of index entries in [lowerBound, upperBound) from memtable statistics and
+		// SST size estimates. Only a range the estimates put below kExactEstimateBytes is read, its entries
+		// are counted up to kExactEstimateEntries. An empty bound leaves that side open
+		uint64_t estimateIndexEntries(const std::string& collection, const std::string& lowerBound, const std::string& upperBound) const;
+		// Keys of the documents of a collection accepted by match, in key order, see parallelScan.
+		// match is called concurrently and must be thread safe
+		Status scanCollection(const std::string& collection, size_t threads,
+			const std::function<bool(const rocksdb::Slice& key, const rocksdb::Slice& value)>& match,
+			std::vector<std::string>& keys) const;
+		// Split points dividing [lowerBound, upperBound) of a column family into up to parts ranges of about
+		// the same size in bytes, chosen among the SST file boundaries and keys interpolated between the first
+		// and last key, weighed with GetApproximateSizes. Ranges hold at least minBytes, so a small range is
+		// not split. An empty bound leaves that side open
+		std::vector<std::string> splitKeyRange(const std::string& collection, const std::string& lowerBound,
+			const std::string& upperBound, size_t parts, uint64_t minBytes = kMinScanRangeBytes) const;
+		// Run scan for each range between the split points, numbered in key order, on the engine's scan
+		// workers and the calling thread. Every iterator is bounded to its range, unpositioned, and reads
+		// the same snapshot
+		Status scanRanges(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+			const std::vector<std::string>& splits, const std::function<Status(size_t range, rocksdb::Iterator* iterator)>& scan) const;
+		// Sets result for an entry of a parallel scan, false leaves the entry out. Called concurrently
+		typedef std::function<bool(const rocksdb::Slice& key, const rocksdb::Slice& value, std::string& result)> ScanVisitor;
+		// Results of visit over [lowerBound, upperBound) of a column family split into up to threads ranges,
+		// appended to results. ordered keeps the key order, otherwise the results of each range are appended
+		// as soon as it is done
+		Status parallelScan(const std::string& collection, const std::string& lowerBound, const std::string& upperBound,
+			size_t threads, bool ordered, const ScanVisitor& visit, std::vector<std::string>& results) const;
+		// Ranges a scan without a thread count is split into, one per core. The engine keeps one scan
+		// worker less, the thread starting a scan is the last one
+		static size_t defaultScanThreads();
+		// Smallest range a scan is split into, smaller ones do not pay for handing them to a worker
+		static const uint64_t kMinScanRangeBytes = 256 * 1024;
+		// Index ranges estimateIndexEntries counts instead of weighing, a few data blocks at most
+		static const uint64_t kExactEstimateBytes = 64 * 1024;
+		static const uint64_t kExactEstimateEntries = 4096;
+		// Iterator over a collection or index column family, bound slices in options must outlive the iterator
+		Status newIterator(const std::string& collection, const rocksdb::ReadOptions& options, std::unique_ptr<rocksdb::Iterator>& iterator) const;
 		rocksdb::DB* getDB();
 		virtual ~StorageEngine();
 		// Decode a Big-Endian encoded integer from a RocksDB key
@@ -68,12 +177,44 @@ namespace anudb {
 
 
 	private:
+		friend class WriteBatch;
+		rocksdb::ColumnFamilyHandle* getColumnFamily(const std::string& name) const;
+		// Options profile for a column family, chosen from its name
+		rocksdb::ColumnFamilyOptions getColumnFamilyOptions(const std::string& name) const;
+		std::string getIndexCfName(const std::string& collection, const std::string& index) const;
+		// Load the index catalog and reconcile it with the existing index column families
+		Status loadIndexCatalog();
+		// Empty the index column families when the catalog records an older key layout, or none
+		Status checkIndexFormat();
+		// Replace the index names of a collection and persist them, caller must hold catalog_mutex_
+		Status saveIndexCatalog(const std::string& collection, const std::set<std::string>& indexes,
+			const IndexIncludes& includes = IndexIncludes(), const std::set<std::string>& multikey = std::set<std::string>());
+
 		std::string dbPath_;
 		rocksdb::DB* db_;
 		std::unordered_map<std::string, rocksdb::ColumnFamilyHandle*> columnFamilies_;
 		std::vector<std::unique_ptr<rocksdb::ColumnFamilyHandle, std::function<void(rocksdb::ColumnFamilyHandle*)>>> ownedHandles_;
 		std::string index_delimiter_;
+		std::string catalog_name_;
+		// Block cache shared by all column families
+		std::shared_ptr<rocksdb::Cache> blockCache_;
+		size_t memoryBudget_;
+		std::shared_ptr<rocksdb::WriteBufferManager> writeBufferManager_;
+		rocksdb::ColumnFamilyOptions documentCfOptions_;
+		rocksdb::ColumnFamilyOptions indexCfOptions_;
+		// In-memory mirror of the catalog column family: collection -> index names.
+		// Sets are replaced, never modified in place, so readers can hold on to a snapshot
+		std::unordered_map<std::string, std::shared_ptr<const std::set<std::string>>> indexCatalog_;
+		std::unordered_map<std::string, std::shared_ptr<const IndexIncludes>> indexIncludes_;
+		std::unordered_map<std::string, std::shared_ptr<const std::set<std::string>>> indexMultikey_;
+		std::map<std::string, std::set<std::string>> indexesToRebuild_;
+		// Catalog key of the index key layout version, not a collection
+		std::string format_key_;
+		mutable std::mutex catalog_mutex_;
+		std::atomic<uint64_t> indexVersion_{ 0 };
 		//mutable std::mutex db_mutex_;
+		// Workers shared by all parallel scans, see scanRanges
+		mutable ScanPool scanPool_;
 	};
 
 	class RocksDBOptimizer {
@@ -114,6 +255,12 @@ namespace anudb {
 			bool enable_direct_io = true;         // Hardware dependent
 
 			int prefix_length = 8;
+
+			// Index column families are scanned in key order, larger blocks mean fewer block reads
+			size_t index_block_size = 16 * 1024;
+
+			// Database-wide cap for block cache and memtables together, 0 means no cap
+			size_t memory_budget = 0;
 		};
 
 		static rocksdb::Options getOptimizedOptions(const EmbeddedConfig& config) {
@@ -198,6 +345,61 @@ namespace anudb {
 			return options;
 		}
 
+		// Column family options for document collections, tuned for point lookups by document id
+		static rocksdb::ColumnFamilyOptions getDocumentCFOptions(const EmbeddedConfig& config, const std::shared_ptr<rocksdb::Cache>& cache) {
+			rocksdb::ColumnFamilyOptions options;
+			applyCommonCFOptions(config, options);
+
+			rocksdb::BlockBasedTableOptions table_options;
+			table_options.block_cache = cache;
+			table_options.block_size = config.block_size;
+			table_options.cache_index_and_filter_blocks = config.cache_index_and_filter_blocks;
+			table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+			table_options.pin_top_level_index_and_filter = true;
+			table_options.format_version = 5;
+
+			// Whole key bloom filters let a Get skip SST files that do not hold the id
+			table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(config.bloom_filter_bits_per_key));
+			table_options.whole_key_filtering = true;
+			table_options.partition_filters = true;
+			table_options.index_type = rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+
+			// Hash index inside data blocks avoids the binary search on point lookups
+			table_options.data_block_index_type = rocksdb::BlockBasedTableOptions::kDataBlockBinaryAndHash;
+			table_options.data_block_hash_table_util_ratio = 0.75;
+			options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+			// Memtable bloom filter for ids that are not in the memtable
+			options.memtable_prefix_bloom_size_ratio = 0.02;
+			options.memtable_whole_key_filtering = true;
+			options.optimize_filters_for_hits = true;
+			return options;
+		}
+
+		// Column family options for index column families, tuned for ordered range scans
+		static rocksdb::ColumnFamilyOptions getIndexCFOptions(const EmbeddedConfig& config, const std::shared_ptr<rocksdb::Cache>& cache) {
+			rocksdb::ColumnFamilyOptions options;
+			applyCommonCFOptions(config, options);
+
+			rocksdb::BlockBasedTableOptions table_options;
+			table_options.block_cache = cache;
+			table_options.block_size = config.index_block_size;
+			table_options.cache_index_and_filter_blocks = config.cache_index_and_filter_blocks;
+			table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+			table_options.pin_top_level_index_and_filter = true;
+			table_options.format_version = 5;
+			// Index keys are only reached through seeks and scans, so filter on the value prefix
+			// and let $eq lookups skip SST files that do not hold the value
+			table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(config.bloom_filter_bits_per_key));
+			table_options.whole_key_filtering = false;
+			options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+			options.prefix_extractor = std::make_shared<IndexKeyPrefixTransform>();
+			options.memtable_prefix_bloom_size_ratio = 0.02;
+
+			options.optimize_filters_for_hits = false;
+			return options;
+		}
+
 		// Optimized read options
 		static rocksdb::ReadOptions getReadOptions() {
 			rocksdb::ReadOptions read_options;
@@ -208,6 +410,15 @@ namespace anudb {
 			return read_options;
 		}
 
+		// Read options for scans that cross values, ignores the prefix extractor
+		static rocksdb::ReadOptions getScanReadOptions() {
+			rocksdb::ReadOptions read_options;
+			read_options.total_order_seek = true;
+			read_options.verify_checksums = false;
+			read_options.fill_cache = true;
+			return read_options;
+		}
+
 		// Optimized write options
 		static rocksdb::WriteOptions getWriteOptions() {
 			rocksdb::WriteOptions write_options;
@@ -216,12 +427,56 @@ namespace anudb {
 			return write_options;
 		}
 
-		// Memory usage estimation
-		static size_t estimateMemoryUsage(const EmbeddedConfig& config) {
-			return config.write_buffer_size * config.max_write_buffer_number +
+		// Memory usage estimation, every column family has its own memtables
+		static size_t estimateMemoryUsage(const EmbeddedConfig& config, size_t numColumnFamilies = 1) {
+			if (config.memory_budget > 0) {
+				// Memtables are charged to the block cache, which is sized to the budget
+				return config.memory_budget + (1 << 20);  // Additional overhead
+			}
+			return config.write_buffer_size * config.max_write_buffer_number * numColumnFamilies +
 				config.block_cache_size +
 				(1 << 20);  // Additional overhead
 		}
+
+		// Fit cache and write buffers into the memory budget
+		static void applyMemoryBudget(EmbeddedConfig& config) {
+			if (config.memory_budget == 0) {
+				return;
+			}
+			// Memtables may use up to half of the budget, the block cache gets all of it and
+			// memtable memory is charged against it, so the total stays within the budget
+			config.block_cache_size = config.memory_budget;
+			config.write_buffer_size = std::max<size_t>(std::min(config.write_buffer_size, config.memory_budget / 8), 64 << 10);
+		}
+
+		// Write buffer manager capping memtables of all column families
+		static std::shared_ptr<rocksdb::WriteBufferManager> getWriteBufferManager(const EmbeddedConfig& config, const std::shared_ptr<rocksdb::Cache>& cache) {
+			if (config.memory_budget == 0) {
+				return nullptr;
+			}
+			// Stall writes instead of growing past the cap
+			return std::make_shared<rocksdb::WriteBufferManager>(config.memory_budget / 2, cache, true);
+		}
+
+	private:
+		// Write buffer, compaction and compression settings shared by all column families
+		static void applyCommonCFOptions(const EmbeddedConfig& config, rocksdb::ColumnFamilyOptions& options) {
+			options.write_buffer_size = config.write_buffer_size;
+			options.min_write_buffer_number_to_merge = config.min_write_buffer_number;
+			options.max_write_buffer_number = config.max_write_buffer_number;
+			options.level0_file_num_compaction_trigger = config.level0_file_num_compaction_trigger;
+
+			options.compression_opts.level = 5;
+			options.compression = config.compression;
+			options.bottommost_compression = config.bottommost_compression;
+
+			options.num_levels = 4;
+			options.target_file_size_base = 16 * 1024 * 1024;
+			options.target_file_size_multiplier = 2;
+			options.level_compaction_dynamic_level_bytes = false;
+			options.max_bytes_for_level_base = 16 * 1024 * 1024;
+			options.max_bytes_for_level_multiplier = 8;
+		}
 	};
 }
 
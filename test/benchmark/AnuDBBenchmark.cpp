@@ -0,0 +1,422 @@
+#include "Database.h"
+#include "json.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace anudb;
+using json = nlohmann::json;
+
+// Micro benchmark for the storage layout, run by hand to compare changes.
+// The number of documents can be set with the ANUDB_BENCH_DOCS environment variable.
+
+static bool removeDirectoryRecursive(const std::string& path) {
+#ifdef _WIN32
+	std::string command = "rmdir /S /Q \"" + path + "\"";
+#else
+	std::string command = "rm -rf \"" + path + "\"";
+#endif
+	return system(command.c_str()) == 0;
+}
+
+static std::string makeId(int index) {
+	return "prod" + std::to_string(index);
+}
+
+static json makeProduct(int index, std::mt19937& gen) {
+	static const std::vector<std::string> categories = { "Electronics", "Books", "Food", "Clothing" };
+	std::uniform_real_distribution<> priceDist(10.0, 1000.0);
+	std::uniform_int_distribution<> stockDist(1, 500);
+
+	json product;
+	product["name"] = "Product " + std::to_string(index);
+	product["category"] = categories[index % categories.size()];
+	product["price"] = priceDist(gen);
+	product["stock"] = stockDist(gen);
+	product["sku"] = "SKU-" + std::to_string(index);
+	product["description"] = "Benchmark product number " + std::to_string(index);
+	return product;
+}
+
+class Timer {
+public:
+	Timer() : start_(std::chrono::steady_clock::now()) {}
+	double elapsedMs() const {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+	}
+private:
+	std::chrono::steady_clock::time_point start_;
+};
+
+static void report(const std::string& name, double totalMs, size_t ops) {
+	std::cout << std::left << std::setw(28) << name
+		<< std::right << std::setw(12) << std::fixed << std::setprecision(2) << totalMs << " ms"
+		<< std::setw(14) << std::setprecision(3) << (ops ? totalMs * 1000.0 / ops : 0.0) << " us/op"
+		<< std::setw(10) << ops << " ops" << std::endl;
+}
+
+int main() {
+	int numDocs = 20000;
+	const char* env = std::getenv("ANUDB_BENCH_DOCS");
+	if (env != nullptr && std::atoi(env) > 0) {
+		numDocs = std::atoi(env);
+	}
+	const int numLookups = 20000;
+	const int numQueries = 20;
+	const std::string dbPath = "./anudb_benchmark";
+
+	removeDirectoryRecursive(dbPath);
+	Database db(dbPath);
+	Status status = db.open();
+	if (!status.ok()) {
+		std::cerr << "Failed to open database: " << status.message() << std::endl;
+		return 1;
+	}
+	status = db.createCollection("products");
+	if (!status.ok()) {
+		std::cerr << "Failed to create collection: " << status.message() << std::endl;
+		return 1;
+	}
+	Collection* products = db.getCollection("products");
+	products->createIndex("category");
+	products->createIndex("price");
+	products->createIndex("sku");
+
+	std::cout << "AnuDB benchmark with " << numDocs << " documents" << std::endl;
+
+	// Bulk load
+	std::mt19937 gen(42);
+	std::vector<Document> docs;
+	docs.reserve(numDocs);
+	for (int i = 0; i < numDocs; i++) {
+		docs.emplace_back(makeId(i), makeProduct(i, gen));
+	}
+	std::vector<Status> statuses;
+	Timer insertTimer;
+	products->insertMany(docs, statuses);
+	report("insertMany", insertTimer.elapsedMs(), numDocs);
+
+	// Point lookups of existing documents
+	std::uniform_int_distribution<> idDist(0, numDocs - 1);
+	int found = 0;
+	Timer readTimer;
+	for (int i = 0; i < numLookups; i++) {
+		Document doc;
+		if (products->readDocument(makeId(idDist(gen)), doc).ok()) {
+			found++;
+		}
+	}
+	report("readDocument (hit)", readTimer.elapsedMs(), numLookups);
+
+	// Point lookups of ids that do not exist
+	Timer missTimer;
+	for (int i = 0; i < numLookups; i++) {
+		Document doc;
+		products->readDocument("missing" + std::to_string(idDist(gen)), doc);
+	}
+	report("readDocument (miss)", missTimer.elapsedMs(), numLookups);
+
+	// Batched lookups
+	std::vector<std::string> ids;
+	for (int i = 0; i < numLookups; i++) {
+		ids.push_back(makeId(idDist(gen)));
+	}
+	std::vector<Document> batch;
+	Timer multiTimer;
+	products->readDocuments(ids, batch);
+	report("readDocuments", multiTimer.elapsedMs(), ids.size());
+
+	// Index queries
+	size_t results = 0;
+	Timer eqTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$eq", {{"category", "Books"}}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $eq", eqTimer.elapsedMs(), numQueries);
+
+	// Same filter repeated with the result cache on, every call after the first is a cache hit
+	products->setQueryCacheCapacity(64);
+	Timer cachedTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$eq", {{"category", "Books"}}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $eq cached", cachedTimer.elapsedMs(), numQueries);
+	products->setQueryCacheCapacity(0);
+
+	// Selective $eq lookups, one entry per value, misses should be answered by the prefix bloom filters
+	Timer eqHitTimer;
+	for (int i = 0; i < numLookups; i++) {
+		json filter = { {"$eq", {{"sku", "SKU-" + std::to_string(idDist(gen))}}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $eq (hit)", eqHitTimer.elapsedMs(), numLookups);
+
+	Timer eqMissTimer;
+	for (int i = 0; i < numLookups; i++) {
+		json filter = { {"$eq", {{"sku", "SKU-missing-" + std::to_string(idDist(gen))}}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $eq (miss)", eqMissTimer.elapsedMs(), numLookups);
+
+	// Same lookups through a query prepared once, each run binds the sku and opens the index scan
+	std::unique_ptr<PreparedQuery> skuQuery;
+	products->prepare({ {"$eq", {{"sku", {{"$param", "sku"}}}}} }, skuQuery);
+	Timer preparedTimer;
+	for (int i = 0; i < numLookups; i++) {
+		std::vector<std::string> ids;
+		skuQuery->bind("sku", "SKU-" + std::to_string(idDist(gen)));
+		if (skuQuery->findDocument(ids).ok()) {
+			results += ids.size();
+		}
+	}
+	report("prepared $eq (hit)", preparedTimer.elapsedMs(), numLookups);
+
+	// 50 values of one field, as one $in against an $or of $eq clauses
+	const int numValues = 50;
+	size_t inResults = 0;
+	size_t orResults = 0;
+	std::vector<json> skuLists;
+	for (int i = 0; i < numQueries; i++) {
+		json skus = json::array();
+		for (int j = 0; j < numValues; j++) {
+			skus.push_back("SKU-" + std::to_string(idDist(gen)));
+		}
+		skuLists.push_back(skus);
+	}
+	Timer inTimer;
+	for (const json& skus : skuLists) {
+		json filter = { {"$in", {{"sku", skus}}} };
+		inResults += products->findDocument(filter).size();
+	}
+	report("findDocument $in (50)", inTimer.elapsedMs(), numQueries);
+
+	Timer orEqTimer;
+	for (const json& skus : skuLists) {
+		json clauses = json::array();
+		for (const json& sku : skus) {
+			clauses.push_back({ {"$eq", {{"sku", sku}}} });
+		}
+		json filter = { {"$or", clauses} };
+		orResults += products->findDocument(filter).size();
+	}
+	report("findDocument $or of $eq", orEqTimer.elapsedMs(), numQueries);
+	if (inResults != orResults) {
+		std::cerr << "$in and $or results differ: " << inResults << " vs " << orResults << std::endl;
+	}
+	results += inResults;
+
+	Timer gtTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$gt", {{"price", 900.0}}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $gt", gtTimer.elapsedMs(), numQueries);
+
+	// Aggregates of the same range, the prices are decoded from the index keys
+	Timer countTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json counts;
+		if (products->aggregate({ {"$gt", {{"price", 900.0}}} }, {
+			{"n", {{"$count", json::object()}}},
+			{"total", {{"$sum", "price"}}}
+		}, counts).ok()) {
+			results += counts["n"].get<size_t>();
+		}
+	}
+	report("aggregate $count/$sum $gt", countTimer.elapsedMs(), numQueries);
+
+	Timer minMaxTimer;
+	for (int i = 0; i < numLookups; i++) {
+		json bounds;
+		if (products->aggregate(json::object(), {
+			{"low", {{"$min", "price"}}},
+			{"high", {{"$max", "price"}}}
+		}, bounds).ok() && !bounds["low"].is_null()) {
+			results++;
+		}
+	}
+	report("aggregate $min/$max", minMaxTimer.elapsedMs(), numLookups);
+
+	// Average price per category, from the category index walk and from a hash table of the stock values
+	json byCategory = {
+		{"n", {{"$count", json::object()}}},
+		{"mean", {{"$avg", "price"}}}
+	};
+	Timer groupIndexTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json groups;
+		if (products->group(json::object(), "category", byCategory, groups).ok()) {
+			results += groups.size();
+		}
+	}
+	report("group indexed field", groupIndexTimer.elapsedMs(), numQueries);
+
+	Timer groupHashTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json groups;
+		if (products->group(json::object(), "stock", byCategory, groups).ok()) {
+			results += groups.size();
+		}
+	}
+	report("group hash table", groupHashTimer.elapsedMs(), numQueries);
+
+	Timer groupSpillTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json groups;
+		if (products->group(json::object(), "stock", byCategory, groups, 16 * 1024).ok()) {
+			results += groups.size();
+		}
+	}
+	report("group hash table spilled", groupSpillTimer.elapsedMs(), numQueries);
+
+	// First page of the same range, only the first entries of the index are touched
+	Timer pageTimer;
+	for (int i = 0; i < numQueries; i++) {
+		QueryOptions options;
+		options.limit = 10;
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find({ {"$gt", {{"price", 900.0}}} }, cursor, options).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				Document doc;
+				cursor->current(&doc);
+				results++;
+			}
+		}
+	}
+	report("find $gt limit 10", pageTimer.elapsedMs(), numQueries);
+
+	// A page further down the same range, reached by skipping the entries before it or from the token of
+	// the previous page. The token seeks past the entries, the page costs the same as the first one
+	const uint64_t pageOffset = products->findDocument({ {"$gt", {{"price", 900.0}}} }).size() / 2;
+	QueryOptions skipOptions;
+	skipOptions.skip = pageOffset;
+	skipOptions.limit = 10;
+	QueryOptions tokenOptions;
+	tokenOptions.limit = 10;
+	{
+		QueryOptions previous;
+		previous.limit = pageOffset;
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find({ {"$gt", {{"price", 900.0}}} }, cursor, previous).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				tokenOptions.continuation = cursor->continuationToken();
+			}
+		}
+	}
+	Timer skipPageTimer;
+	for (int i = 0; i < numQueries; i++) {
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find({ {"$gt", {{"price", 900.0}}} }, cursor, skipOptions).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				Document doc;
+				cursor->current(&doc);
+				results++;
+			}
+		}
+	}
+	report("find $gt page N (skip)", skipPageTimer.elapsedMs(), numQueries);
+
+	Timer tokenPageTimer;
+	for (int i = 0; i < numQueries; i++) {
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find({ {"$gt", {{"price", 900.0}}} }, cursor, tokenOptions).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				Document doc;
+				cursor->current(&doc);
+				results++;
+			}
+		}
+	}
+	report("find $gt page N (token)", tokenPageTimer.elapsedMs(), numQueries);
+
+	// Broad category combined with a narrow price range, the planner should drive the scan from price
+	Timer andTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$and", {
+			{{"$eq", {{"category", "Books"}}}},
+			{{"$between", {{"price", {500.0, 510.0}}}}}
+		}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $and", andTimer.elapsedMs(), numQueries);
+
+	// Most expensive 20 books, walks the price index from the end and checks the category of each document
+	QueryOptions topOptions;
+	topOptions.sortField = "price";
+	topOptions.sortDescending = true;
+	topOptions.limit = 20;
+	json books = { {"$eq", {{"category", "Books"}}} };
+	Timer topTimer;
+	for (int i = 0; i < numQueries; i++) {
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find(books, cursor, topOptions).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				results++;
+			}
+		}
+	}
+	report("find sorted top 20", topTimer.elapsedMs(), numQueries);
+
+	// Same query once a compound index holds both fields
+	products->createIndex({ "category", "price" });
+	Timer topCompoundTimer;
+	for (int i = 0; i < numQueries; i++) {
+		std::unique_ptr<QueryCursor> cursor;
+		if (products->find(books, cursor, topOptions).ok()) {
+			for (; cursor->isValid(); cursor->next()) {
+				results++;
+			}
+		}
+	}
+	report("find sorted top 20 compound", topCompoundTimer.elapsedMs(), numQueries);
+
+	Timer compoundTimer;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$and", {
+			{{"$eq", {{"category", "Books"}}}},
+			{{"$between", {{"price", {500.0, 510.0}}}}}
+		}} };
+		results += products->findDocument(filter).size();
+	}
+	report("findDocument $and compound", compoundTimer.elapsedMs(), numQueries);
+
+	// Filter on a field without an index: scan of the stored msgpack against decoding every document first
+	Timer scanTimer;
+	size_t scanned = 0;
+	for (int i = 0; i < numQueries; i++) {
+		json filter = { {"$lt", {{"stock", 50}}} };
+		scanned += products->findDocument(filter).size();
+	}
+	report("findDocument unindexed", scanTimer.elapsedMs(), numQueries);
+
+	Timer decodeTimer;
+	size_t decoded = 0;
+	for (int i = 0; i < numQueries; i++) {
+		auto cursor = products->createCursor();
+		for (; cursor->isValid(); cursor->next()) {
+			Document doc;
+			if (cursor->current(&doc).ok() && doc.data()["stock"].get<int>() < 50) {
+				decoded++;
+			}
+		}
+	}
+	report("decode then filter", decodeTimer.elapsedMs(), numQueries);
+	if (scanned != decoded) {
+		std::cerr << "Scan and decode results differ: " << scanned << " vs " << decoded << std::endl;
+	}
+
+	if (found != numLookups || results == 0) {
+		std::cerr << "Unexpected benchmark results" << std::endl;
+	}
+
+	db.dropCollection("products");
+	db.close();
+	removeDirectoryRecursive(dbPath);
+	return 0;
+}
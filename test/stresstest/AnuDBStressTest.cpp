@@ -148,6 +148,51 @@ protected:
 			<< "Some document insertions failed";
 	}
 
+	// Threaded bulk insertion test, each thread commits its documents in groups
+	void insertDocumentsInBulkMultiThreaded(const std::string& prefix, size_t batchSize) {
+		std::vector<std::thread> threads;
+		std::atomic<int> successfulInserts{ 0 };
+		std::atomic<int> failedInserts{ 0 };
+
+		auto insertWorker = [&prefix, batchSize, &successfulInserts, &failedInserts](int startIndex, int endIndex) {
+			std::vector<Document> docs;
+			docs.reserve(endIndex - startIndex);
+			for (int i = startIndex; i < endIndex; ++i) {
+				docs.push_back(Document(prefix + std::to_string(i), generateRandomProduct(i)));
+			}
+
+			std::vector<Status> statuses;
+			products->insertMany(docs, statuses, batchSize);
+			for (const Status& status : statuses) {
+				if (status.ok()) {
+					successfulInserts++;
+				}
+				else {
+					failedInserts++;
+				}
+			}
+			};
+
+		// Divide work among threads
+		int docsPerThread = NUM_DOCUMENTS / NUM_THREADS;
+		for (int t = 0; t < NUM_THREADS; ++t) {
+			int start = t * docsPerThread;
+			int end = (t == NUM_THREADS - 1) ? NUM_DOCUMENTS : (t + 1) * docsPerThread;
+			threads.emplace_back(insertWorker, start, end);
+		}
+
+		// Wait for all threads to complete
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		// Verify insertions
+		EXPECT_EQ(successfulInserts, NUM_DOCUMENTS)
+			<< "Not all documents were inserted successfully";
+		EXPECT_EQ(failedInserts, 0)
+			<< "Some document insertions failed";
+	}
+
 	// Threaded document reading test
 	void readDocumentsMultiThreaded() {
 		std::vector<std::thread> threads;
@@ -209,9 +254,10 @@ protected:
 			};
 			
 			for (const auto& query : queries) {
-				std::vector<std::string> docIds = products->findDocument(query);
+				json counts;
+				Status status = products->aggregate(query, { {"matches", {{"$count", json::object()}}} }, counts);
 
-				if (docIds.size()) {
+				if (status.ok() && counts["matches"] > 0) {
 					successfulQueries++;
 				}
 				else {
@@ -352,6 +398,11 @@ TEST_F(AnuDBStressTest, WriteReadFindUpdateStressTest) {
 	auto durationInsert = std::chrono::duration_cast<std::chrono::milliseconds>(endInsert - startInsert);
 	std::cout << "Inserting documents took "
 		<< durationInsert.count() << " ms" << std::endl;
+	// Each insert commits the document and its index entries as one write batch
+	std::vector<std::string> indexes;
+	products->getIndex(indexes);
+	std::cout << "Average insert latency with " << indexes.size() << " indexes: "
+		<< (durationInsert.count() * 1000.0 / NUM_DOCUMENTS) << " us/document" << std::endl;
 
 	auto startRead = std::chrono::high_resolution_clock::now();
 	readDocumentsMultiThreaded();
@@ -379,6 +430,31 @@ TEST_F(AnuDBStressTest, WriteReadFindUpdateStressTest) {
 #endif
 }
 
+TEST_F(AnuDBStressTest, BulkInsertDeleteStressTest) {
+	auto startInsert = std::chrono::high_resolution_clock::now();
+	insertDocumentsInBulkMultiThreaded("bulk_", 1000);
+	auto endInsert = std::chrono::high_resolution_clock::now();
+	auto durationInsert = std::chrono::duration_cast<std::chrono::milliseconds>(endInsert - startInsert);
+	std::cout << "Bulk inserting documents took "
+		<< durationInsert.count() << " ms ("
+		<< (durationInsert.count() * 1000.0 / NUM_DOCUMENTS) << " us/document)" << std::endl;
+
+	std::vector<std::string> ids;
+	ids.reserve(NUM_DOCUMENTS);
+	for (int i = 0; i < NUM_DOCUMENTS; ++i) {
+		ids.push_back("bulk_" + std::to_string(i));
+	}
+
+	auto startDelete = std::chrono::high_resolution_clock::now();
+	std::vector<Status> statuses;
+	Status status = products->deleteMany(ids, statuses, 1000);
+	auto endDelete = std::chrono::high_resolution_clock::now();
+	auto durationDelete = std::chrono::duration_cast<std::chrono::milliseconds>(endDelete - startDelete);
+	EXPECT_TRUE(status.ok()) << status.message();
+	std::cout << "Bulk deleting documents took "
+		<< durationDelete.count() << " ms" << std::endl;
+}
+
 // Static member initialization
 Database* AnuDBStressTest::db = nullptr;
 Collection* AnuDBStressTest::products = nullptr;
@@ -2,6 +2,7 @@
 #include "Database.h"
 #include "json.hpp"
 #include <iostream>
+#include <map>
 #include <vector>
 #include <string>
 #ifdef _WIN32
@@ -427,6 +428,45 @@ TEST_F(AnuDBTest, DatabaseOpenClose) {
     EXPECT_TRUE(db->isDbOpen());
 }
 
+TEST_F(AnuDBTest, DatabaseMemoryBudget) {
+    std::string budgetPath = "./test_budget_db";
+    removeDirectoryRecursive(budgetPath);
+
+    const size_t budget = 8 << 20;
+    Database budgetDb(budgetPath, budget);
+    Status status = budgetDb.open();
+    ASSERT_TRUE(status.ok()) << status.message();
+
+    // Several collections with indexes all share the same budget
+    for (int c = 0; c < 4; c++) {
+        std::string name = "coll" + std::to_string(c);
+        ASSERT_TRUE(budgetDb.createCollection(name).ok());
+        Collection* coll = budgetDb.getCollection(name);
+        ASSERT_TRUE(coll->createIndex("value").ok());
+        ASSERT_TRUE(coll->createIndex("group").ok());
+
+        std::vector<Document> docs;
+        for (int i = 0; i < 500; i++) {
+            json data = { {"value", i}, {"group", "g" + std::to_string(i % 10)}, {"payload", std::string(200, 'x')} };
+            docs.emplace_back("doc" + std::to_string(i), data);
+        }
+        std::vector<Status> statuses;
+        ASSERT_TRUE(coll->insertMany(docs, statuses).ok());
+    }
+
+    EXPECT_GT(budgetDb.getMemoryUsage(), 0);
+    EXPECT_LE(budgetDb.getMemoryUsage(), budget);
+
+    Collection* coll = budgetDb.getCollection("coll3");
+    Document doc;
+    EXPECT_TRUE(coll->readDocument("doc42", doc).ok());
+    EXPECT_EQ(doc.data()["value"], 42);
+    EXPECT_EQ(coll->findDocument({ {"$eq", {{"group", "g3"}}} }).size(), 50);
+
+    EXPECT_TRUE(budgetDb.close().ok());
+    removeDirectoryRecursive(budgetPath);
+}
+
 TEST_F(AnuDBTest, CollectionManagement) {
     // Create a new collection
     Status status = db->createCollection("test_collection");
@@ -492,6 +532,21 @@ TEST_F(AnuDBTest, DocumentRead) {
     EXPECT_FALSE(status.ok());
 }
 
+TEST_F(AnuDBTest, DocumentReadMany) {
+    std::vector<std::string> ids = {"prod003", "prod001", "non_existent_id", "prod014"};
+    std::vector<Document> docs;
+    Status status = products->readDocuments(ids, docs);
+    EXPECT_TRUE(status.ok());
+
+    // Documents come back in request order, missing ids are skipped
+    ASSERT_EQ(docs.size(), 3);
+    EXPECT_EQ(docs[0].id(), "prod003");
+    EXPECT_EQ(docs[0].data()["name"], "Programming in C++");
+    EXPECT_EQ(docs[1].id(), "prod001");
+    EXPECT_EQ(docs[1].data()["name"], "Laptop");
+    EXPECT_EQ(docs[2].id(), "prod014");
+}
+
 TEST_F(AnuDBTest, DocumentUpdate) {
     // Update top-level fields
     json updateData = {
@@ -545,6 +600,140 @@ TEST_F(AnuDBTest, DocumentDelete) {
     EXPECT_FALSE(status.ok());
 }
 
+TEST_F(AnuDBTest, DocumentInsertManyDeleteMany) {
+    Status status = products->createIndex("category");
+    EXPECT_TRUE(status.ok());
+
+    std::vector<Document> docs;
+    for (int i = 0; i < 25; i++) {
+        json data = {
+            {"name", "Sensor " + std::to_string(i)},
+            {"category", "Sensors"},
+            {"stock", i}
+        };
+        docs.push_back(Document("bulk" + std::to_string(i), data));
+    }
+
+    // Small batch size so that several groups are committed
+    std::vector<Status> statuses;
+    status = products->insertMany(docs, statuses, 10);
+    EXPECT_TRUE(status.ok());
+    ASSERT_EQ(statuses.size(), docs.size());
+    for (const Status& s : statuses) {
+        EXPECT_TRUE(s.ok());
+    }
+
+    Document doc;
+    status = products->readDocument("bulk24", doc);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(doc.data()["stock"], 24);
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"category", "Sensors"}}} }).size(), 25);
+
+    // Unknown ids are reported per document without failing the rest
+    std::vector<std::string> ids = { "bulk0", "bulk1", "missing_id", "bulk2" };
+    status = products->deleteMany(ids, statuses, 2);
+    EXPECT_TRUE(status.ok());
+    ASSERT_EQ(statuses.size(), ids.size());
+    EXPECT_TRUE(statuses[0].ok());
+    EXPECT_TRUE(statuses[1].ok());
+    EXPECT_TRUE(statuses[2].isNotFound());
+    EXPECT_TRUE(statuses[3].ok());
+
+    status = products->readDocument("bulk1", doc);
+    EXPECT_TRUE(status.isNotFound());
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"category", "Sensors"}}} }).size(), 22);
+}
+
+TEST_F(AnuDBTest, DocumentOverwriteIndexEntries) {
+    ASSERT_TRUE(products->createIndex("age").ok());
+    ASSERT_TRUE(products->createIndex("tags", { {"multikey", true} }).ok());
+
+    // Creating a document under an existing id replaces the index entries of the old one
+    Document first("person1", { {"age", 5}, {"tags", {"a", "b"}} });
+    ASSERT_TRUE(products->createDocument(first).ok());
+    Document second("person1", { {"age", 7}, {"tags", {"b", "c"}} });
+    ASSERT_TRUE(products->createDocument(second).ok());
+    EXPECT_TRUE(products->findDocument({ {"$eq", {{"age", 5}}} }).empty());
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"age", 7}}} }), std::vector<std::string>({ "person1" }));
+    EXPECT_TRUE(products->findDocument({ {"$eq", {{"tags", "a"}}} }).empty());
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"tags", "c"}}} }), std::vector<std::string>({ "person1" }));
+
+    // Without the field the document leaves the index
+    Document third("person1", { {"name", "no age"} });
+    ASSERT_TRUE(products->createDocument(third).ok());
+    EXPECT_TRUE(products->findDocument({ {"$eq", {{"age", 7}}} }).empty());
+
+    // Within one insertMany group a later document overwrites an earlier one with the same id
+    std::vector<Document> docs = {
+        Document("person2", { {"age", 20} }),
+        Document("person1", { {"age", 30} }),
+        Document("person2", { {"age", 21} })
+    };
+    std::vector<Status> statuses;
+    ASSERT_TRUE(products->insertMany(docs, statuses).ok());
+    EXPECT_TRUE(products->findDocument({ {"$eq", {{"age", 20}}} }).empty());
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"age", 21}}} }), std::vector<std::string>({ "person2" }));
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"age", 30}}} }), std::vector<std::string>({ "person1" }));
+}
+
+TEST_F(AnuDBTest, ConcurrentWritesKeepIndexEntries) {
+    ASSERT_TRUE(db->createCollection("people").ok());
+    Collection* people = db->getCollection("people");
+    ASSERT_TRUE(people->createIndex("age").ok());
+    std::vector<Document> docs;
+    for (int i = 0; i < 2000; i++) {
+        docs.emplace_back("p" + std::to_string(i), json{ {"age", i % 10}, {"level", i % 5} });
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(people->insertMany(docs, statuses).ok());
+
+    // Creates, updates and deletes of the same ids race each other and the backfill of a new index
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++) {
+        writers.emplace_back([people, t]() {
+            for (int i = 0; i < 1000; i++) {
+                std::string id = "p" + std::to_string((i + t) % 4);
+                if (t == 0) {
+                    Document doc(id, { {"age", i % 10}, {"level", i % 5} });
+                    people->createDocument(doc);
+                }
+                else if (t == 1) {
+                    people->updateDocument(id, { {"$set", {{"age", 10 + i % 3}, {"level", 5 + i % 2}}} });
+                }
+                else if (t == 2) {
+                    people->deleteDocument(id);
+                }
+                else {
+                    std::vector<Status> deleted;
+                    people->deleteMany({ id }, deleted);
+                }
+            }
+        });
+    }
+    ASSERT_TRUE(people->createIndex("level").ok());
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+
+    // Every index entry belongs to the current version of its document
+    std::vector<Document> stored;
+    ASSERT_TRUE(people->readAllDocuments(stored, 10000).ok());
+    for (const std::string field : { "age", "level" }) {
+        for (int value = 0; value < 13; value++) {
+            std::vector<std::string> expected;
+            for (const Document& doc : stored) {
+                if (doc.data()[field] == value) {
+                    expected.push_back(doc.id());
+                }
+            }
+            std::vector<std::string> found = people->findDocument({ {"$eq", {{field, value}}} });
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            EXPECT_EQ(found, expected) << field << " " << value;
+        }
+    }
+}
+
 // Query Tests
 TEST_F(AnuDBTest, QueryEqualityOperator) {
     // Create index for faster queries
@@ -618,6 +807,101 @@ TEST_F(AnuDBTest, QueryLessThanOperator) {
     }
 }
 
+TEST_F(AnuDBTest, QueryInclusiveRangeOperators) {
+    Status status = products->createIndex("price");
+    EXPECT_TRUE(status.ok());
+
+    // Bounds equal to stored values are included
+    std::vector<std::string> docIds = products->findDocument({ {"$gte", {{"price", 129.99}}} });
+    EXPECT_EQ(docIds.size(), 7);
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "prod006") != docIds.end());
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "prod012") != docIds.end());
+
+    docIds = products->findDocument({ {"$lte", {{"price", 45.99}}} });
+    EXPECT_EQ(docIds.size(), 5);
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "prod014") != docIds.end());
+}
+
+TEST_F(AnuDBTest, QueryBetweenOperator) {
+    Status status = products->createIndex("price");
+    EXPECT_TRUE(status.ok());
+
+    // Array form, both ends inclusive
+    std::vector<std::string> docIds = products->findDocument({ {"$between", {{"price", {38.50, 129.99}}}} });
+    EXPECT_EQ(docIds.size(), 7);
+    std::vector<std::string> expectedIds = { "prod003", "prod006", "prod007", "prod008", "prod010", "prod012", "prod014" };
+    for (const auto& id : expectedIds) {
+        EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), id) != docIds.end());
+    }
+
+    // Object form with exclusive bounds
+    docIds = products->findDocument({ {"$between", {{"price", {{"$gt", 38.50}, {"$lt", 129.99}}}}} });
+    EXPECT_EQ(docIds.size(), 4);
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "prod010") == docIds.end());
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "prod006") == docIds.end());
+
+    // Open upper side
+    docIds = products->findDocument({ {"$between", {{"price", {{"$gte", 300.0}}}}} });
+    EXPECT_EQ(docIds.size(), 3);
+
+    // Empty range
+    docIds = products->findDocument({ {"$between", {{"price", {500.0, 100.0}}}} });
+    EXPECT_TRUE(docIds.empty());
+
+    // Range operators inside $and
+    docIds = products->findDocument({ {"$and", {
+        {{"$gte", {{"price", 129.99}}}},
+        {{"$lte", {{"price", 249.99}}}}
+    }} });
+    EXPECT_EQ(docIds.size(), 4);
+}
+
+TEST_F(AnuDBTest, QueryCursorSkipLimit) {
+    Status status = products->createIndex("price");
+    EXPECT_TRUE(status.ok());
+
+    json query = { {"$orderBy", {{"price", "asc"}}} };
+    std::vector<std::string> allIds = products->findDocument(query);
+    ASSERT_EQ(allIds.size(), 14);
+
+    // The cursor returns the same ids as findDocument, paged
+    QueryOptions options;
+    options.skip = 2;
+    options.limit = 3;
+    std::unique_ptr<QueryCursor> cursor;
+    status = products->find(query, cursor, options);
+    ASSERT_TRUE(status.ok()) << status.message();
+    std::vector<std::string> pageIds;
+    for (; cursor->isValid(); cursor->next()) {
+        Document doc;
+        ASSERT_TRUE(cursor->current(&doc).ok());
+        EXPECT_EQ(doc.id(), cursor->currentId());
+        pageIds.push_back(doc.id());
+    }
+    EXPECT_TRUE(cursor->status().ok());
+    ASSERT_EQ(pageIds.size(), 3);
+    EXPECT_TRUE(std::equal(pageIds.begin(), pageIds.end(), allIds.begin() + 2));
+
+    // Range query without limit streams every match
+    status = products->find({ {"$gt", {{"price", 100.0}}} }, cursor);
+    ASSERT_TRUE(status.ok());
+    size_t count = 0;
+    for (; cursor->isValid(); cursor->next()) {
+        count++;
+    }
+    EXPECT_EQ(count, 7);
+
+    // Skipping past the end leaves an empty cursor
+    options.skip = 100;
+    status = products->find(query, cursor, options);
+    ASSERT_TRUE(status.ok());
+    EXPECT_FALSE(cursor->isValid());
+
+    // Errors are reported up front
+    status = products->find({ {"$near", {{"price", 1}}} }, cursor);
+    EXPECT_FALSE(status.ok());
+}
+
 TEST_F(AnuDBTest, QueryOrderByOperator) {
     // Create index for faster queries
     Status status = products->createIndex("price");
@@ -722,6 +1006,934 @@ TEST_F(AnuDBTest, QueryAndOperatorRangeScan) {
     }
 }
 
+TEST_F(AnuDBTest, QueryAndPlannerChoosesSelectiveIndex) {
+    Status status = db->createCollection("planner");
+    ASSERT_TRUE(status.ok());
+    Collection* items = db->getCollection("planner");
+    ASSERT_TRUE(items->createIndex("category").ok());
+    ASSERT_TRUE(items->createIndex("price").ok());
+
+    const std::vector<std::string> categories = { "Electronics", "Books", "Food", "Clothing" };
+    std::vector<Document> docs;
+    for (int i = 0; i < 2000; i++) {
+        json data = { {"category", categories[i % 4]}, {"price", i} };
+        docs.emplace_back("item" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    items->insertMany(docs, statuses);
+
+    // Reopening replays the WAL into SST files, so the estimates below do not depend on
+    // whether a background flush has run yet
+    ASSERT_TRUE(db->close().ok());
+    ASSERT_TRUE(db->open().ok());
+    items = db->getCollection("planner");
+    ASSERT_NE(items, nullptr);
+
+    // A narrow price range is far more selective than a category holding a quarter of the items
+    json query = { {"$and", {
+        {{"$eq", {{"category", "Books"}}}},
+        {{"$between", {{"price", {1000, 1019}}}}}
+    }} };
+    json plan;
+    status = items->explain(query, plan);
+    ASSERT_TRUE(status.ok()) << status.message();
+    ASSERT_EQ(plan.size(), 1);
+    EXPECT_EQ(plan[0]["driver"]["field"], "price");
+    EXPECT_EQ(plan[0]["probe"].size() + plan[0]["fetch"].size(), 1);
+
+    // Results follow the price index of the driving condition
+    std::vector<std::string> docIds = items->findDocument(query);
+    std::vector<std::string> expectedIds = { "item1001", "item1005", "item1009", "item1013", "item1017" };
+    EXPECT_EQ(docIds, expectedIds);
+
+    // Conditions on the same field are merged into a single range
+    status = items->explain({ {"$and", {
+        {{"$gte", {{"price", 10}}}},
+        {{"$lt", {{"price", 20}}}}
+    }} }, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["driver"]["field"], "price");
+    EXPECT_TRUE(plan[0]["probe"].empty());
+    EXPECT_TRUE(plan[0]["fetch"].empty());
+
+    // Crossed ranges match nothing
+    docIds = items->findDocument({ {"$and", {
+        {{"$gt", {{"price", 100}}}},
+        {{"$lt", {{"price", 50}}}}
+    }} });
+    EXPECT_TRUE(docIds.empty());
+
+    // Overlapping $or clauses return each document once
+    docIds = items->findDocument({ {"$or", {
+        {{"$between", {{"price", {10, 19}}}}},
+        {{"$between", {{"price", {15, 24}}}}}
+    }} });
+    EXPECT_EQ(docIds.size(), 15);
+
+    db->dropCollection("planner");
+}
+
+TEST_F(AnuDBTest, QueryBooleanOperatorsOrderedByDocId) {
+    Status status = db->createCollection("postings");
+    ASSERT_TRUE(status.ok());
+    Collection* items = db->getCollection("postings");
+    ASSERT_TRUE(items->createIndex("shape").ok());
+    ASSERT_TRUE(items->createIndex("color").ok());
+    ASSERT_TRUE(items->createIndex("size").ok());
+
+    const std::vector<std::string> shapes = { "circle", "square", "triangle", "star" };
+    const std::vector<std::string> colors = { "red", "green", "blue" };
+    std::vector<Document> docs;
+    for (int i = 0; i < 600; i++) {
+        json data = { {"shape", shapes[i % 4]}, {"color", colors[i % 3]}, {"size", i} };
+        docs.emplace_back("item" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    items->insertMany(docs, statuses);
+
+    std::vector<std::string> expectedAnd;
+    std::vector<std::string> expectedOr;
+    for (int i = 0; i < 600; i++) {
+        if (i % 4 == 1 && i % 3 == 2) {
+            expectedAnd.push_back("item" + std::to_string(i));
+        }
+        if (i % 4 == 1 || i % 3 == 2 || i < 10) {
+            expectedOr.push_back("item" + std::to_string(i));
+        }
+    }
+    std::sort(expectedAnd.begin(), expectedAnd.end());
+    std::sort(expectedOr.begin(), expectedOr.end());
+
+    // Two equality posting lists intersected on the index
+    std::vector<std::string> docIds = items->findDocument({ {"$and", {
+        {{"$eq", {{"shape", "square"}}}},
+        {{"$eq", {{"color", "blue"}}}}
+    }} });
+    EXPECT_EQ(docIds, expectedAnd);
+
+    // Union of equality and range clauses, duplicates removed, ordered by doc id
+    docIds = items->findDocument({ {"$or", {
+        {{"$eq", {{"shape", "square"}}}},
+        {{"$eq", {{"color", "blue"}}}},
+        {{"$lt", {{"size", 10}}}}
+    }} });
+    EXPECT_EQ(docIds, expectedOr);
+
+    // Fixture results come back in doc id order as well
+    products->createIndex("category");
+    docIds = products->findDocument({ {"$or", {
+        {{"$eq", {{"category", "Food"}}}},
+        {{"$eq", {{"category", "Books"}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod003", "prod004" }));
+
+    db->dropCollection("postings");
+}
+
+TEST_F(AnuDBTest, CompoundIndex) {
+    Status status = db->createCollection("readings");
+    ASSERT_TRUE(status.ok());
+    Collection* readings = db->getCollection("readings");
+
+    std::vector<Document> docs;
+    for (int i = 0; i < 1000; i++) {
+        json data = { {"device", "dev" + std::to_string(i % 10)}, {"ts", i} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    readings->insertMany(docs, statuses);
+
+    EXPECT_FALSE(readings->createIndex({ "device", "" }).ok());
+    ASSERT_TRUE(readings->createIndex({ "device", "ts" }).ok());
+    std::vector<std::string> indexList;
+    readings->getIndex(indexList);
+    EXPECT_TRUE(std::find(indexList.begin(), indexList.end(), "device,ts") != indexList.end());
+
+    // Equality on the device and a range on ts are answered by one scan of the compound index
+    json query = { {"$and", {
+        {{"$eq", {{"device", "dev3"}}}},
+        {{"$gt", {{"ts", 900}}}}
+    }} };
+    json plan;
+    status = readings->explain(query, plan);
+    ASSERT_TRUE(status.ok()) << status.message();
+    EXPECT_EQ(plan[0]["driver"]["index"], "device,ts");
+    EXPECT_TRUE(plan[0]["probe"].empty());
+    EXPECT_TRUE(plan[0]["fetch"].empty());
+
+    std::vector<std::string> docIds = readings->findDocument(query);
+    std::vector<std::string> expectedIds;
+    for (int i = 903; i < 1000; i += 10) {
+        expectedIds.push_back("r" + std::to_string(i));
+    }
+    EXPECT_EQ(docIds, expectedIds);
+
+    // Both fields fixed
+    docIds = readings->findDocument({ {"$and", {
+        {{"$eq", {{"device", "dev7"}}}},
+        {{"$eq", {{"ts", 17}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "r17" }));
+
+    // The index lacks documents without ts, a condition on the first field alone does not use it
+    Document untimed("untimed", { {"device", "dev5"} });
+    ASSERT_TRUE(readings->createDocument(untimed).ok());
+    status = readings->explain({ {"$eq", {{"device", "dev5"}}} }, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["scan"], "collection");
+    docIds = readings->findDocument({ {"$eq", {{"device", "dev5"}}} });
+    EXPECT_EQ(docIds.size(), 101);
+    EXPECT_TRUE(std::find(docIds.begin(), docIds.end(), "untimed") != docIds.end());
+    EXPECT_EQ(readings->findDocument({ {"$and", {
+        {{"$eq", {{"device", "dev5"}}}},
+        {{"$lt", {{"ts", 10}}}}
+    }} }), std::vector<std::string>({ "r5" }));
+    QueryOptions byDevice;
+    byDevice.sortField = "device";
+    std::unique_ptr<QueryCursor> sorted;
+    ASSERT_TRUE(readings->find({ {"$eq", {{"device", "dev5"}}} }, sorted, byDevice).ok());
+    size_t count = 0;
+    for (; sorted->isValid(); sorted->next()) {
+        count++;
+    }
+    EXPECT_EQ(count, 101u);
+    ASSERT_TRUE(readings->deleteDocument("untimed").ok());
+
+    // The second field needs its own index
+    status = readings->explain({ {"$eq", {{"ts", 5}}} }, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["scan"], "collection");
+
+    // Entries follow updates and deletes
+    ASSERT_TRUE(readings->updateDocument("r17", { {"$set", {{"ts", 5000}}} }).ok());
+    EXPECT_TRUE(readings->findDocument({ {"$and", {
+        {{"$eq", {{"device", "dev7"}}}},
+        {{"$eq", {{"ts", 17}}}}
+    }} }).empty());
+    docIds = readings->findDocument({ {"$and", {
+        {{"$eq", {{"device", "dev7"}}}},
+        {{"$gte", {{"ts", 1000}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "r17" }));
+    ASSERT_TRUE(readings->deleteDocument("r17").ok());
+    EXPECT_EQ(readings->findDocument({ {"$eq", {{"device", "dev7"}}} }).size(), 99);
+
+    db->dropCollection("readings");
+}
+
+TEST_F(AnuDBTest, CoveredQueryProjection) {
+    Status status = products->createIndex("price", { {"include", {"name"}} });
+    ASSERT_TRUE(status.ok());
+
+    // name and price are both held by the price index entries
+    QueryOptions options;
+    options.projection = { "name", "price", "_id" };
+    std::unique_ptr<QueryCursor> cursor;
+    status = products->find({ {"$gt", {{"price", 300.0}}} }, cursor, options);
+    ASSERT_TRUE(status.ok()) << status.message();
+    std::map<std::string, json> results;
+    for (; cursor->isValid(); cursor->next()) {
+        Document doc;
+        ASSERT_TRUE(cursor->current(&doc).ok());
+        results[doc.id()] = doc.data();
+    }
+    ASSERT_EQ(results.size(), 3);
+    for (const auto& result : results) {
+        Document full;
+        ASSERT_TRUE(products->readDocument(result.first, full).ok());
+        EXPECT_EQ(result.second.size(), 3);
+        EXPECT_EQ(result.second["name"], full.data()["name"]);
+        EXPECT_EQ(result.second["price"], full.data()["price"]);
+        EXPECT_EQ(result.second["_id"], result.first);
+    }
+
+    // A field missing from the index is read from the document
+    options.projection = { "name", "category" };
+    status = products->find({ {"$eq", {{"price", 1299.99}}} }, cursor, options);
+    ASSERT_TRUE(status.ok());
+    ASSERT_TRUE(cursor->isValid());
+    Document doc;
+    ASSERT_TRUE(cursor->current(&doc).ok());
+    EXPECT_EQ(doc.id(), "prod001");
+    EXPECT_EQ(doc.data().size(), 2);
+    EXPECT_EQ(doc.data()["category"], "Electronics");
+
+    // Included fields follow updates
+    ASSERT_TRUE(products->updateDocument("prod001", { {"$set", {{"name", "Laptop Pro"}}} }).ok());
+    options.projection = { "name" };
+    status = products->find({ {"$eq", {{"price", 1299.99}}} }, cursor, options);
+    ASSERT_TRUE(status.ok());
+    ASSERT_TRUE(cursor->isValid());
+    ASSERT_TRUE(cursor->current(&doc).ok());
+    EXPECT_EQ(doc.data()["name"], "Laptop Pro");
+}
+
+TEST_F(AnuDBTest, QueryUnindexedFields) {
+    // No index exists, the documents are scanned and filtered on their stored bytes
+    std::vector<std::string> docIds = products->findDocument({ {"$eq", {{"category", "Books"}}} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod003" }));
+    docIds = products->findDocument({ {"$gt", {{"price", 1000.0}}} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod001" }));
+
+    // Same results as decoding every document and filtering it
+    std::vector<Document> allDocs;
+    ASSERT_TRUE(products->readAllDocuments(allDocs, 100).ok());
+    std::vector<std::string> expectedIds;
+    for (const Document& doc : allDocs) {
+        if (doc.data().contains("stock") && doc.data()["stock"].get<int>() < 100) {
+            expectedIds.push_back(doc.id());
+        }
+    }
+    std::sort(expectedIds.begin(), expectedIds.end());
+    docIds = products->findDocument({ {"$lt", {{"stock", 100}}} });
+    EXPECT_EQ(docIds, expectedIds);
+
+    json plan;
+    Status status = products->explain({ {"$eq", {{"available", true}}} }, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["scan"], "collection");
+
+    // An indexed condition drives the scan, the unindexed one is checked on the candidates
+    ASSERT_TRUE(products->createIndex("price").ok());
+    json query = { {"$and", {
+        {{"$eq", {{"category", "Electronics"}}}},
+        {{"$gt", {{"price", 500.0}}}}
+    }} };
+    status = products->explain(query, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["driver"]["field"], "price");
+    ASSERT_EQ(plan[0]["fetch"].size(), 1);
+    EXPECT_EQ(plan[0]["fetch"][0]["scan"], "collection");
+    docIds = products->findDocument(query);
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod001", "prod002" }));
+
+    // A single unindexed clause turns $or into one scan
+    docIds = products->findDocument({ {"$or", {
+        {{"$eq", {{"category", "Books"}}}},
+        {{"$gt", {{"price", 1000.0}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod001", "prod003" }));
+}
+
+TEST_F(AnuDBTest, QueryInOperator) {
+    ASSERT_TRUE(products->createIndex("category").ok());
+    // Duplicates and values without documents are ignored, ids come out by value then doc id
+    json query = { {"$in", {{"category", {"Food", "Electronics", "Books", "Food", "Gadgets"}}}} };
+    std::vector<std::string> docIds = products->findDocument(query);
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod003", "prod001", "prod002", "prod004" }));
+
+    json plan;
+    Status status = products->explain(query, plan);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(plan[0]["scan"], "seek");
+    EXPECT_EQ(plan[0]["values"], 4);
+
+    EXPECT_TRUE(products->findDocument({ {"$in", {{"category", json::array()}}} }).empty());
+    EXPECT_TRUE(products->findDocument({ {"$in", {{"category", "Books"}}} }).empty());
+
+    // The index entries answer a projection on the field
+    QueryOptions options;
+    options.projection = { "category" };
+    std::unique_ptr<QueryCursor> cursor;
+    ASSERT_TRUE(products->find(query, cursor, options).ok());
+    ASSERT_TRUE(cursor->isValid());
+    Document doc;
+    ASSERT_TRUE(cursor->current(&doc).ok());
+    EXPECT_EQ(doc.id(), "prod003");
+    EXPECT_EQ(doc.data(), json({ {"category", "Books"} }));
+
+    // Inside $and the matches are ordered by doc id
+    ASSERT_TRUE(products->createIndex("price").ok());
+    docIds = products->findDocument({ {"$and", {
+        {{"$in", {{"category", {"Food", "Electronics", "Books"}}}}},
+        {{"$gt", {{"price", 40.0}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod001", "prod002", "prod003" }));
+
+    // Other conditions on the field narrow the values
+    docIds = products->findDocument({ {"$and", {
+        {{"$in", {{"category", {"Food", "Books"}}}}},
+        {{"$gte", {{"category", "C"}}}}
+    }} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod004" }));
+    docIds = products->findDocument({ {"$and", {
+        {{"$in", {{"category", {"Food", "Books"}}}}},
+        {{"$in", {{"category", {"Toys", "Electronics"}}}}}
+    }} });
+    EXPECT_TRUE(docIds.empty());
+
+    // Without an index the values are checked on the stored documents
+    docIds = products->findDocument({ {"$in", {{"name", {"Organic Coffee", "Missing"}}}} });
+    EXPECT_EQ(docIds, std::vector<std::string>({ "prod004" }));
+}
+
+TEST_F(AnuDBTest, QuerySortedTopK) {
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    for (int i = 0; i < 200; i++) {
+        json data = { {"device", "d" + std::to_string(i % 4)}, {"ts", i}, {"value", i * 10} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+
+    auto readIds = [](std::unique_ptr<QueryCursor>& cursor) {
+        std::vector<std::string> ids;
+        for (; cursor->isValid(); cursor->next()) {
+            ids.push_back(cursor->currentId());
+        }
+        return ids;
+    };
+    const std::vector<std::string> latest = { "r197", "r193", "r189", "r185", "r181" };
+    json device = { {"$eq", {{"device", "d1"}}} };
+    QueryOptions options;
+    options.sortField = "ts";
+    options.sortDescending = true;
+    options.limit = 5;
+
+    // Without an index on ts the matches are ranked in a bounded heap
+    json plan;
+    ASSERT_TRUE(readings->explain(device, plan, options).ok());
+    EXPECT_EQ(plan[0]["scan"], "heap");
+    std::unique_ptr<QueryCursor> cursor;
+    ASSERT_TRUE(readings->find(device, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), latest);
+
+    // The ts index is walked from the end, the device is checked on each document
+    ASSERT_TRUE(readings->createIndex("ts").ok());
+    ASSERT_TRUE(readings->explain(device, plan, options).ok());
+    EXPECT_EQ(plan[0]["scan"], "index");
+    EXPECT_EQ(plan[0]["checks"], json::array({ "device" }));
+    ASSERT_TRUE(readings->find(device, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), latest);
+
+    // Either plan gives the same page once both fields are indexed
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    options.skip = 2;
+    options.limit = 3;
+    ASSERT_TRUE(readings->find(device, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), std::vector<std::string>({ "r189", "r185", "r181" }));
+
+    // A range on the sort field bounds the walk
+    options.skip = 0;
+    json before100 = { {"$and", {
+        {{"$eq", {{"device", "d1"}}}},
+        {{"$lt", {{"ts", 100}}}}
+    }} };
+    ASSERT_TRUE(readings->find(before100, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), std::vector<std::string>({ "r97", "r93", "r89" }));
+
+    // With a compound index the entries of the device are already ordered by ts
+    ASSERT_TRUE(readings->createIndex({ "device", "ts" }).ok());
+    options.limit = 5;
+    ASSERT_TRUE(readings->explain(device, plan, options).ok());
+    EXPECT_EQ(plan[0]["index"], "device,ts");
+    EXPECT_TRUE(plan[0]["checks"].empty());
+    EXPECT_EQ(plan[0]["estimate"], 5);
+    ASSERT_TRUE(readings->find(device, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), latest);
+
+    // $orderBy next to a condition orders its matches
+    std::vector<std::string> docIds = readings->findDocument({ {"$eq", {{"device", "d2"}}}, {"$orderBy", {{"ts", "asc"}}} });
+    ASSERT_EQ(docIds.size(), 50);
+    EXPECT_EQ(docIds[0], "r2");
+    EXPECT_EQ(docIds[1], "r6");
+    EXPECT_EQ(docIds[49], "r198");
+
+    // Alternatives are checked on the walk as well
+    options.limit = 4;
+    json either = { {"$or", {
+        {{"$eq", {{"device", "d0"}}}},
+        {{"$eq", {{"device", "d3"}}}}
+    }} };
+    ASSERT_TRUE(readings->find(either, cursor, options).ok());
+    EXPECT_EQ(readIds(cursor), std::vector<std::string>({ "r199", "r196", "r195", "r192" }));
+}
+
+TEST_F(AnuDBTest, AggregateCountSumMinMaxAvg) {
+    std::vector<Document> allDocs;
+    ASSERT_TRUE(products->readAllDocuments(allDocs, 100).ok());
+    int64_t stockSum = 0;
+    double priceSum = 0;
+    double minPrice = 0;
+    double maxPrice = 0;
+    size_t priced = 0;
+    for (const Document& doc : allDocs) {
+        if (doc.data().contains("stock")) {
+            stockSum += doc.data()["stock"].get<int64_t>();
+        }
+        if (doc.data().contains("price")) {
+            double price = doc.data()["price"].get<double>();
+            minPrice = priced == 0 ? price : std::min(minPrice, price);
+            maxPrice = priced == 0 ? price : std::max(maxPrice, price);
+            priceSum += price;
+            priced++;
+        }
+    }
+    json aggregates = {
+        {"n", {{"$count", json::object()}}},
+        {"stock", {{"$sum", "stock"}}},
+        {"low", {{"$min", "price"}}},
+        {"high", {{"$max", "price"}}},
+        {"mean", {{"$avg", "price"}}}
+    };
+
+    // Without indexes the fields are read from the stored documents
+    json result;
+    Status status = products->aggregate(json::object(), aggregates, result);
+    ASSERT_TRUE(status.ok()) << status.message();
+    EXPECT_EQ(result["n"], allDocs.size());
+    EXPECT_TRUE(result["stock"].is_number_integer());
+    EXPECT_EQ(result["stock"], stockSum);
+    EXPECT_DOUBLE_EQ(result["low"].get<double>(), minPrice);
+    EXPECT_DOUBLE_EQ(result["high"].get<double>(), maxPrice);
+    EXPECT_NEAR(result["mean"].get<double>(), priceSum / priced, 1e-9);
+
+    // Same answers once they come from the price index
+    ASSERT_TRUE(products->createIndex("price").ok());
+    json fromIndex;
+    ASSERT_TRUE(products->aggregate(json::object(), aggregates, fromIndex).ok());
+    EXPECT_EQ(fromIndex["n"], result["n"]);
+    EXPECT_EQ(fromIndex["stock"], result["stock"]);
+    EXPECT_DOUBLE_EQ(fromIndex["low"].get<double>(), minPrice);
+    EXPECT_DOUBLE_EQ(fromIndex["high"].get<double>(), maxPrice);
+    EXPECT_NEAR(fromIndex["mean"].get<double>(), priceSum / priced, 1e-9);
+
+    // Filtered aggregates agree with the matches of the filter
+    json filter = { {"$gt", {{"price", 100.0}}} };
+    std::vector<std::string> ids = products->findDocument(filter);
+    std::vector<Document> matches;
+    ASSERT_TRUE(products->readDocuments(ids, matches).ok());
+    double matchedSum = 0;
+    double matchedMin = matches.empty() ? 0 : matches[0].data()["price"].get<double>();
+    for (const Document& doc : matches) {
+        matchedSum += doc.data()["price"].get<double>();
+        matchedMin = std::min(matchedMin, doc.data()["price"].get<double>());
+    }
+    ASSERT_TRUE(products->aggregate(filter, {
+        {"n", {{"$count", json::object()}}},
+        {"total", {{"$sum", "price"}}},
+        {"low", {{"$min", "price"}}}
+    }, result).ok());
+    EXPECT_EQ(result["n"], ids.size());
+    EXPECT_NEAR(result["total"].get<double>(), matchedSum, 1e-9);
+    EXPECT_DOUBLE_EQ(result["low"].get<double>(), matchedMin);
+
+    ASSERT_TRUE(products->aggregate({ {"$eq", {{"category", "Electronics"}}} }, aggregates, result).ok());
+    EXPECT_EQ(result["n"], 2);
+
+    // Nothing matches
+    ASSERT_TRUE(products->aggregate({ {"$gt", {{"price", 1000000.0}}} }, aggregates, result).ok());
+    EXPECT_EQ(result["n"], 0);
+    EXPECT_EQ(result["stock"], 0);
+    EXPECT_TRUE(result["low"].is_null());
+    EXPECT_TRUE(result["mean"].is_null());
+
+    EXPECT_FALSE(products->aggregate(json::object(), { {"x", {{"$median", "price"}}} }, result).ok());
+    EXPECT_FALSE(products->aggregate(json::object(), { {"x", {{"$sum", 1}}} }, result).ok());
+
+    // Integer sums leaving the int64 range, and unsigned values above it, are summed as doubles
+    ASSERT_TRUE(db->createCollection("counters").ok());
+    Collection* counters = db->getCollection("counters");
+    Document first("c1", { {"hits", INT64_MAX}, {"bytes", UINT64_MAX} });
+    Document second("c2", { {"hits", 1}, {"bytes", 1} });
+    ASSERT_TRUE(counters->createDocument(first).ok());
+    ASSERT_TRUE(counters->createDocument(second).ok());
+    json totals = { {"hits", {{"$sum", "hits"}}}, {"bytes", {{"$sum", "bytes"}}}, {"mean", {{"$avg", "hits"}}} };
+    ASSERT_TRUE(counters->aggregate(json::object(), totals, result).ok());
+    EXPECT_TRUE(result["hits"].is_number_float());
+    EXPECT_DOUBLE_EQ(result["hits"].get<double>(), 9223372036854775808.0);
+    EXPECT_TRUE(result["bytes"].is_number_float());
+    EXPECT_DOUBLE_EQ(result["bytes"].get<double>(), 18446744073709551616.0);
+    EXPECT_DOUBLE_EQ(result["mean"].get<double>(), 4611686018427387904.0);
+    // Back in range the sums are exact integers again
+    Document replaced("c1", { {"hits", INT64_MAX - 1}, {"bytes", 2} });
+    ASSERT_TRUE(counters->createDocument(replaced).ok());
+    ASSERT_TRUE(counters->aggregate(json::object(), totals, result).ok());
+    EXPECT_EQ(result["hits"], INT64_MAX);
+    EXPECT_EQ(result["bytes"], 3);
+    db->dropCollection("counters");
+}
+
+TEST_F(AnuDBTest, GroupByField) {
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    for (int i = 0; i < 200; i++) {
+        json data = { {"device", "d" + std::to_string(i % 7)}, {"ts", i}, {"value", i % 50} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    docs.emplace_back("nodevice", json({ {"ts", 500}, {"value", 1} }));
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+
+    // Expected groups computed from the documents, ordered by device
+    std::map<std::string, json> expected;
+    for (int i = 0; i < 200; i++) {
+        if (i < 20) {
+            continue;
+        }
+        json& group = expected["d" + std::to_string(i % 7)];
+        if (group.is_null()) {
+            group = { {"_id", "d" + std::to_string(i % 7)}, {"n", 0}, {"total", 0}, {"first", i} };
+        }
+        group["n"] = group["n"].get<int>() + 1;
+        group["total"] = group["total"].get<int>() + i % 50;
+    }
+    json expectedGroups = json::array();
+    for (auto& entry : expected) {
+        entry.second["mean"] = entry.second["total"].get<double>() / entry.second["n"].get<int>();
+        expectedGroups.push_back(entry.second);
+    }
+    json filter = { {"$gte", {{"ts", 20}}} };
+    json aggregates = {
+        {"n", {{"$count", json::object()}}},
+        {"total", {{"$sum", "value"}}},
+        {"first", {{"$min", "ts"}}},
+        {"mean", {{"$avg", "value"}}}
+    };
+
+    // In a hash table, device is not indexed
+    json groups;
+    Status status = readings->group(filter, "device", aggregates, groups);
+    ASSERT_TRUE(status.ok()) << status.message();
+    EXPECT_EQ(groups, expectedGroups);
+
+    // A budget of a few bytes writes a sorted run per group, the runs are merged back
+    json spilled;
+    ASSERT_TRUE(readings->group(filter, "device", aggregates, spilled, 1).ok());
+    EXPECT_EQ(spilled, expectedGroups);
+
+    // Walking the device index, a group ends when the walk reaches the next device
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    QueryOptions byDevice;
+    byDevice.sortField = "device";
+    json plan;
+    ASSERT_TRUE(readings->explain(filter, plan, byDevice).ok());
+    EXPECT_EQ(plan[0]["scan"], "index");
+    json walked;
+    ASSERT_TRUE(readings->group(filter, "device", aggregates, walked).ok());
+    EXPECT_EQ(walked, expectedGroups);
+
+    // Without a filter every document with the field is counted
+    ASSERT_TRUE(readings->group(json::object(), "device", { {"n", {{"$count", json::object()}}} }, groups).ok());
+    ASSERT_EQ(groups.size(), 7);
+    EXPECT_EQ(groups[0], json({ {"_id", "d0"}, {"n", 29} }));
+
+    // Grouped on a numeric field the groups follow the index order of the values
+    ASSERT_TRUE(readings->group({ {"$lt", {{"ts", 100}}} }, "value", { {"n", {{"$count", json::object()}}} }, groups).ok());
+    ASSERT_EQ(groups.size(), 50);
+    EXPECT_EQ(groups[0], json({ {"_id", 0}, {"n", 2} }));
+    EXPECT_EQ(groups[49], json({ {"_id", 49}, {"n", 2} }));
+
+    // Arrays and objects are in no group, with or without an index on the field
+    std::vector<Document> models = {
+        Document("m1", { {"model", "a"} }),
+        Document("m2", { {"model", "a"} }),
+        Document("m3", { {"model", {{"name", "a"}}} }),
+        Document("m4", { {"model", {"a", "b"}} }),
+        Document("m5", { {"model", "b"} })
+    };
+    ASSERT_TRUE(readings->insertMany(models, statuses).ok());
+    json hashed;
+    ASSERT_TRUE(readings->group(json::object(), "model", { {"n", {{"$count", json::object()}}} }, hashed).ok());
+    EXPECT_EQ(hashed, json::parse("[{\"_id\": \"a\", \"n\": 2}, {\"_id\": \"b\", \"n\": 1}]"));
+    ASSERT_TRUE(readings->createIndex("model").ok());
+    ASSERT_TRUE(readings->group(json::object(), "model", { {"n", {{"$count", json::object()}}} }, walked).ok());
+    EXPECT_EQ(walked, hashed);
+
+    // Values of different types that encode alike are separate groups, ordered by value then type
+    std::vector<Document> flags = {
+        Document("f1", { {"flag", "true"} }),
+        Document("f2", { {"flag", true} }),
+        Document("f3", { {"flag", "true"} }),
+        Document("f4", { {"flag", nullptr} }),
+        Document("f5", { {"flag", ""} }),
+        Document("f6", { {"flag", ""} })
+    };
+    ASSERT_TRUE(readings->insertMany(flags, statuses).ok());
+    json expectedFlags = json::parse("[{\"_id\": null, \"n\": 1}, {\"_id\": \"\", \"n\": 2},"
+        " {\"_id\": true, \"n\": 1}, {\"_id\": \"true\", \"n\": 2}]");
+    ASSERT_TRUE(readings->group(json::object(), "flag", { {"n", {{"$count", json::object()}}} }, hashed).ok());
+    EXPECT_EQ(hashed, expectedFlags);
+    ASSERT_TRUE(readings->group(json::object(), "flag", { {"n", {{"$count", json::object()}}} }, spilled, 1).ok());
+    EXPECT_EQ(spilled, expectedFlags);
+    ASSERT_TRUE(readings->createIndex("flag").ok());
+    ASSERT_TRUE(readings->group(json::object(), "flag", { {"n", {{"$count", json::object()}}} }, walked).ok());
+    EXPECT_EQ(walked, expectedFlags);
+
+    EXPECT_FALSE(readings->group(filter, "device", { {"x", {{"$median", "value"}}} }, groups).ok());
+}
+
+TEST_F(AnuDBTest, QueryCacheInvalidation) {
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    for (int i = 0; i < 20; i++) {
+        json data = { {"device", "d" + std::to_string(i % 2)}, {"ts", i}, {"note", "n"} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    readings->setQueryCacheCapacity(8);
+
+    json device = { {"$eq", {{"device", "d1"}}} };
+    json recent = { {"$gte", {{"ts", 15}}} };
+    std::vector<std::string> expected = readings->findDocument(device);
+    EXPECT_EQ(expected.size(), 10);
+    EXPECT_EQ(readings->findDocument(device), expected);
+    // Same filter written with its operators in another order
+    json ordered = json::parse("{\"$eq\": {\"device\": \"d0\"}, \"$lt\": {\"ts\": 4}}");
+    json reordered = json::parse("{\"$lt\": {\"ts\": 4}, \"$eq\": {\"device\": \"d0\"}}");
+    std::vector<std::string> both = readings->findDocument(ordered);
+    EXPECT_FALSE(both.empty());
+    EXPECT_EQ(readings->findDocument(reordered), both);
+    EXPECT_EQ(readings->findDocument(recent).size(), 5);
+    QueryCacheStats stats = readings->queryCacheStats();
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.misses, 3);
+    EXPECT_EQ(stats.entries, 3);
+
+    // A change of a field no cached filter reads keeps the entries
+    ASSERT_TRUE(readings->updateDocument("r1", { {"$set", {{"note", "changed"}}} }).ok());
+    EXPECT_EQ(readings->queryCacheStats().entries, 3);
+
+    // A changed device drops the filters on device, the ts filter stays cached
+    ASSERT_TRUE(readings->updateDocument("r1", { {"$set", {{"device", "d0"}}} }).ok());
+    stats = readings->queryCacheStats();
+    EXPECT_EQ(stats.entries, 1);
+    EXPECT_EQ(stats.invalidations, 2);
+    EXPECT_EQ(readings->findDocument(device).size(), 9);
+    EXPECT_EQ(readings->findDocument(recent).size(), 5);
+    EXPECT_EQ(readings->queryCacheStats().hits, 3);
+
+    // Created and deleted documents drop the filters on their fields
+    Document created("r100", { {"device", "d1"}, {"ts", 100} });
+    ASSERT_TRUE(readings->createDocument(created).ok());
+    EXPECT_EQ(readings->findDocument(device).size(), 10);
+    EXPECT_EQ(readings->findDocument(recent).size(), 6);
+    ASSERT_TRUE(readings->deleteDocument("r19").ok());
+    EXPECT_EQ(readings->findDocument(device).size(), 9);
+    EXPECT_EQ(readings->findDocument(recent).size(), 5);
+    std::vector<Status> deleted;
+    ASSERT_TRUE(readings->deleteMany({ "r17" }, deleted).ok());
+    EXPECT_EQ(readings->findDocument(recent).size(), 4);
+
+    // Overwriting a document without a field drops the filters on that field
+    json noted = { {"$eq", {{"note", "n"}}} };
+    size_t notes = readings->findDocument(noted).size();
+    EXPECT_EQ(readings->findDocument(noted).size(), notes);
+    Document overwritten("r2", { {"device", "d0"}, {"ts", 2} });
+    ASSERT_TRUE(readings->createDocument(overwritten).ok());
+    EXPECT_EQ(readings->findDocument(noted).size(), notes - 1);
+    std::vector<Document> overwrites = { Document("r3", { {"device", "d1"}, {"ts", 3} }) };
+    ASSERT_TRUE(readings->insertMany(overwrites, statuses).ok());
+    EXPECT_EQ(readings->findDocument(noted).size(), notes - 2);
+
+    // Least recently used filters are evicted past the capacity, 0 turns the cache off
+    readings->setQueryCacheCapacity(1);
+    EXPECT_EQ(readings->queryCacheStats().entries, 1);
+    readings->setQueryCacheCapacity(0);
+    EXPECT_EQ(readings->queryCacheStats().entries, 0);
+    uint64_t hits = readings->queryCacheStats().hits;
+    readings->findDocument(device);
+    readings->findDocument(device);
+    EXPECT_EQ(readings->queryCacheStats().hits, hits);
+}
+
+TEST_F(AnuDBTest, PreparedQueryBinding) {
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    for (int i = 0; i < 100; i++) {
+        json data = { {"device", "d" + std::to_string(i % 4)}, {"ts", i}, {"value", i % 10} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    ASSERT_TRUE(readings->createIndex("ts").ok());
+
+    // A parameter and a constant bound in the same $and, value is not indexed and checked on the documents
+    std::unique_ptr<PreparedQuery> query;
+    json filter = { {"$and", {
+        {{"$eq", {{"device", {{"$param", "device"}}}}}},
+        {{"$gte", {{"ts", 50}}}},
+        {{"$lt", {{"value", {{"$param", "value"}}}}}}
+    }} };
+    ASSERT_TRUE(readings->prepare(filter, query).ok());
+    EXPECT_EQ(query->parameters(), std::vector<std::string>({ "device", "value" }));
+    std::vector<std::string> ids;
+    EXPECT_FALSE(query->findDocument(ids).ok());
+    for (int device = 0; device < 4; device++) {
+        for (int value = 0; value < 10; value += 3) {
+            ASSERT_TRUE(query->bind("device", "d" + std::to_string(device)).ok());
+            ASSERT_TRUE(query->bind("value", value).ok());
+            ASSERT_TRUE(query->findDocument(ids).ok());
+            json bound = { {"$and", {
+                {{"$eq", {{"device", "d" + std::to_string(device)}}}},
+                {{"$gte", {{"ts", 50}}}},
+                {{"$lt", {{"value", value}}}}
+            }} };
+            EXPECT_EQ(ids, readings->findDocument(bound));
+        }
+    }
+    EXPECT_FALSE(query->bind("missing", 1).ok());
+
+    // $in list and $or clauses, the cursor applies the paging and projection of find
+    ASSERT_TRUE(readings->prepare({ {"$in", {{"ts", {{"$param", "list"}}}}} }, query).ok());
+    ASSERT_TRUE(query->bind("list", { 7, 3, 90 }).ok());
+    ASSERT_TRUE(query->findDocument(ids).ok());
+    EXPECT_EQ(ids, std::vector<std::string>({ "r3", "r7", "r90" }));
+    ASSERT_TRUE(readings->prepare({ {"$or", {
+        {{"$eq", {{"device", {{"$param", "device"}}}}}},
+        {{"$lt", {{"ts", {{"$param", "ts"}}}}}}
+    }} }, query).ok());
+    ASSERT_TRUE(query->bind("device", "d3").ok());
+    ASSERT_TRUE(query->bind("ts", 2).ok());
+    QueryOptions options;
+    options.limit = 3;
+    options.projection = { "ts" };
+    std::unique_ptr<QueryCursor> cursor;
+    ASSERT_TRUE(query->find(cursor, options).ok());
+    std::vector<json> found;
+    for (; cursor->isValid(); cursor->next()) {
+        Document doc;
+        ASSERT_TRUE(cursor->current(&doc).ok());
+        found.push_back(doc.data());
+    }
+    EXPECT_EQ(found, std::vector<json>({ {{"ts", 0}}, {{"ts", 1}}, {{"ts", 11}} }));
+
+    // Runs after an index is dropped or created again use the current indexes
+    std::vector<std::string> expected = readings->findDocument({ {"$or", {
+        {{"$eq", {{"device", "d3"}}}},
+        {{"$lt", {{"ts", 2}}}}
+    }} });
+    EXPECT_EQ(expected.size(), 27u);
+    ASSERT_TRUE(query->findDocument(ids).ok());
+    EXPECT_EQ(ids, expected);
+    ASSERT_TRUE(readings->deleteIndex("device").ok());
+    ASSERT_TRUE(query->findDocument(ids).ok());
+    EXPECT_EQ(ids, expected);
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    ASSERT_TRUE(query->findDocument(ids).ok());
+    EXPECT_EQ(ids, expected);
+
+    // Sorted queries are planned with the bound values in place
+    ASSERT_TRUE(readings->prepare({ {"$eq", {{"device", {{"$param", "device"}}}}}, {"$orderBy", {{"ts", "desc"}}} }, query).ok());
+    ASSERT_TRUE(query->bind("device", "d1").ok());
+    options = QueryOptions();
+    options.limit = 2;
+    ASSERT_TRUE(query->find(cursor, options).ok());
+    ASSERT_TRUE(cursor->isValid());
+    EXPECT_EQ(cursor->currentId(), "r97");
+
+    EXPECT_FALSE(readings->prepare({ {"$median", {{"ts", 1}}} }, query).ok());
+    EXPECT_EQ(query, nullptr);
+}
+
+TEST_F(AnuDBTest, ContinuationTokenPaging) {
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    for (int i = 0; i < 100; i++) {
+        json data = { {"device", "d" + std::to_string(i % 4)}, {"ts", i}, {"value", (i * 7) % 10} };
+        docs.emplace_back("r" + std::to_string(i), data);
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+    ASSERT_TRUE(readings->createIndex("device").ok());
+    ASSERT_TRUE(readings->createIndex("ts").ok());
+
+    // Pages of 7 chained by their tokens give the same ids, in the same order, as one unlimited find
+    auto readPages = [](const std::function<Status(const QueryOptions&, std::unique_ptr<QueryCursor>&)>& find,
+        QueryOptions options, std::vector<std::string>& ids) {
+        options.limit = 7;
+        for (int page = 0; page < 100; page++) {
+            std::unique_ptr<QueryCursor> cursor;
+            Status status = find(options, cursor);
+            if (!status.ok()) {
+                return status;
+            }
+            for (; cursor->isValid(); cursor->next()) {
+                ids.push_back(cursor->currentId());
+            }
+            // A full page keeps its token after the loop, an exhausted query has none
+            std::string token = cursor->continuationToken();
+            if (token.empty()) {
+                break;
+            }
+            options.continuation = token;
+        }
+        return Status::OK();
+    };
+    auto check = [&](const json& filter, const QueryOptions& options) {
+        std::unique_ptr<QueryCursor> cursor;
+        ASSERT_TRUE(readings->find(filter, cursor, options).ok());
+        std::vector<std::string> expected;
+        for (; cursor->isValid(); cursor->next()) {
+            expected.push_back(cursor->currentId());
+        }
+        std::vector<std::string> paged;
+        ASSERT_TRUE(readPages([&](const QueryOptions& o, std::unique_ptr<QueryCursor>& c) {
+            return readings->find(filter, c, o);
+        }, options, paged).ok());
+        EXPECT_FALSE(expected.empty()) << filter.dump();
+        EXPECT_EQ(paged, expected) << filter.dump();
+    };
+    QueryOptions unsorted;
+    check({ {"$gt", {{"ts", 20}}} }, unsorted);
+    check({ {"$in", {{"device", {"d3", "d1"}}}} }, unsorted);
+    check({ {"$and", { {{"$eq", {{"device", "d2"}}}}, {{"$lt", {{"ts", 70}}}} }} }, unsorted);
+    check({ {"$or", { {{"$eq", {{"device", "d2"}}}}, {{"$lt", {{"ts", 30}}}} }} }, unsorted);
+    check({ {"$eq", {{"value", 3}}} }, unsorted);
+    // Sorted by an index walk and by ranking the matches, ties on value are ordered by id
+    QueryOptions byTs;
+    byTs.sortField = "ts";
+    byTs.sortDescending = true;
+    check({ {"$eq", {{"device", "d1"}}} }, byTs);
+    QueryOptions byValue;
+    byValue.sortField = "value";
+    check({ {"$gte", {{"ts", 10}}} }, byValue);
+
+    // Prepared queries take the tokens of their runs
+    std::unique_ptr<PreparedQuery> query;
+    ASSERT_TRUE(readings->prepare({ {"$gte", {{"ts", {{"$param", "ts"}}}}} }, query).ok());
+    ASSERT_TRUE(query->bind("ts", 40).ok());
+    std::vector<std::string> paged;
+    ASSERT_TRUE(readPages([&](const QueryOptions& o, std::unique_ptr<QueryCursor>& c) {
+        return query->find(c, o);
+    }, QueryOptions(), paged).ok());
+    EXPECT_EQ(paged, readings->findDocument({ {"$gte", {{"ts", 40}}} }));
+
+    // Collection scan in id order
+    std::vector<Document> page;
+    std::vector<std::string> scanned;
+    std::string continuation;
+    do {
+        page.clear();
+        ASSERT_TRUE(readings->readAllDocuments(page, 30, continuation).ok());
+        for (Document& doc : page) {
+            scanned.push_back(doc.id());
+        }
+    } while (!continuation.empty());
+    std::vector<Document> all;
+    ASSERT_TRUE(readings->readAllDocuments(all, 1000).ok());
+    ASSERT_EQ(scanned.size(), all.size());
+    for (size_t i = 0; i < all.size(); i++) {
+        EXPECT_EQ(scanned[i], all[i].id());
+    }
+
+    QueryOptions invalid;
+    invalid.continuation = "not a token";
+    std::unique_ptr<QueryCursor> cursor;
+    EXPECT_FALSE(readings->find({ {"$gt", {{"ts", 20}}} }, cursor, invalid).ok());
+    continuation = "0";
+    EXPECT_FALSE(readings->readAllDocuments(page, 10, continuation).ok());
+}
+
 TEST_F(AnuDBTest, QueryOrOperatorRangeScan) {
     // Create indexes for faster queries
     products->createIndex("price");
@@ -930,7 +2142,14 @@ TEST_F(AnuDBTest, IndexCRUD) {
         EXPECT_TRUE(status.ok());
     }
     
-    // TODO: Add a way to check if indexes exist
+    // Indexes are listed from the index catalog
+    std::vector<std::string> indexes;
+    Status status = products->getIndex(indexes);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(indexes.size(), fieldsToIndex.size());
+    for (const auto& field : fieldsToIndex) {
+        EXPECT_TRUE(std::find(indexes.begin(), indexes.end(), field) != indexes.end());
+    }
     
     // Delete some indexes
     std::vector<std::string> fieldsToDelete = {"name", "rating"};
@@ -940,10 +2159,383 @@ TEST_F(AnuDBTest, IndexCRUD) {
         EXPECT_TRUE(status.ok());
     }
     
-    // TODO: Verify indexes are deleted
+    indexes.clear();
+    status = products->getIndex(indexes);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(indexes.size(), 2);
+    EXPECT_TRUE(std::find(indexes.begin(), indexes.end(), "price") != indexes.end());
+    EXPECT_TRUE(std::find(indexes.begin(), indexes.end(), "category") != indexes.end());
+
+    // An existing index is not created again, with or without other options
+    EXPECT_FALSE(products->createIndex("price").ok());
+    EXPECT_FALSE(products->createIndex("price", { {"include", {"name"}} }).ok());
+
+    // Index column families are not reported as collections
+    auto collectionNames = db->getCollectionNames();
+    EXPECT_EQ(collectionNames.size(), 1);
+
+    // The catalog survives a reopen and queries keep using its indexes
+    ASSERT_TRUE(db->close().ok());
+    ASSERT_TRUE(db->open().ok());
+    products = db->getCollection("products");
+    ASSERT_NE(products, nullptr);
+    indexes.clear();
+    ASSERT_TRUE(products->getIndex(indexes).ok());
+    EXPECT_EQ(indexes, std::vector<std::string>({ "category", "price" }));
+    json plan;
+    ASSERT_TRUE(products->explain({ {"$gt", {{"price", 500}}} }, plan).ok());
+    EXPECT_EQ(plan[0]["index"], "price");
+    EXPECT_EQ(products->findDocument({ {"$eq", {{"category", "Electronics"}}} }).size(), 2u);
+}
+
+TEST_F(AnuDBTest, IndexRebuiltFromOlderKeyLayout) {
+    // A database from before the catalog, its index keys are "value#docId"
+    std::string oldPath = "./test_old_layout_db";
+    removeDirectoryRecursive(oldPath);
+    {
+        StorageEngine engine(oldPath);
+        ASSERT_TRUE(engine.open().ok());
+        ASSERT_TRUE(engine.createCollection("items").ok());
+        ASSERT_TRUE(engine.createCollection("items__index__color").ok());
+        for (int i = 0; i < 30; i++) {
+            std::string id = "item" + std::to_string(i);
+            std::string color = i % 3 == 0 ? "red" : "blue";
+            Document doc(id, { {"_id", id}, {"color", color} });
+            ASSERT_TRUE(engine.put("items", id, doc.to_msgpack()).ok());
+            ASSERT_TRUE(engine.putIndex("items__index__color", color + "#" + id, id).ok());
+        }
+        ASSERT_TRUE(engine.dropCollection("__catalog__").ok());
+        ASSERT_TRUE(engine.close().ok());
+    }
+
+    // Opening the database rebuilds the index in the current layout, once
+    for (int reopen = 0; reopen < 2; reopen++) {
+        Database old(oldPath);
+        ASSERT_TRUE(old.open().ok());
+        Collection* items = old.getCollection("items");
+        ASSERT_NE(items, nullptr);
+        std::vector<std::string> indexes;
+        ASSERT_TRUE(items->getIndex(indexes).ok());
+        EXPECT_EQ(indexes, std::vector<std::string>({ "color" }));
+        json plan;
+        ASSERT_TRUE(items->explain({ {"$eq", {{"color", "red"}}} }, plan).ok());
+        EXPECT_EQ(plan[0]["index"], "color");
+        std::vector<std::string> red = items->findDocument({ {"$eq", {{"color", "red"}}} });
+        EXPECT_EQ(red.size(), 10u);
+        EXPECT_TRUE(std::find(red.begin(), red.end(), "item9") != red.end());
+        EXPECT_EQ(items->findDocument({ {"$gt", {{"color", "blue"}}} }), red);
+        ASSERT_TRUE(old.close().ok());
+    }
+    removeDirectoryRecursive(oldPath);
+}
+
+TEST_F(AnuDBTest, IndexMaintainedOnUpdateAndDelete) {
+    Status status = products->createIndex("category");
+    EXPECT_TRUE(status.ok());
+
+    // Moving a document to another category must drop its old index entry
+    json updateData = {
+        {"$set", {
+            {"category", "Refurbished"}
+        }}
+    };
+    status = products->updateDocument("prod001", updateData);
+    EXPECT_TRUE(status.ok());
+
+    std::vector<std::string> docIds = products->findDocument({ {"$eq", {{"category", "Electronics"}}} });
+    EXPECT_EQ(docIds.size(), 1);
+    EXPECT_EQ(docIds[0], "prod002");
+
+    docIds = products->findDocument({ {"$eq", {{"category", "Refurbished"}}} });
+    EXPECT_EQ(docIds.size(), 1);
+    EXPECT_EQ(docIds[0], "prod001");
+
+    // Deleting the document removes its index entry as well
+    status = products->deleteDocument("prod001");
+    EXPECT_TRUE(status.ok());
+    docIds = products->findDocument({ {"$eq", {{"category", "Refurbished"}}} });
+    EXPECT_TRUE(docIds.empty());
+}
+
+TEST_F(AnuDBTest, IndexValuesSharingPrefix) {
+    // Values that are prefixes of each other must not leak into each other's lookups
+    Status status = products->createIndex("code");
+    ASSERT_TRUE(status.ok());
+    std::vector<std::string> codes = { "a", "a!", "ab", "abc", "b" };
+    for (size_t i = 0; i < codes.size(); i++) {
+        Document doc("code" + std::to_string(i), { {"code", codes[i]} });
+        ASSERT_TRUE(products->createDocument(doc).ok());
+    }
+
+    std::vector<std::string> docIds = products->findDocument({ {"$eq", {{"code", "a"}}} });
+    ASSERT_EQ(docIds.size(), 1);
+    EXPECT_EQ(docIds[0], "code0");
+
+    docIds = products->findDocument({ {"$eq", {{"code", "ab"}}} });
+    ASSERT_EQ(docIds.size(), 1);
+    EXPECT_EQ(docIds[0], "code2");
+
+    docIds = products->findDocument({ {"$gt", {{"code", "a"}}} });
+    EXPECT_EQ(docIds.size(), 4);
+
+    docIds = products->findDocument({ {"$lt", {{"code", "ab"}}} });
+    EXPECT_EQ(docIds.size(), 2);
 }
 
 // Export/Import Tests
+TEST_F(AnuDBTest, NestedFieldIndex) {
+    ASSERT_TRUE(db->createCollection("devices").ok());
+    Collection* devices = db->getCollection("devices");
+    std::vector<Document> docs;
+    for (int i = 0; i < 40; i++) {
+        json data = {
+            {"name", "device" + std::to_string(i)},
+            {"metadata", {{"unique_id", "uid-" + std::to_string(i)}, {"site", "s" + std::to_string(i % 4)}}},
+            {"specs", {{"weight", i % 10}, {"brand", i % 2 == 0 ? "acme" : "globex"}}}
+        };
+        docs.emplace_back("dev" + std::to_string(i), data);
+    }
+    // Without the object, or with another value in its place, a document has no entry
+    docs.emplace_back("flat", json{ {"name", "flat"}, {"metadata", "none"} });
+    docs.emplace_back("bare", json{ {"name", "bare"} });
+    std::vector<Status> statuses;
+    ASSERT_TRUE(devices->insertMany(docs, statuses).ok());
+    devices->setQueryCacheCapacity(16);
+
+    // The filter is answered by a scan first, then by the index once it exists
+    json byId = { {"$eq", {{"metadata.unique_id", "uid-17"}}} };
+    EXPECT_EQ(devices->findDocument(byId), std::vector<std::string>({ "dev17" }));
+    ASSERT_TRUE(devices->createIndex("metadata.unique_id").ok());
+    ASSERT_TRUE(devices->createIndex({ "specs.brand", "specs.weight" }).ok());
+    json plan;
+    ASSERT_TRUE(devices->explain(byId, plan).ok());
+    EXPECT_EQ(plan[0]["index"], "metadata.unique_id");
+    EXPECT_EQ(devices->findDocument(byId), std::vector<std::string>({ "dev17" }));
+    EXPECT_EQ(devices->findDocument({ {"$gt", {{"metadata.unique_id", "uid-8"}}} }), std::vector<std::string>({ "dev9" }));
+    EXPECT_EQ(devices->findDocument({ {"$and", {
+        {{"$eq", {{"specs.brand", "acme"}}}},
+        {{"$eq", {{"specs.weight", 4}}}}
+    }} }), std::vector<std::string>({ "dev14", "dev24", "dev34", "dev4" }));
+    EXPECT_EQ(devices->findDocument({ {"$eq", {{"metadata.site", "s3"}}} }).size(), 10u);
+
+    // Updating the nested value moves its index entry and drops the cached result
+    ASSERT_TRUE(devices->updateDocument("dev17", { {"$set", {{"metadata.unique_id", "uid-moved"}}} }).ok());
+    EXPECT_TRUE(devices->findDocument(byId).empty());
+    EXPECT_EQ(devices->findDocument({ {"$eq", {{"metadata.unique_id", "uid-moved"}}} }), std::vector<std::string>({ "dev17" }));
+
+    // Projections and sorts on nested fields, the covered projection is rebuilt from the index entry
+    QueryOptions options;
+    options.projection = { "metadata.unique_id" };
+    options.sortField = "metadata.unique_id";
+    options.limit = 2;
+    std::unique_ptr<QueryCursor> cursor;
+    ASSERT_TRUE(devices->find({ {"$gte", {{"metadata.unique_id", "uid-2"}}} }, cursor, options).ok());
+    std::vector<json> found;
+    for (; cursor->isValid(); cursor->next()) {
+        Document doc;
+        ASSERT_TRUE(cursor->current(&doc).ok());
+        found.push_back(doc.data());
+    }
+    EXPECT_EQ(found, std::vector<json>({ {{"metadata", {{"unique_id", "uid-2"}}}}, {{"metadata", {{"unique_id", "uid-20"}}}} }));
+    options = QueryOptions();
+    options.sortField = "specs.weight";
+    options.sortDescending = true;
+    options.limit = 1;
+    ASSERT_TRUE(devices->find({ {"$eq", {{"specs.brand", "globex"}}} }, cursor, options).ok());
+    ASSERT_TRUE(cursor->isValid());
+    EXPECT_EQ(cursor->currentId(), "dev9");
+
+    // Aggregates and groups read nested values
+    json groups;
+    ASSERT_TRUE(devices->group(json::object(), "specs.brand", { {"total", {{"$sum", "specs.weight"}}} }, groups).ok());
+    EXPECT_EQ(groups, json::array({ {{"_id", "acme"}, {"total", 80}}, {{"_id", "globex"}, {"total", 100}} }));
+    json result;
+    ASSERT_TRUE(devices->aggregate({ {"$eq", {{"metadata.site", "s1"}}} }, { {"heaviest", {{"$max", "specs.weight"}}} }, result).ok());
+    EXPECT_EQ(result["heaviest"], 9);
+}
+
+TEST_F(AnuDBTest, MultikeyArrayIndex) {
+    ASSERT_TRUE(db->createCollection("sensors").ok());
+    Collection* sensors = db->getCollection("sensors");
+    std::vector<Document> docs;
+    for (int i = 0; i < 30; i++) {
+        json tags = json::array({ "site" + std::to_string(i % 3), i % 2 == 0 ? "even" : "odd" });
+        docs.emplace_back("s" + std::to_string(i), json{ {"tags", tags}, {"readings", {i, i + 10, i}} });
+    }
+    // Repeated elements give one entry, an empty array none, a scalar its own entry
+    docs.emplace_back("dup", json{ {"tags", {"even", "even", "site0"}}, {"readings", json::array()} });
+    docs.emplace_back("scalar", json{ {"tags", "odd"}, {"readings", 5} });
+    std::vector<Status> statuses;
+    ASSERT_TRUE(sensors->insertMany(docs, statuses).ok());
+
+    // A scan compares each element, the multikey index gives the same matches
+    json site1 = { {"$eq", {{"tags", "site1"}}} };
+    json evenOrSite0 = { {"$in", {{"tags", {"even", "site0"}}}} };
+    json readings = { {"$between", {{"readings", {12, 14}}}} };
+    std::vector<std::string> scanSite1 = sensors->findDocument(site1);
+    std::vector<std::string> scanEvenOrSite0 = sensors->findDocument(evenOrSite0);
+    std::vector<std::string> scanReadings = sensors->findDocument(readings);
+    EXPECT_EQ(scanSite1.size(), 10u);
+    EXPECT_EQ(scanEvenOrSite0.size(), 21u);
+    EXPECT_EQ(scanReadings, std::vector<std::string>({ "s12", "s13", "s14", "s2", "s3", "s4" }));
+    EXPECT_FALSE(sensors->createIndex("tags", { {"multikey", "yes"} }).ok());
+    EXPECT_FALSE(sensors->createIndex("tags,readings", { {"multikey", true} }).ok());
+    ASSERT_TRUE(sensors->createIndex("tags", { {"multikey", true} }).ok());
+    ASSERT_TRUE(sensors->createIndex("readings", { {"multikey", true} }).ok());
+    json plan;
+    ASSERT_TRUE(sensors->explain(site1, plan).ok());
+    EXPECT_EQ(plan[0]["index"], "tags");
+    EXPECT_EQ(sensors->findDocument(site1), scanSite1);
+    EXPECT_EQ(sensors->findDocument(evenOrSite0), scanEvenOrSite0);
+    EXPECT_EQ(sensors->findDocument(readings), scanReadings);
+    EXPECT_EQ(sensors->findDocument({ {"$and", {
+        {{"$eq", {{"tags", "odd"}}}},
+        {{"$eq", {{"tags", "site1"}}}}
+    }} }).size(), 5u);
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "odd"}}} }).size(), 16u);
+
+    // $push and $pull add and remove the entry of the element
+    ASSERT_TRUE(sensors->updateDocument("s1", { {"$push", {{"tags", "faulty"}}} }).ok());
+    ASSERT_TRUE(sensors->updateDocument("s2", { {"$pull", {{"tags", "site2"}}} }).ok());
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "faulty"}}} }), std::vector<std::string>({ "s1" }));
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "site2"}}} }).size(), 9u);
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "even"}}} }).size(), 16u);
+    ASSERT_TRUE(sensors->updateDocument("dup", { {"$pull", {{"tags", "even"}}} }).ok());
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "even"}}} }).size(), 15u);
+
+    // The option is kept across a reopen, deleting a document removes every entry
+    ASSERT_TRUE(db->close().ok());
+    ASSERT_TRUE(db->open().ok());
+    sensors = db->getCollection("sensors");
+    std::vector<std::string> indexes;
+    ASSERT_TRUE(sensors->getIndex(indexes).ok());
+    EXPECT_TRUE(std::find(indexes.begin(), indexes.end(), "tags") != indexes.end());
+    ASSERT_TRUE(sensors->explain(site1, plan).ok());
+    EXPECT_EQ(plan[0]["index"], "tags");
+    ASSERT_TRUE(sensors->updateDocument("s1", { {"$pull", {{"tags", "faulty"}}} }).ok());
+    EXPECT_TRUE(sensors->findDocument({ {"$eq", {{"tags", "faulty"}}} }).empty());
+    ASSERT_TRUE(sensors->deleteDocument("s4").ok());
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "site1"}}} }).size(), 9u);
+    EXPECT_EQ(sensors->findDocument({ {"$eq", {{"tags", "even"}}} }).size(), 14u);
+
+    // Projections read the array from the document, the index does not order the field
+    QueryOptions options;
+    options.projection = { "tags" };
+    std::unique_ptr<QueryCursor> cursor;
+    ASSERT_TRUE(sensors->find({ {"$eq", {{"tags", "site0"}}} }, cursor, options).ok());
+    ASSERT_TRUE(cursor->isValid());
+    Document doc;
+    ASSERT_TRUE(cursor->current(&doc).ok());
+    EXPECT_EQ(doc.data(), json({ {"tags", {"site0"}} }));
+    EXPECT_FALSE(sensors->find({ {"$orderBy", {{"tags", "asc"}}} }, cursor).ok());
+}
+
+TEST_F(AnuDBTest, ParallelRangeScans) {
+    // Enough data for the scans to be split into several ranges
+    ASSERT_TRUE(db->createCollection("readings").ok());
+    Collection* readings = db->getCollection("readings");
+    std::vector<Document> docs;
+    const std::string padding(400, 'x');
+    for (int i = 0; i < 6000; i++) {
+        char id[16];
+        snprintf(id, sizeof(id), "r%05d", i);
+        json data = { {"ts", 6000 - i}, {"odd", i % 2 == 1}, {"padding", padding} };
+        docs.emplace_back(id, data);
+    }
+    std::vector<Status> statuses;
+    ASSERT_TRUE(readings->insertMany(docs, statuses).ok());
+    ASSERT_TRUE(readings->createIndex("ts").ok());
+
+    // Index range in value order, collection scan in id order
+    std::vector<std::string> expected;
+    for (int i = 4999; i >= 0; i--) {
+        expected.push_back(docs[i].id());
+    }
+    EXPECT_EQ(readings->findDocument({ {"$gt", {{"ts", 1000}}} }), expected);
+    expected.clear();
+    for (int i = 1; i < 6000; i += 2) {
+        expected.push_back(docs[i].id());
+    }
+    EXPECT_EQ(readings->findDocument({ {"$eq", {{"odd", true}}} }), expected);
+
+    // The engine splits a large key range into balanced parts and merges them in key order
+    std::string enginePath = "./test_parallel_scan_db";
+    removeDirectoryRecursive(enginePath);
+    {
+        StorageEngine engine(enginePath);
+        ASSERT_TRUE(engine.open().ok());
+        ASSERT_TRUE(engine.createCollection("values").ok());
+        for (const Document& doc : docs) {
+            ASSERT_TRUE(engine.put("values", doc.id(), doc.to_msgpack()).ok());
+        }
+        // Split points are weighed on SST sizes, flushing keeps them from depending on background flushes
+        ASSERT_TRUE(engine.getDB()->Flush(rocksdb::FlushOptions(), engine.getColumnFamilies()["values"]).ok());
+        std::vector<std::string> splits = engine.splitKeyRange("values", "", "", 4);
+        EXPECT_GE(splits.size(), 2u);
+        EXPECT_TRUE(std::is_sorted(splits.begin(), splits.end()));
+
+        // The ranges between the split points cover every key once
+        std::vector<std::vector<std::string>> rangeKeys(splits.size() + 1);
+        ASSERT_TRUE(engine.scanRanges("values", "", "", splits, [&rangeKeys](size_t range, rocksdb::Iterator* iterator) {
+            for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
+                rangeKeys[range].push_back(iterator->key().ToString());
+            }
+            return Status::OK();
+        }).ok());
+        std::vector<std::string> allKeys;
+        for (const std::vector<std::string>& keys : rangeKeys) {
+            allKeys.insert(allKeys.end(), keys.begin(), keys.end());
+        }
+        ASSERT_EQ(allKeys.size(), docs.size());
+        for (size_t i = 0; i < docs.size(); i++) {
+            EXPECT_EQ(allKeys[i], docs[i].id());
+        }
+        EXPECT_TRUE(engine.splitKeyRange("values", "r01000", "r01010", 4).empty());
+
+        auto keyOf = [](const rocksdb::Slice& key, const rocksdb::Slice&, std::string& result) {
+            result = key.ToString();
+            return true;
+        };
+        std::vector<std::string> ordered;
+        ASSERT_TRUE(engine.parallelScan("values", "r00100", "r05900", 4, true, keyOf, ordered).ok());
+        std::vector<std::string> unordered;
+        ASSERT_TRUE(engine.parallelScan("values", "r00100", "r05900", 4, false, keyOf, unordered).ok());
+        ASSERT_EQ(ordered.size(), 5800u);
+        EXPECT_EQ(ordered.front(), "r00100");
+        EXPECT_TRUE(std::is_sorted(ordered.begin(), ordered.end()));
+        std::sort(unordered.begin(), unordered.end());
+        EXPECT_EQ(unordered, ordered);
+
+        // Concurrent scans share the engine's workers and each gets all of its ranges
+        std::vector<std::vector<std::string>> concurrent(8);
+        std::vector<std::thread> scans;
+        for (size_t i = 0; i < concurrent.size(); i++) {
+            scans.emplace_back([&engine, &keyOf, &concurrent, i]() {
+                engine.parallelScan("values", "r00100", "r05900", 4, true, keyOf, concurrent[i]);
+            });
+        }
+        for (std::thread& scan : scans) {
+            scan.join();
+        }
+        for (const std::vector<std::string>& keys : concurrent) {
+            EXPECT_EQ(keys, ordered);
+        }
+
+        std::vector<std::vector<uint8_t>> values;
+        ASSERT_TRUE(engine.getAll("values", values).ok());
+        ASSERT_EQ(values.size(), docs.size());
+        EXPECT_EQ(values[1234], docs[1234].to_msgpack());
+
+        ASSERT_TRUE(engine.exportAllToJson("values", enginePath + "/export/").ok());
+        std::ifstream exported(enginePath + "/export/values.json");
+        json array = json::parse(exported);
+        ASSERT_EQ(array.size(), docs.size());
+        EXPECT_EQ(array[4321], docs[4321].data());
+        ASSERT_TRUE(engine.close().ok());
+    }
+    removeDirectoryRecursive(enginePath);
+}
+
 TEST_F(AnuDBTest, ExportDocuments) {
     std::string exportPath = "./test_export/";
     Status status = db->exportAllToJsonAsync("products", exportPath);